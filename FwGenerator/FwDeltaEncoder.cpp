@@ -0,0 +1,207 @@
+//
+//  FwDeltaEncoder.cpp
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include <string.h>
+#include "FwDeltaEncoder.h"
+#include "FwDelta.h"
+#include "FwLz.h"
+
+#define KEY_LEN         8
+#define MIN_COPY        12      /* shorter copies cost more than literals */
+#define HASH_LOG        20
+#define MAX_CHAIN       64
+/* A copy from a base block the driver does not hold decoded costs a whole
+ * block decode, only long ones are worth it.
+ */
+#define FAR_COPY        64
+
+static uint32_t hashKey(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return (uint32_t)((v * 0x9e3779b97f4a7c15ull) >> (64 - HASH_LOG));
+}
+
+static void writeVarint(std::vector<uint8_t> &out, uint32_t v)
+{
+    while (v >= 0x80) {
+        out.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+}
+
+static void writeLiterals(std::vector<uint8_t> &out, const uint8_t *p, uint32_t length)
+{
+    if (!length) {
+        return;
+    }
+    writeVarint(out, length << 1);
+    out.insert(out.end(), p, p + length);
+}
+
+static void writeCopy(std::vector<uint8_t> &out, uint32_t length, int32_t skew)
+{
+    writeVarint(out, (length << 1) | 1);
+    writeVarint(out, ((uint32_t)skew << 1) ^ (uint32_t)(skew >> 31));
+}
+
+/* Mirrors the decoded block windows FwBlockReader keeps for the base */
+class WindowCache {
+
+public:
+
+    WindowCache()
+    {
+        for (int i = 0; i < FW_LZ_BLOCK_WINDOWS; i++) {
+            blocks[i] = -1;
+        }
+    }
+
+    bool holds(uint32_t start, uint32_t length) const
+    {
+        return holdsBlock(start / FW_LZ_BLOCK_SIZE) && holdsBlock((start + length - 1) / FW_LZ_BLOCK_SIZE);
+    }
+
+    void touch(uint32_t start, uint32_t length)
+    {
+        touchBlock(start / FW_LZ_BLOCK_SIZE);
+        touchBlock((start + length - 1) / FW_LZ_BLOCK_SIZE);
+    }
+
+private:
+
+    bool holdsBlock(int block) const
+    {
+        for (int i = 0; i < FW_LZ_BLOCK_WINDOWS; i++) {
+            if (blocks[i] == block) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void touchBlock(int block)
+    {
+        int i = 0;
+        while (i < FW_LZ_BLOCK_WINDOWS - 1 && blocks[i] != block) {
+            i++;
+        }
+        for (; i > 0; i--) {
+            blocks[i] = blocks[i - 1];
+        }
+        blocks[0] = block;
+    }
+
+private:
+    int blocks[FW_LZ_BLOCK_WINDOWS];
+};
+
+void FwDeltaEncode(const std::vector<uint8_t> &base, const std::vector<uint8_t> &target, std::vector<uint8_t> &delta)
+{
+    const uint8_t *b = base.data();
+    const uint8_t *t = target.data();
+    uint32_t bsize = (uint32_t)base.size();
+    uint32_t tsize = (uint32_t)target.size();
+    std::vector<int> head(1 << HASH_LOG, -1);
+    std::vector<int> chain(bsize, -1);
+    for (uint32_t i = 0; i + KEY_LEN <= bsize; i++) {
+        uint32_t h = hashKey(b + i);
+        chain[i] = head[h];
+        head[h] = i;
+    }
+
+    WindowCache windows;
+    uint32_t anchor = 0;
+    uint32_t pos = 0;
+    uint32_t copyEnd = 0;
+    while (pos + KEY_LEN <= tsize) {
+        uint32_t bestLen = 0;
+        uint32_t bestSrc = 0;
+        uint32_t bestBack = 0;
+        /* Following the previous copy is free, try it first */
+        if (copyEnd < bsize) {
+            uint32_t len = 0;
+            while (pos + len < tsize && copyEnd + len < bsize && t[pos + len] == b[copyEnd + len]) {
+                len++;
+            }
+            if (len >= KEY_LEN) {
+                bestLen = len;
+                bestSrc = copyEnd;
+            }
+        }
+        int candidate = head[hashKey(t + pos)];
+        for (int depth = 0; candidate >= 0 && depth < MAX_CHAIN; depth++) {
+            uint32_t len = 0;
+            while (pos + len < tsize && candidate + len < bsize && t[pos + len] == b[candidate + len]) {
+                len++;
+            }
+            uint32_t back = 0;
+            while (back < pos - anchor && back < (uint32_t)candidate &&
+                   t[pos - back - 1] == b[candidate - back - 1]) {
+                back++;
+            }
+            if (len + back < FAR_COPY && !windows.holds(candidate - back, len + back)) {
+                candidate = chain[candidate];
+                continue;
+            }
+            if (len + back > bestLen + bestBack + 1) {
+                bestLen = len;
+                bestSrc = candidate;
+                bestBack = back;
+            }
+            candidate = chain[candidate];
+        }
+        if (bestLen + bestBack < MIN_COPY) {
+            pos++;
+            continue;
+        }
+        uint32_t start = pos - bestBack;
+        uint32_t src = bestSrc - bestBack;
+        writeLiterals(delta, t + anchor, start - anchor);
+        writeCopy(delta, bestLen + bestBack, (int32_t)(src - copyEnd));
+        windows.touch(src, bestLen + bestBack);
+        pos += bestLen;
+        anchor = pos;
+        copyEnd = src + bestLen + bestBack;
+    }
+    writeLiterals(delta, t + anchor, tsize - anchor);
+}
+
+bool FwDeltaApply(const std::vector<uint8_t> &base, const std::vector<uint8_t> &delta, std::vector<uint8_t> &target, size_t length)
+{
+    target.clear();
+    uint32_t pos = 0;
+    uint32_t copyEnd = 0;
+    while (pos < delta.size()) {
+        FwDeltaOp op;
+        int len = FwDeltaReadOp(&delta[pos], (uint32_t)delta.size() - pos, &op);
+        if (len < 0) {
+            return false;
+        }
+        pos += len;
+        if (op.copy) {
+            uint32_t src = copyEnd + op.skew;
+            if (src > base.size() || base.size() - src < op.length) {
+                return false;
+            }
+            target.insert(target.end(), base.begin() + src, base.begin() + src + op.length);
+            copyEnd = src + op.length;
+        } else {
+            if (delta.size() - pos < op.length) {
+                return false;
+            }
+            target.insert(target.end(), delta.begin() + pos, delta.begin() + pos + op.length);
+            pos += op.length;
+        }
+        if (target.size() > length) {
+            return false;
+        }
+    }
+    return target.size() == length;
+}
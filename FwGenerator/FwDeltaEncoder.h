@@ -0,0 +1,22 @@
+//
+//  FwDeltaEncoder.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef FwDeltaEncoder_h
+#define FwDeltaEncoder_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* Encodes target as the op list described in FwDelta.h against base */
+void FwDeltaEncode(const std::vector<uint8_t> &base, const std::vector<uint8_t> &target, std::vector<uint8_t> &delta);
+
+/* Rebuilds a whole image, used to verify the round trip */
+bool FwDeltaApply(const std::vector<uint8_t> &base, const std::vector<uint8_t> &delta, std::vector<uint8_t> &target, size_t length);
+
+#endif /* FwDeltaEncoder_h */
@@ -0,0 +1,846 @@
+//
+//  FwGenerator.cpp
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+//  Host tool run by fw_gen.sh, packs the images in IntelBluetoothFirmware/fw
+//  together with everything the driver can know about them before a
+//  controller shows up into the container described in FwContainer.h.
+//  FwPayload.S pulls the container into the kext with an .incbin, so it
+//  never passes through the C++ compiler.
+//
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "FWData.h"
+#include "FwLzEncoder.h"
+#include "FwDeltaEncoder.h"
+
+struct FwImage {
+    std::string path;
+    std::string name;
+    std::vector<uint8_t> data;
+    std::vector<FwFragment> plan;
+    uint32_t bootParam;
+    std::vector<FwPatchCommand> patch;
+    uint64_t hash;
+    int alias;              /* index of the image holding the same bytes */
+    int base;               /* index of the image this one is a delta of */
+    uint16_t kind;          /* identity key the driver looks it up by */
+    uint64_t key;
+    std::vector<uint8_t> delta;
+    std::vector<uint8_t> stored;    /* what ends up in the kext */
+    uint32_t checksum;
+    size_t offset;                  /* of stored in the container */
+    size_t planIndex;
+    size_t patchIndex;
+};
+
+/* What each hw_variant would cost on its own, for FW_VARIANTS builds */
+struct FwVariantSize {
+    size_t images;
+    size_t raw;
+    size_t stored;
+    std::set<uint64_t> hashes;
+};
+
+static bool endsWith(const std::string &s, const char *suffix)
+{
+    size_t len = strlen(suffix);
+    return s.size() >= len && s.compare(s.size() - len, len, suffix) == 0;
+}
+
+static bool readFile(const char *path, std::vector<uint8_t> &out)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return false;
+    }
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        out.insert(out.end(), buf, buf + n);
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+/* FNV-1a, only used to find candidates, duplicates are confirmed by
+ * comparing the bytes.
+ */
+static uint64_t contentHash(const std::vector<uint8_t> &data)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < data.size(); i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static std::string extension(const std::string &name)
+{
+    size_t dot = name.find_last_of('.');
+    return dot == std::string::npos ? std::string() : name.substr(dot);
+}
+
+/* Recovers the hardware identity from the file name, the same tuples the
+ * driver reads back from the controller.
+ */
+static bool parseKey(FwImage &image)
+{
+    const char *name = image.name.c_str();
+    unsigned int v[8];
+    int end = 0;
+    if (sscanf(name, "ibt-hw-%x.%x.%x-fw-%x.%x.%x.%x.%x.bseq%n",
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &end) == 8 && !name[end]) {
+        image.kind = kFwKeyBseq;
+        image.key = FwKeyBseq(v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7]);
+        return v[0] <= 0xff && v[1] <= 0xff && v[2] <= 0xff && v[3] <= 0xff &&
+        v[4] <= 0xff && v[5] <= 0xff && v[6] <= 0xff && v[7] <= 0xff;
+    }
+    end = 0;
+    if (sscanf(name, "ibt-hw-%x.%x.bseq%n", &v[0], &v[1], &end) == 2 && !name[end]) {
+        image.kind = kFwKeyBseqDefault;
+        image.key = FwKeyBseqDefault(v[0], v[1]);
+        return v[0] <= 0xff && v[1] <= 0xff;
+    }
+    end = 0;
+    if (sscanf(name, "ibt-%u-%u-%u.sfi%n", &v[0], &v[1], &v[2], &end) == 3 && !name[end]) {
+        image.kind = kFwKeySfi;
+        image.key = FwKeySfi(v[0], v[1], v[2]);
+        return v[0] <= 0xff && v[1] <= 0xff && v[2] <= 0xff;
+    }
+    end = 0;
+    if (sscanf(name, "ibt-%u-%u.sfi%n", &v[0], &v[1], &end) == 2 && !name[end]) {
+        image.kind = kFwKeySfiRevId;
+        image.key = FwKeySfiRevId(v[0], v[1]);
+        return v[0] <= 0xff && v[1] <= 0xffff;
+    }
+    return false;
+}
+
+/* Finds a seed that puts every key in its own slot of the smallest power
+ * of two table at least twice the number of keys.
+ */
+static bool buildKeyTable(const std::vector<FwImage> &images, std::vector<FwKeySlot> &table, uint32_t *seed)
+{
+    size_t size = 16;
+    while (size < images.size() * 2) {
+        size <<= 1;
+    }
+    for (; size <= 1 << 16; size <<= 1) {
+        for (uint32_t s = 1; s < 1 << 20; s++) {
+            table.assign(size, FwKeySlot());
+            bool collision = false;
+            for (size_t i = 0; i < images.size() && !collision; i++) {
+                FwKeySlot &slot = table[FwKeyHash(images[i].kind, images[i].key, s) & (size - 1)];
+                collision = slot.kind != kFwKeyNone;
+                slot.key = images[i].key;
+                slot.kind = images[i].kind;
+                slot.index = (uint16_t)i;
+            }
+            if (!collision) {
+                *seed = s;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static const FwImage *lookupByName(const std::vector<FwImage> &images, const char *name)
+{
+    for (size_t i = 0; i < images.size(); i++) {
+        if (strcmp(images[i].name.c_str(), name) == 0) {
+            return &images[i];
+        }
+    }
+    return NULL;
+}
+
+static const FwImage *lookupByKey(const std::vector<FwImage> &images, const std::vector<FwKeySlot> &table,
+                                  uint32_t seed, uint16_t kind, uint64_t key)
+{
+    const FwKeySlot &slot = table[FwKeyHash(kind, key, seed) & (table.size() - 1)];
+    return slot.kind == kind && slot.key == key ? &images[slot.index] : NULL;
+}
+
+/* Compares the name scan the driver used to do, including the snprintf
+ * that built the name, against a probe of the key table.
+ */
+static void benchmarkLookup(const std::vector<FwImage> &images, const std::vector<FwKeySlot> &table, uint32_t seed)
+{
+    const int rounds = 200000;
+    char name[64];
+    size_t found = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        const FwImage &image = images[r % images.size()];
+        snprintf(name, sizeof(name), "%s", image.name.c_str());
+        found += lookupByName(images, name) != NULL;
+    }
+    std::chrono::duration<double> byName = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        const FwImage &image = images[r % images.size()];
+        found += lookupByKey(images, table, seed, image.kind, image.key) != NULL;
+    }
+    std::chrono::duration<double> byKey = std::chrono::steady_clock::now() - start;
+    printf("FwGenerator: lookup %.1f ns by name, %.1f ns by key (%zu hits)\n",
+           byName.count() * 1e9 / rounds, byKey.count() * 1e9 / rounds, found);
+}
+
+static bool planImage(FwImage &image)
+{
+    FwFragmentPlanner planner(image.data.data(), (uint32_t)image.data.size());
+    FwFragment fragment;
+    while (planner.next(&fragment)) {
+        image.plan.push_back(fragment);
+    }
+    if (planner.isCorrupted()) {
+        fprintf(stderr, "error: %s: corrupted command stream near fragment %u\n",
+                image.path.c_str(), planner.fragmentCount());
+        return false;
+    }
+    image.bootParam = planner.bootParam();
+    return true;
+}
+
+static bool indexPatch(FwImage &image)
+{
+    FwPatchIndexer indexer(image.data.data(), (uint32_t)image.data.size());
+    FwPatchCommand command;
+    while (indexer.next(&command)) {
+        image.patch.push_back(command);
+    }
+    if (indexer.isCorrupted()) {
+        fprintf(stderr, "error: %s: corrupted patch record at offset %u\n",
+                image.path.c_str(), indexer.position());
+        return false;
+    }
+    return true;
+}
+
+static size_t storedSize(const std::vector<uint8_t> &stream, bool pack)
+{
+    if (!pack) {
+        return stream.size();
+    }
+    std::vector<uint8_t> packed;
+    FwLzEncodeImage(stream, packed);
+    return packed.size();
+}
+
+/* Parses FW_VARIANTS, hw_variant values separated by spaces or commas */
+static bool parseVariants(const char *list, std::set<int> &variants)
+{
+    while (*list) {
+        if (*list == ' ' || *list == ',') {
+            list++;
+            continue;
+        }
+        char *end;
+        unsigned long v = strtoul(list, &end, 0);
+        if (end == list || v > 0xff) {
+            return false;
+        }
+        variants.insert((int)v);
+        list = end;
+    }
+    return !variants.empty();
+}
+
+static void countVariant(std::map<int, FwVariantSize> &sizes, const FwImage &image, bool pack)
+{
+    FwVariantSize &size = sizes[FwKeyVariant(image.kind, image.key)];
+    size.images++;
+    if (size.hashes.insert(image.hash).second) {
+        size.raw += image.data.size();
+        size.stored += storedSize(image.data, pack);
+    }
+}
+
+/* Picks which images are kept whole and which become a delta against one
+ * of them. Deltas are never chained, so every set of bases is tried for
+ * each kind of image, there are only a handful of unique ones. Returns
+ * the bytes saved.
+ */
+static size_t selectBases(std::vector<FwImage> &images, bool pack)
+{
+    std::map<std::string, std::vector<int> > kinds;
+    for (size_t i = 0; i < images.size(); i++) {
+        if (images[i].alias < 0) {
+            kinds[extension(images[i].name)].push_back((int)i);
+        }
+    }
+    size_t saved = 0;
+    for (auto it = kinds.begin(); it != kinds.end(); ++it) {
+        const std::vector<int> &members = it->second;
+        size_t n = members.size();
+        if (n < 2 || n > 16) {
+            continue;
+        }
+        std::vector<size_t> alone(n);
+        std::vector<std::vector<size_t> > cost(n, std::vector<size_t>(n, SIZE_MAX));
+        for (size_t t = 0; t < n; t++) {
+            alone[t] = storedSize(images[members[t]].data, pack);
+            for (size_t b = 0; b < n; b++) {
+                if (b != t) {
+                    std::vector<uint8_t> delta;
+                    FwDeltaEncode(images[members[b]].data, images[members[t]].data, delta);
+                    cost[b][t] = storedSize(delta, pack);
+                }
+            }
+        }
+        uint32_t bestMask = 0;
+        size_t bestTotal = SIZE_MAX;
+        for (uint32_t mask = 1; mask < (1u << n); mask++) {
+            size_t total = 0;
+            for (size_t t = 0; t < n; t++) {
+                size_t best = alone[t];
+                for (size_t b = 0; !(mask & (1u << t)) && b < n; b++) {
+                    if ((mask & (1u << b)) && cost[b][t] < best) {
+                        best = cost[b][t];
+                    }
+                }
+                total += best;
+            }
+            if (total < bestTotal) {
+                bestTotal = total;
+                bestMask = mask;
+            }
+        }
+        for (size_t t = 0; t < n; t++) {
+            if (bestMask & (1u << t)) {
+                continue;
+            }
+            size_t best = alone[t];
+            int base = -1;
+            for (size_t b = 0; b < n; b++) {
+                if ((bestMask & (1u << b)) && cost[b][t] < best) {
+                    best = cost[b][t];
+                    base = members[b];
+                }
+            }
+            if (base >= 0) {
+                images[members[t]].base = base;
+                saved += alone[t] - best;
+            }
+        }
+    }
+    return saved;
+}
+
+static bool storeImage(FwImage &image, const std::vector<FwImage> &images, bool pack)
+{
+    if (image.base >= 0) {
+        const FwImage &base = images[image.base];
+        FwDeltaEncode(base.data, image.data, image.delta);
+        std::vector<uint8_t> check;
+        if (!FwDeltaApply(base.data, image.delta, check, image.data.size()) || check != image.data) {
+            fprintf(stderr, "error: %s: delta against %s does not apply back\n",
+                    image.path.c_str(), base.name.c_str());
+            return false;
+        }
+    }
+    const std::vector<uint8_t> &stream = image.base >= 0 ? image.delta : image.data;
+    if (!pack) {
+        image.stored = stream;
+        return true;
+    }
+    FwLzEncodeImage(stream, image.stored);
+    std::vector<uint8_t> check;
+    if (!FwLzDecodeImage(image.stored, check, stream.size()) || check != stream) {
+        fprintf(stderr, "error: %s: packed image does not decode back\n", image.path.c_str());
+        return false;
+    }
+    return true;
+}
+
+static void loadStream(const FwImage &image, bool pack, std::vector<uint8_t> &out)
+{
+    if (pack) {
+        FwLzDecodeImage(image.stored, out, image.base >= 0 ? image.delta.size() : image.data.size());
+    } else {
+        out = image.stored;
+    }
+}
+
+/* Rebuilds every image in the list a few times the way the driver does,
+ * unpacking the stored stream and applying deltas to their unpacked base,
+ * to report what that costs per megabyte.
+ */
+static double rebuildThroughput(const std::vector<FwImage> &images, bool pack)
+{
+    const int rounds = 8;
+    size_t bytes = 0;
+    std::vector<uint8_t> stream, base, out;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < images.size(); i++) {
+            const FwImage &image = images[i].alias >= 0 ? images[images[i].alias] : images[i];
+            loadStream(image, pack, stream);
+            if (image.base >= 0) {
+                loadStream(images[image.base], pack, base);
+                FwDeltaApply(base, stream, out, image.data.size());
+            }
+            bytes += image.data.size();
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() > 0 ? bytes / elapsed.count() / (1024 * 1024) : 0;
+}
+
+/* Recorded so the images can be checked outside the build and resources
+ * before the driver takes them.
+ */
+static uint32_t crc32(const std::vector<uint8_t> &data)
+{
+    return FwCrc32(0, data.data(), data.size());
+}
+
+static size_t alignUp(size_t value, size_t align)
+{
+    return (value + align - 1) / align * align;
+}
+
+/* Lays out the container described in FwContainer.h */
+static bool buildContainer(std::vector<FwImage> &images, const std::vector<FwKeySlot> &keyTable, uint32_t keySeed,
+                           bool pack, bool onDemand, bool slim, std::vector<uint8_t> &out)
+{
+    FwContainerHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = FW_CONTAINER_MAGIC;
+    header.version = FW_CONTAINER_VERSION;
+    header.flags = slim ? kFwContainerSlim : 0;
+    header.headerSize = sizeof(FwContainerHeader);
+    header.entryCount = (uint32_t)images.size();
+    header.entrySize = sizeof(FwContainerEntry);
+    header.entryOffset = sizeof(FwContainerHeader);
+    header.keyOffset = (uint32_t)alignUp(header.entryOffset + images.size() * sizeof(FwContainerEntry), 8);
+    header.keyCount = (uint32_t)keyTable.size();
+    header.keySeed = keySeed;
+    header.planOffset = header.keyOffset + header.keyCount * sizeof(FwKeySlot);
+    size_t planCount = 0;
+    size_t patchCount = 0;
+    for (size_t i = 0; i < images.size(); i++) {
+        FwImage &image = images[i];
+        if (image.alias < 0) {
+            image.planIndex = planCount;
+            image.patchIndex = patchCount;
+            planCount += image.plan.size();
+            patchCount += image.patch.size();
+        }
+    }
+    header.planCount = (uint32_t)planCount;
+    header.patchOffset = (uint32_t)(header.planOffset + planCount * sizeof(FwFragment));
+    header.patchCount = (uint32_t)patchCount;
+    size_t offset = alignUp(header.patchOffset + patchCount * sizeof(FwPatchCommand), FW_CONTAINER_ALIGN);
+    header.payloadOffset = (uint32_t)offset;
+    for (size_t i = 0; i < images.size(); i++) {
+        FwImage &image = images[i];
+        if (image.alias < 0) {
+            image.offset = onDemand ? 0 : offset;
+            offset = onDemand ? offset : alignUp(offset + image.stored.size(), FW_CONTAINER_ALIGN);
+        }
+    }
+    if (offset > UINT32_MAX) {
+        fprintf(stderr, "error: firmware container exceeds 4 GB\n");
+        return false;
+    }
+    header.length = (uint32_t)offset;
+
+    out.assign(offset, 0);
+    memcpy(&out[0], &header, sizeof(header));
+    for (size_t i = 0; i < images.size(); i++) {
+        const FwImage &image = images[i].alias >= 0 ? images[images[i].alias] : images[i];
+        FwContainerEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        if (images[i].name.size() >= sizeof(entry.name)) {
+            fprintf(stderr, "error: %s: name too long for the container\n", images[i].name.c_str());
+            return false;
+        }
+        memcpy(entry.name, images[i].name.c_str(), images[i].name.size());
+        entry.type = endsWith(image.name, ".sfi") ? kFwImageSfi : kFwImageBseq;
+        entry.keyKind = images[i].kind;
+        entry.flags = onDemand ? kFwEntryResource : 0;
+        entry.key = images[i].key;
+        entry.offset = (uint32_t)image.offset;
+        entry.storedLength = (uint32_t)image.stored.size();
+        entry.length = (uint32_t)image.data.size();
+        entry.packedLength = pack ? (uint32_t)image.stored.size() : 0;
+        entry.base = image.base >= 0 ? (uint32_t)image.base : FW_CONTAINER_NO_BASE;
+        entry.deltaLength = image.base >= 0 ? (uint32_t)image.delta.size() : 0;
+        entry.checksum = image.checksum;
+        entry.plan = (uint32_t)image.planIndex;
+        entry.planCount = (uint32_t)image.plan.size();
+        entry.bootParam = image.bootParam;
+        entry.patch = (uint32_t)image.patchIndex;
+        entry.patchCount = (uint32_t)image.patch.size();
+        memcpy(&out[header.entryOffset + i * sizeof(entry)], &entry, sizeof(entry));
+        if (images[i].alias < 0) {
+            if (!image.plan.empty()) {
+                memcpy(&out[header.planOffset + image.planIndex * sizeof(FwFragment)],
+                       image.plan.data(), image.plan.size() * sizeof(FwFragment));
+            }
+            if (!image.patch.empty()) {
+                memcpy(&out[header.patchOffset + image.patchIndex * sizeof(FwPatchCommand)],
+                       image.patch.data(), image.patch.size() * sizeof(FwPatchCommand));
+            }
+            if (!onDemand) {
+                memcpy(&out[image.offset], image.stored.data(), image.stored.size());
+            }
+        }
+    }
+    for (size_t i = 0; i < keyTable.size(); i++) {
+        FwKeySlot slot;
+        memset(&slot, 0, sizeof(slot));
+        slot.key = keyTable[i].key;
+        slot.kind = keyTable[i].kind;
+        slot.index = keyTable[i].index;
+        memcpy(&out[header.keyOffset + i * sizeof(slot)], &slot, sizeof(slot));
+    }
+    return true;
+}
+
+static bool writeContainer(const char *path, const std::vector<uint8_t> &container)
+{
+    FILE *out = fopen(path, "wb");
+    if (!out) {
+        return false;
+    }
+    fwrite(container.data(), 1, container.size(), out);
+    return fclose(out) == 0;
+}
+
+static std::string resourcePath(const char *dir, const FwImage &image)
+{
+    char name[FW_CONTAINER_RESOURCE_NAME_LEN];
+    snprintf(name, sizeof(name), FW_CONTAINER_RESOURCE_FMT, image.checksum);
+    return std::string(dir) + "/" + name;
+}
+
+/* Writes every stored stream as the kext resource the driver requests */
+static bool writeResources(const char *dir, const std::vector<FwImage> &images, size_t *bytes)
+{
+    std::map<uint32_t, int> names;
+    *bytes = 0;
+    for (size_t i = 0; i < images.size(); i++) {
+        const FwImage &image = images[i];
+        if (image.alias >= 0) {
+            continue;
+        }
+        if (!names.insert(std::make_pair(image.checksum, (int)i)).second) {
+            fprintf(stderr, "error: %s and %s have the same resource name\n",
+                    image.name.c_str(), images[names[image.checksum]].name.c_str());
+            return false;
+        }
+        std::string path = resourcePath(dir, image);
+        FILE *out = fopen(path.c_str(), "wb");
+        if (!out) {
+            fprintf(stderr, "error: can not write %s\n", path.c_str());
+            return false;
+        }
+        fwrite(image.stored.data(), 1, image.stored.size(), out);
+        if (fclose(out) != 0) {
+            fprintf(stderr, "error: can not write %s\n", path.c_str());
+            return false;
+        }
+        *bytes += image.stored.size();
+    }
+    return true;
+}
+
+/* Maps the written container and reads every image back through FwView,
+ * the same way the driver does in place. Resources are read from dir the
+ * way OSKextRequestResource would hand them over.
+ */
+static bool verifyContainer(const char *path, const char *dir, const std::vector<FwImage> &images)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    void *map = fstat(fd, &st) == 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    const FwContainerHeader *container = (const FwContainerHeader *)map;
+    bool ok = FwContainerCheck(container, (uint32_t)st.st_size) && container->entryCount == images.size();
+    for (size_t i = 0; ok && i < images.size(); i++) {
+        const FwImage &image = images[i].alias >= 0 ? images[images[i].alias] : images[i];
+        FwView view(container, (uint32_t)i);
+        std::vector<uint8_t> resource;
+        if (view.isValid() && view.isResource()) {
+            ok = dir && readFile(resourcePath(dir, image).c_str(), resource);
+            view = view.withStream(resource.data(), (uint32_t)resource.size());
+        }
+        ok = ok && view.isValid() && images[i].name == view.name() && view.length() == image.data.size() &&
+        memcmp(view.bytes(), image.stored.data(), image.stored.size()) == 0 &&
+        view.planCount() == (int)image.plan.size() && view.patchCount() == (int)image.patch.size() &&
+        (image.plan.empty() || memcmp(view.plan(), image.plan.data(), image.plan.size() * sizeof(FwFragment)) == 0) &&
+        (image.patch.empty() || memcmp(view.patch(), image.patch.data(), image.patch.size() * sizeof(FwPatchCommand)) == 0) &&
+        (!view.isDelta() || (view.base().isValid() && !view.base().isDelta()));
+    }
+    munmap(map, st.st_size);
+    return ok;
+}
+
+static bool writeAssembly(const char *path, const char *container)
+{
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        return false;
+    }
+    fprintf(out, "/*  IntelBluetoothFirmware\n\n    Copyright © 2020 钟先耀. All rights reserved.\n");
+    fprintf(out, "    Generated by FwGenerator, do not edit. */\n\n");
+    fprintf(out, "#if defined(__APPLE__)\n"
+            "    .const\n"
+            "    .globl _fwContainer\n"
+            "    .globl _fwContainerEnd\n"
+            "    .p2align 12\n"
+            "_fwContainer:\n"
+            "#else\n"
+            "    .section .rodata\n"
+            "    .globl fwContainer\n"
+            "    .globl fwContainerEnd\n"
+            "    .type fwContainer, %%object\n"
+            "    .balign %d\n"
+            "fwContainer:\n"
+            "#endif\n", FW_CONTAINER_ALIGN);
+    fprintf(out, "    .incbin \"");
+    for (const char *p = container; *p; p++) {
+        fprintf(out, *p == '"' || *p == '\\' ? "\\%c" : "%c", *p);
+    }
+    fprintf(out, "\"\n");
+    fprintf(out, "#if defined(__APPLE__)\n"
+            "_fwContainerEnd:\n"
+            "#else\n"
+            "fwContainerEnd:\n"
+            "    .size fwContainer, . - fwContainer\n"
+            "    .section .note.GNU-stack, \"\", %%progbits\n"
+            "#endif\n");
+    return fclose(out) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *output = NULL;
+    const char *assembly = NULL;
+    const char *resources = NULL;
+    std::set<int> variants;
+    std::map<int, FwVariantSize> variantSizes;
+    size_t skipped = 0;
+    bool pack = false;
+    bool delta = false;
+    bool bench = false;
+    std::vector<FwImage> images;
+    std::multimap<uint64_t, int> blobs;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+            continue;
+        }
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            assembly = argv[++i];
+            continue;
+        }
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            resources = argv[++i];
+            continue;
+        }
+        if (strcmp(argv[i], "-v") == 0 && i + 1 < argc) {
+            if (!parseVariants(argv[++i], variants)) {
+                fprintf(stderr, "error: bad hw_variant list %s\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        if (strcmp(argv[i], "-z") == 0) {
+            pack = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-d") == 0) {
+            delta = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-b") == 0) {
+            bench = true;
+            continue;
+        }
+        FwImage image;
+        image.path = argv[i];
+        size_t slash = image.path.find_last_of('/');
+        image.name = slash == std::string::npos ? image.path : image.path.substr(slash + 1);
+        image.bootParam = 0;
+        image.alias = -1;
+        image.base = -1;
+        if (!parseKey(image)) {
+            fprintf(stderr, "error: %s: can not tell the hardware it is for from its name\n", argv[i]);
+            return 1;
+        }
+        if (!readFile(argv[i], image.data)) {
+            fprintf(stderr, "error: can not read %s\n", argv[i]);
+            return 1;
+        }
+        /* Several SKUs ship byte identical images under different names,
+         * those are embedded once and share one fwList entry's storage.
+         */
+        image.hash = contentHash(image.data);
+        image.checksum = crc32(image.data);
+        countVariant(variantSizes, image, pack);
+        if (!variants.empty() && !variants.count(FwKeyVariant(image.kind, image.key))) {
+            skipped++;
+            continue;
+        }
+        for (auto it = blobs.lower_bound(image.hash); it != blobs.end() && it->first == image.hash; ++it) {
+            const FwImage &blob = images[it->second];
+            if (extension(blob.name) == extension(image.name) && blob.data == image.data) {
+                image.alias = it->second;
+                break;
+            }
+        }
+        if (image.alias >= 0) {
+            image.data.clear();
+            images.push_back(image);
+            continue;
+        }
+        blobs.insert(std::make_pair(image.hash, (int)images.size()));
+        if (endsWith(image.name, ".sfi") && !planImage(image)) {
+            return 1;
+        }
+        if (endsWith(image.name, ".bseq") && !indexPatch(image)) {
+            return 1;
+        }
+        images.push_back(image);
+    }
+    if (images.empty() && skipped) {
+        fprintf(stderr, "error: none of the images is for the selected hw_variants\n");
+        return 1;
+    }
+    if (!output || !assembly || images.empty()) {
+        fprintf(stderr, "usage: %s [-z] [-d] [-b] [-r resources] [-v hw_variants] -o FwPayload.bin -s FwPayload.S fw/*.*\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<FwKeySlot> keyTable;
+    uint32_t keySeed = 0;
+    if (!buildKeyTable(images, keyTable, &keySeed)) {
+        fprintf(stderr, "error: no perfect hash for the image keys\n");
+        return 1;
+    }
+    for (size_t i = 0; i < images.size(); i++) {
+        const FwImage *other = lookupByKey(images, keyTable, keySeed, images[i].kind, images[i].key);
+        if (other != &images[i]) {
+            fprintf(stderr, "error: %s and %s are for the same hardware\n",
+                    images[i].name.c_str(), other->name.c_str());
+            return 1;
+        }
+    }
+
+    /* An on demand image is requested on its own, it can not need a base */
+    if (resources && delta) {
+        printf("FwGenerator: on demand resources are stored without deltas\n");
+        delta = false;
+    }
+    size_t deltaSaved = delta ? selectBases(images, pack) : 0;
+    for (size_t i = 0; i < images.size(); i++) {
+        if (images[i].alias < 0 && !storeImage(images[i], images, pack)) {
+            return 1;
+        }
+    }
+
+    std::vector<uint8_t> container;
+    size_t resourceBytes = 0;
+    if (!buildContainer(images, keyTable, keySeed, pack, resources != NULL, !variants.empty(), container)) {
+        return 1;
+    }
+    if (resources && !writeResources(resources, images, &resourceBytes)) {
+        return 1;
+    }
+    if (!writeContainer(output, container) || !writeAssembly(assembly, output)) {
+        fprintf(stderr, "error: can not write %s\n", output);
+        return 1;
+    }
+    if (!verifyContainer(output, resources, images)) {
+        fprintf(stderr, "error: %s does not read back\n", output);
+        return 1;
+    }
+
+    size_t fragments = 0;
+    size_t commands = 0;
+    size_t rawBytes = 0;
+    size_t packedBytes = 0;
+    size_t aliases = 0;
+    size_t aliasedBytes = 0;
+    size_t deltas = 0;
+    for (size_t i = 0; i < images.size(); i++) {
+        const FwImage &image = images[i];
+        if (image.alias >= 0) {
+            aliases++;
+            aliasedBytes += images[image.alias].stored.size();
+            continue;
+        }
+        rawBytes += image.data.size();
+        packedBytes += image.stored.size();
+        deltas += image.base >= 0;
+        fragments += image.plan.size();
+        commands += image.patch.size();
+    }
+
+    printf("FwGenerator: %zu images, %zu precomputed fragments, %zu patch commands\n",
+           images.size(), fragments, commands);
+    printf("FwGenerator: %zu unique images, %zu aliases, %zu bytes saved by deduplication\n",
+           images.size() - aliases, aliases, aliasedBytes);
+    /* The benchmarks take seconds, a kext build does not run them */
+    if (bench) {
+        benchmarkLookup(images, keyTable, keySeed);
+    }
+    if (delta) {
+        printf("FwGenerator: %zu images stored as deltas, %zu bytes saved\n", deltas, deltaSaved);
+    }
+    if (pack || delta) {
+        printf("FwGenerator: stored %zu bytes as %zu bytes (%.1f%%)\n",
+               rawBytes, packedBytes, 100.0 * packedBytes / rawBytes);
+    }
+    if ((pack || delta) && bench) {
+        printf("FwGenerator: rebuild %.0f MB/s\n", rebuildThroughput(images, pack));
+    }
+    for (std::map<int, FwVariantSize>::const_iterator it = variantSizes.begin(); it != variantSizes.end(); ++it) {
+        printf("FwGenerator: hw_variant 0x%02x%s %zu images, %zu bytes, %zu bytes stored alone\n", it->first,
+               variants.empty() || variants.count(it->first) ? ":" : " (left out):",
+               it->second.images, it->second.raw, it->second.stored);
+    }
+    if (!variants.empty()) {
+        printf("FwGenerator: slimmed build, %zu images left out\n", skipped);
+    }
+    printf("FwGenerator: container version %d, %zu bytes, %zu entries\n",
+           FW_CONTAINER_VERSION, container.size(), images.size());
+    if (resources) {
+        size_t largest = 0;
+        for (size_t i = 0; i < images.size(); i++) {
+            if (images[i].alias < 0 && images[i].stored.size() > largest) {
+                largest = images[i].stored.size();
+            }
+        }
+        printf("FwGenerator: %zu bytes on demand in %s, at most %zu bytes resident\n",
+               resourceBytes, resources, container.size() + largest);
+    }
+    return 0;
+}
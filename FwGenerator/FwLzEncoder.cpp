@@ -0,0 +1,198 @@
+//
+//  FwLzEncoder.cpp
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include <string.h>
+#include <algorithm>
+#include "FwLzEncoder.h"
+#include "FwLz.h"
+
+#define MIN_MATCH       4
+#define LAST_LITERALS   5       /* a block always ends with literals */
+#define MF_LIMIT        12      /* no match starts this close to the end */
+#define MAX_DISTANCE    65535
+#define HASH_LOG        16
+#define MAX_CHAIN       256
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t hash4(const uint8_t *p)
+{
+    return (read32(p) * 2654435761u) >> (32 - HASH_LOG);
+}
+
+static void writeLength(std::vector<uint8_t> &out, uint32_t length)
+{
+    while (length >= 255) {
+        out.push_back(255);
+        length -= 255;
+    }
+    out.push_back((uint8_t)length);
+}
+
+static void writeSequence(std::vector<uint8_t> &out, const uint8_t *literals, uint32_t literalLength,
+                          uint32_t offset, uint32_t matchLength)
+{
+    uint32_t ml = matchLength ? matchLength - MIN_MATCH : 0;
+    out.push_back((uint8_t)(((literalLength < 15 ? literalLength : 15) << 4) | (ml < 15 ? ml : 15)));
+    if (literalLength >= 15) {
+        writeLength(out, literalLength - 15);
+    }
+    out.insert(out.end(), literals, literals + literalLength);
+    if (!matchLength) {
+        return;
+    }
+    out.push_back(offset & 0xff);
+    out.push_back(offset >> 8);
+    if (ml >= 15) {
+        writeLength(out, ml - 15);
+    }
+}
+
+class MatchFinder {
+
+public:
+
+    MatchFinder(const uint8_t *src, uint32_t length)
+    : src(src), length(length), inserted(0), head(1 << HASH_LOG, -1), chain(length, -1)
+    {
+    }
+
+    uint32_t find(uint32_t pos, uint32_t *offset)
+    {
+        insertUpTo(pos);
+        uint32_t limit = length - LAST_LITERALS;
+        uint32_t best = 0;
+        int candidate = head[hash4(src + pos)];
+        for (int depth = 0; candidate >= 0 && depth < MAX_CHAIN; depth++) {
+            if (pos - candidate > MAX_DISTANCE) {
+                break;
+            }
+            if (read32(src + candidate) == read32(src + pos)) {
+                uint32_t len = MIN_MATCH;
+                while (pos + len < limit && src[candidate + len] == src[pos + len]) {
+                    len++;
+                }
+                if (len > best) {
+                    best = len;
+                    *offset = pos - candidate;
+                }
+            }
+            candidate = chain[candidate];
+        }
+        return best >= MIN_MATCH ? best : 0;
+    }
+
+private:
+
+    void insertUpTo(uint32_t pos)
+    {
+        for (; inserted < pos; inserted++) {
+            uint32_t h = hash4(src + inserted);
+            chain[inserted] = head[h];
+            head[h] = inserted;
+        }
+    }
+
+private:
+    const uint8_t *src;
+    uint32_t length;
+    uint32_t inserted;
+    std::vector<int> head;
+    std::vector<int> chain;
+};
+
+static void encodeBlock(const uint8_t *src, uint32_t length, std::vector<uint8_t> &out)
+{
+    MatchFinder finder(src, length);
+    uint32_t anchor = 0;
+    uint32_t pos = 0;
+    while (length > MF_LIMIT && pos + MF_LIMIT <= length) {
+        uint32_t offset = 0;
+        uint32_t len = finder.find(pos, &offset);
+        if (!len) {
+            pos++;
+            continue;
+        }
+        /* One step lazy evaluation, a longer match right after this one
+         * is worth a literal.
+         */
+        if (pos + 1 + MF_LIMIT <= length) {
+            uint32_t nextOffset = 0;
+            uint32_t next = finder.find(pos + 1, &nextOffset);
+            if (next > len + 1) {
+                pos++;
+                continue;
+            }
+        }
+        writeSequence(out, src + anchor, pos - anchor, offset, len);
+        pos += len;
+        anchor = pos;
+    }
+    writeSequence(out, src + anchor, length - anchor, 0, 0);
+}
+
+static void putHeader(std::vector<uint8_t> &out, uint32_t header)
+{
+    for (int i = 0; i < 4; i++) {
+        out.push_back((header >> (8 * i)) & 0xff);
+    }
+}
+
+void FwLzEncodeImage(const std::vector<uint8_t> &image, std::vector<uint8_t> &packed)
+{
+    std::vector<uint8_t> block;
+    for (size_t pos = 0; pos < image.size(); pos += FW_LZ_BLOCK_SIZE) {
+        uint32_t length = (uint32_t)std::min(image.size() - pos, (size_t)FW_LZ_BLOCK_SIZE);
+        block.clear();
+        encodeBlock(image.data() + pos, length, block);
+        if (block.size() >= length) {
+            putHeader(packed, length | FW_LZ_BLOCK_STORED);
+            packed.insert(packed.end(), image.begin() + pos, image.begin() + pos + length);
+        } else {
+            putHeader(packed, (uint32_t)block.size());
+            packed.insert(packed.end(), block.begin(), block.end());
+        }
+    }
+}
+
+bool FwLzDecodeImage(const std::vector<uint8_t> &packed, std::vector<uint8_t> &image, size_t length)
+{
+    size_t pos = 0;
+    image.resize(length);
+    for (size_t out = 0; out < length; out += FW_LZ_BLOCK_SIZE) {
+        uint32_t expected = (uint32_t)std::min(length - out, (size_t)FW_LZ_BLOCK_SIZE);
+        if (packed.size() - pos < FW_LZ_BLOCK_HDR_LEN) {
+            return false;
+        }
+        uint32_t header = FwLzBlockHeader(&packed[pos]);
+        uint32_t payload = header & FW_LZ_BLOCK_LEN_MASK;
+        pos += FW_LZ_BLOCK_HDR_LEN;
+        if (packed.size() - pos < payload) {
+            return false;
+        }
+        int decoded;
+        if (header & FW_LZ_BLOCK_STORED) {
+            decoded = payload == expected ? (int)payload : -1;
+            if (decoded > 0) {
+                memcpy(&image[out], &packed[pos], payload);
+            }
+        } else {
+            decoded = FwLzDecodeBlock(&packed[pos], payload, &image[out], expected);
+        }
+        if (decoded != (int)expected) {
+            return false;
+        }
+        pos += payload;
+    }
+    return pos == packed.size();
+}
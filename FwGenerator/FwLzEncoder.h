@@ -0,0 +1,25 @@
+//
+//  FwLzEncoder.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef FwLzEncoder_h
+#define FwLzEncoder_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/* Packs an image into the block stream described in FwLz.h. Blocks are
+ * compressed independently with a hash chain match finder, the driver only
+ * ever needs one decoded block in memory.
+ */
+void FwLzEncodeImage(const std::vector<uint8_t> &image, std::vector<uint8_t> &packed);
+
+/* Decodes a whole block stream, used to verify the round trip */
+bool FwLzDecodeImage(const std::vector<uint8_t> &packed, std::vector<uint8_t> &image, size_t length);
+
+#endif /* FwLzEncoder_h */
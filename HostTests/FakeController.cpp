@@ -0,0 +1,393 @@
+//
+//  FakeController.cpp
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "FakeController.h"
+#include "Hci.h"
+#include "FwPlan.h"
+
+/* Where the CSS header, public key and signature sit in an .sfi, by
+ * fragment type.
+ */
+static const struct {
+    uint32_t offset;
+    uint32_t length;
+} kSfiHeader[4] = {
+    { 0, 128 },             /* kFwFragmentInit */
+    { 0, 0 },               /* kFwFragmentData, everything after FW_SFI_HEADER_LEN */
+    { 388, 256 },           /* kFwFragmentSign */
+    { 128, 256 },           /* kFwFragmentPKey */
+};
+
+static uint64_t now()
+{
+    return mach_absolute_time();
+}
+
+FakeController::FakeController()
+: readyAfterMs(0), resetFirst(false), eventDelayMs(0), slowDelayMs(0), bootDelayMs(5), mQuit(false), mLegacy(true), mAttachTime(0),
+mPatchPos(0), mDataReceived(0), mFragmentIndex(0), mTransport(NULL), mReadPosted(false), mReadBulk(false),
+mAborted(0), mDelivering(false)
+{
+    bzero(&mVersion, sizeof(mVersion));
+    bzero(&mParams, sizeof(mParams));
+    bzero(mHeaderReceived, sizeof(mHeaderReceived));
+    bzero(&mStats, sizeof(mStats));
+    mThread = std::thread(&FakeController::deliver, this);
+}
+
+FakeController::~FakeController()
+{
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        mQuit = true;
+    }
+    mWake.notify_all();
+    mThread.join();
+}
+
+void FakeController::setLegacy(const IntelVersion &version, const std::vector<uint8_t> &bseq)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mLegacy = true;
+    mVersion = version;
+    mImage = bseq;
+    mPatchPos = 0;
+}
+
+void FakeController::setBootloader(const IntelVersion &version, const IntelBootParams &params, const std::vector<uint8_t> &sfi)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mLegacy = false;
+    mVersion = version;
+    mVersion.fw_variant = 0x06;
+    mParams = params;
+    mImage = sfi;
+    bzero(mHeaderReceived, sizeof(mHeaderReceived));
+    mDataReceived = 0;
+    mFragmentIndex = 0;
+}
+
+BtTransport *FakeController::createTransport()
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    if (mTransport) {
+        return NULL;
+    }
+    mTransport = new FakeTransport(this);
+    if (!mAttachTime) {
+        mAttachTime = now();
+    }
+    mReadPosted = false;
+    mAborted = 0;
+    mEvents.clear();
+    return mTransport;
+}
+
+FakeControllerStats FakeController::stats()
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    return mStats;
+}
+
+void FakeController::queue(bool bulk, const std::vector<uint8_t> &bytes, uint32_t delayMs)
+{
+    Event event;
+    event.bulk = bulk;
+    event.queued = now();
+    event.due = event.queued + (uint64_t)(eventDelayMs + delayMs) * 1000000;
+    event.bytes = bytes;
+    mEvents.push_back(event);
+    mWake.notify_all();
+}
+
+void FakeController::complete(uint16_t opcode, const uint8_t *result, uint8_t length, bool bulk, uint32_t delayMs)
+{
+    std::vector<uint8_t> event = { HCI_EV_CMD_COMPLETE, (uint8_t)(3 + length), 1, (uint8_t)opcode, (uint8_t)(opcode >> 8) };
+    event.insert(event.end(), result, result + length);
+    if (slowOpcodes.count(opcode) && !mAnswered.count(opcode)) {
+        delayMs += slowDelayMs;
+    }
+    mAnswered.insert(opcode);
+    queue(bulk, event, delayMs);
+}
+
+void FakeController::vendor(uint8_t code, bool bulk, uint32_t delayMs)
+{
+    queue(bulk, { HCI_EV_VENDOR, 2, code, 0x00 }, delayMs);
+}
+
+/* Answers with the events the .bseq lists if the command is the next one
+ * of the patch. The patch starts in manufacturer mode, some leave it with
+ * 0xfc11 before their last commands.
+ */
+bool FakeController::replayPatch(uint16_t opcode, const uint8_t *param, uint8_t plen)
+{
+    if (!mLegacy || (!mStats.inManufacturerMode && !mPatchPos) || mPatchPos >= mImage.size()) {
+        return false;
+    }
+    const uint8_t *record = mImage.data() + mPatchPos;
+    size_t remain = mImage.size() - mPatchPos;
+    if (remain < 4 || record[0] != 0x01 || (record[1] | (record[2] << 8)) != opcode || record[3] != plen ||
+        remain - 4 < plen || memcmp(record + 4, param, plen)) {
+        return false;
+    }
+    size_t pos = mPatchPos + 4 + plen;
+    uint32_t delay = 0;
+    while (mImage.size() - pos > 2 && mImage[pos] == 0x02) {
+        uint8_t length = mImage[pos + 2];
+        queue(false, std::vector<uint8_t>(mImage.begin() + pos + 1, mImage.begin() + pos + 3 + length), delay);
+        pos += 3 + length;
+        /* A vendor event follows its command status a little later */
+        delay++;
+    }
+    mPatchPos = pos;
+    mStats.patchCommands++;
+    if (opcode == HCI_OP_INTEL_ENTER_MFG && plen == 2) {
+        mStats.inManufacturerMode = param[0] == 0x01;
+    }
+    if (mPatchPos == mImage.size()) {
+        mStats.patched = true;
+        mVersion.fw_patch_num = 1;
+    }
+    return true;
+}
+
+IOReturn FakeController::command(const uint8_t *bytes, uint16_t length)
+{
+    static const uint8_t kSuccess = 0;
+    std::lock_guard<std::mutex> guard(mLock);
+    if (length < HCI_COMMAND_HDR_SIZE || length != HCI_COMMAND_HDR_SIZE + bytes[2]) {
+        return kIOReturnBadArgument;
+    }
+    uint16_t opcode = bytes[0] | (bytes[1] << 8);
+    const uint8_t *param = bytes + HCI_COMMAND_HDR_SIZE;
+    uint8_t plen = bytes[2];
+    mStats.commands++;
+    if ((now() - mAttachTime) / 1000000 < readyAfterMs) {
+        return kIOReturnSuccess;
+    }
+    if (resetFirst && !mStats.resets && opcode != HCI_OP_RESET) {
+        return kIOReturnSuccess;
+    }
+    if (replayPatch(opcode, param, plen)) {
+        return kIOReturnSuccess;
+    }
+    if (mLegacy && (mStats.inManufacturerMode || mPatchPos) && mPatchPos < mImage.size()) {
+        mStats.patchMismatches++;
+    }
+    switch (opcode) {
+        case HCI_OP_RESET:
+            mStats.resets++;
+            complete(opcode, &kSuccess, 1, false);
+            break;
+        case HCI_OP_INTEL_VERSION:
+            mStats.versionReads++;
+            complete(opcode, (const uint8_t *)&mVersion, sizeof(mVersion), false);
+            break;
+        case HCI_OP_READ_INTEL_BOOT_PARAMS:
+            complete(opcode, (const uint8_t *)&mParams, sizeof(mParams), false);
+            break;
+        case HCI_OP_INTEL_ENTER_MFG:
+            if (plen == 2) {
+                mStats.inManufacturerMode = param[0] == 0x01;
+            }
+            complete(opcode, &kSuccess, 1, false);
+            break;
+        case HCI_OP_INTEL_RESET_BOOT:
+            if (plen && param[0] == 0x01) {
+                /* Back to the bootloader, the device drops off the bus */
+                mStats.bootloaderResets++;
+                bzero(mHeaderReceived, sizeof(mHeaderReceived));
+                mDataReceived = 0;
+                mStats.downloaded = false;
+                break;
+            }
+            complete(opcode, &kSuccess, 1, false);
+            if (!mLegacy && mStats.downloaded) {
+                mStats.booted = true;
+                mVersion.fw_variant = 0x23;
+                vendor(INTEL_EV_REBOOT_DONE, false, bootDelayMs);
+            }
+            break;
+        default:
+            complete(opcode, &kSuccess, 1, false);
+            break;
+    }
+    return kIOReturnSuccess;
+}
+
+IOReturn FakeController::bulk(const uint8_t *bytes, uint16_t length)
+{
+    static const uint8_t kSuccess = 0;
+    std::lock_guard<std::mutex> guard(mLock);
+    if (length < HCI_COMMAND_HDR_SIZE || length != HCI_COMMAND_HDR_SIZE + bytes[2]) {
+        return kIOReturnBadArgument;
+    }
+    uint16_t opcode = bytes[0] | (bytes[1] << 8);
+    if (opcode != HCI_OP_INTEL_SECURE_SEND || mLegacy || bytes[2] < 1) {
+        mStats.corrupt++;
+        return kIOReturnSuccess;
+    }
+    secureSend(bytes + HCI_COMMAND_HDR_SIZE, bytes[2]);
+    if (dropAcks.count(mFragmentIndex)) {
+        mStats.acksDropped++;
+    } else {
+        complete(opcode, &kSuccess, 1, true);
+    }
+    mFragmentIndex++;
+    return kIOReturnSuccess;
+}
+
+/* Checks one fragment against the image, the bootloader only takes every
+ * byte once and in order.
+ */
+void FakeController::secureSend(const uint8_t *param, uint8_t plen)
+{
+    uint8_t type = param[0];
+    const uint8_t *data = param + 1;
+    uint32_t length = plen - 1;
+
+    mStats.fragments++;
+    if (type > kFwFragmentPKey || mImage.size() < FW_SFI_HEADER_LEN) {
+        mStats.corrupt++;
+        return;
+    }
+    uint32_t base = type == kFwFragmentData ? FW_SFI_HEADER_LEN : kSfiHeader[type].offset;
+    uint32_t size = type == kFwFragmentData ? (uint32_t)mImage.size() - FW_SFI_HEADER_LEN : kSfiHeader[type].length;
+    uint32_t *received = type == kFwFragmentData ? &mDataReceived : &mHeaderReceived[type];
+    if (*received + length <= size && !memcmp(mImage.data() + base + *received, data, length)) {
+        *received += length;
+    } else {
+        bool repeated = false;
+        for (uint32_t offset = 0; offset + length <= *received && !repeated; offset++) {
+            repeated = !memcmp(mImage.data() + base + offset, data, length);
+        }
+        if (repeated) {
+            mStats.duplicates++;
+        } else {
+            mStats.corrupt++;
+        }
+        return;
+    }
+    bool done = mDataReceived == mImage.size() - FW_SFI_HEADER_LEN;
+    for (int i = 0; i < 4 && done; i++) {
+        done = i == kFwFragmentData || mHeaderReceived[i] == kSfiHeader[i].length;
+    }
+    if (done && !mStats.downloaded && !mStats.duplicates && !mStats.corrupt) {
+        mStats.downloaded = true;
+        vendor(INTEL_EV_DOWNLOAD_DONE, true, 1);
+    }
+}
+
+bool FakeController::postRead(FakeTransport *transport, bool bulk)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    if (transport != mTransport) {
+        return false;
+    }
+    if (mReadPosted) {
+        mStats.doubleReads++;
+        return false;
+    }
+    mStats.reads++;
+    mReadPosted = true;
+    mReadBulk = bulk;
+    mWake.notify_all();
+    return true;
+}
+
+/* Completes the posted read with kIOReturnAborted if it is on the pipe
+ * aborted, or on any with all.
+ */
+void FakeController::abort(FakeTransport *transport, bool bulk, bool all)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    if (transport != mTransport) {
+        return;
+    }
+    if (all) {
+        mStats.transportAborts++;
+    }
+    if (!mReadPosted || (!all && mReadBulk != bulk)) {
+        if (!all) {
+            mStats.wrongPipeAborts++;
+        }
+        return;
+    }
+    mReadPosted = false;
+    mAborted++;
+    mStats.aborts++;
+    mWake.notify_all();
+}
+
+/* The driver let go of the transport, nothing is delivered to it after */
+void FakeController::detach(FakeTransport *transport)
+{
+    std::unique_lock<std::mutex> guard(mLock);
+    if (transport != mTransport) {
+        return;
+    }
+    mTransport = NULL;
+    mReadPosted = false;
+    mAborted = 0;
+    mEvents.clear();
+    mWake.wait(guard, [this] { return !mDelivering; });
+}
+
+void FakeController::deliver()
+{
+    std::unique_lock<std::mutex> guard(mLock);
+    while (!mQuit) {
+        FakeTransport *transport = mTransport;
+        if (transport && mAborted) {
+            mAborted--;
+            mDelivering = true;
+            guard.unlock();
+            transport->complete(kIOReturnAborted, NULL, 0);
+            guard.lock();
+            mDelivering = false;
+            mWake.notify_all();
+            continue;
+        }
+        uint64_t wake = 0;
+        std::deque<Event>::iterator next = mEvents.end();
+        if (transport && mReadPosted) {
+            /* In order per pipe, the other pipe's events wait for their read */
+            for (auto it = mEvents.begin(); it != mEvents.end(); ++it) {
+                if (it->bulk == mReadBulk) {
+                    next = it;
+                    break;
+                }
+            }
+        }
+        if (next != mEvents.end() && next->due <= now()) {
+            Event event = *next;
+            mEvents.erase(next);
+            mReadPosted = false;
+            uint32_t delayUs = (uint32_t)((now() - event.queued) / 1000);
+            if (delayUs > mStats.maxEventDelayUs) {
+                mStats.maxEventDelayUs = delayUs;
+            }
+            mDelivering = true;
+            guard.unlock();
+            transport->complete(kIOReturnSuccess, event.bytes.data(), (uint32_t)event.bytes.size());
+            guard.lock();
+            mDelivering = false;
+            mWake.notify_all();
+            continue;
+        }
+        if (next != mEvents.end()) {
+            wake = next->due;
+        }
+        if (wake) {
+            mWake.wait_for(guard, std::chrono::nanoseconds(wake - now()));
+        } else {
+            mWake.wait(guard);
+        }
+    }
+}
@@ -0,0 +1,218 @@
+//
+//  FakeController.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef FakeController_h
+#define FakeController_h
+
+#include "HostKernel.h"
+#include "BtTransport.h"
+#include "BtIntel.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+
+class FakeTransport;
+
+/* What the controller saw of one attach and download */
+struct FakeControllerStats {
+    uint32_t commands;          /* on the control endpoint */
+    uint32_t patchCommands;     /* .bseq records answered */
+    uint32_t patchMismatches;   /* commands off the .bseq while patching */
+    uint32_t fragments;         /* secure send fragments taken */
+    uint32_t duplicates;        /* data fragments that repeated image bytes */
+    uint32_t corrupt;           /* fragments that matched no image bytes */
+    uint32_t acksDropped;
+    uint32_t versionReads;
+    uint32_t resets;            /* HCI_Reset */
+    uint32_t bootloaderResets;  /* Intel reset back to the bootloader */
+    uint32_t aborts;            /* posted reads aborted */
+    uint32_t wrongPipeAborts;   /* aborts that hit a pipe without a read */
+    uint32_t transportAborts;   /* every pipe aborted, writes included */
+    uint32_t doubleReads;       /* reads posted while one was */
+    uint32_t reads;
+    uint32_t maxEventDelayUs;
+    bool inManufacturerMode;
+    bool patched;               /* every .bseq record answered */
+    bool downloaded;            /* every image byte arrived once */
+    bool booted;                /* operational firmware running */
+};
+
+/* A simulated Intel controller behind the BtTransport the driver talks to.
+ *
+ * Legacy parts answer HCI_Reset, the version read and manufacturer mode,
+ * and replay the events a .bseq lists for each of its commands. Parts with
+ * the new bootloader answer the version and boot parameter reads, check
+ * every secure send fragment against the .sfi, acknowledge them on bulk in
+ * and report download and boot done with the 0xff 0x06 and 0x02 vendor
+ * events. Events are delivered from a thread of their own, the way USB
+ * completions come in.
+ */
+class FakeController {
+
+public:
+
+    FakeController();
+
+    ~FakeController();
+
+    /* A legacy controller expecting the patch in bseq, empty if patched */
+    void setLegacy(const IntelVersion &version, const std::vector<uint8_t> &bseq);
+
+    /* A controller in the bootloader expecting the image in sfi */
+    void setBootloader(const IntelVersion &version, const IntelBootParams &params, const std::vector<uint8_t> &sfi);
+
+    /* Handed to the driver, which deletes it when it lets go of the device */
+    BtTransport *createTransport();
+
+    FakeControllerStats stats();
+
+    /* Commands sent before are not answered, in ms from the first attach */
+    uint32_t readyAfterMs;
+
+    /* Commands before the first HCI_Reset go unanswered */
+    bool resetFirst;
+
+    /* Every event comes this much late, in ms */
+    uint32_t eventDelayMs;
+
+    /* The first answer to each of these opcodes comes this much late, in ms */
+    std::set<uint16_t> slowOpcodes;
+    uint32_t slowDelayMs;
+
+    /* Secure send fragments, counted from 0, whose command complete is lost */
+    std::set<uint32_t> dropAcks;
+
+    /* Milliseconds the operational firmware takes to boot */
+    uint32_t bootDelayMs;
+
+private:
+
+    friend class FakeTransport;
+
+    struct Event {
+        bool bulk;
+        uint64_t due;           /* absolute time */
+        uint64_t queued;
+        std::vector<uint8_t> bytes;
+    };
+
+    IOReturn command(const uint8_t *bytes, uint16_t length);
+
+    IOReturn bulk(const uint8_t *bytes, uint16_t length);
+
+    bool postRead(FakeTransport *transport, bool bulk);
+
+    void abort(FakeTransport *transport, bool bulk, bool all);
+
+    void detach(FakeTransport *transport);
+
+    /* The helpers below expect mLock held */
+    void queue(bool bulk, const std::vector<uint8_t> &bytes, uint32_t delayMs = 0);
+
+    void complete(uint16_t opcode, const uint8_t *result, uint8_t length, bool bulk, uint32_t delayMs = 0);
+
+    void vendor(uint8_t code, bool bulk, uint32_t delayMs);
+
+    bool replayPatch(uint16_t opcode, const uint8_t *param, uint8_t plen);
+
+    void secureSend(const uint8_t *param, uint8_t plen);
+
+    void deliver();
+
+private:
+    std::mutex mLock;
+    std::condition_variable mWake;
+    std::thread mThread;
+    bool mQuit;
+
+    bool mLegacy;
+    IntelVersion mVersion;
+    IntelBootParams mParams;
+    std::vector<uint8_t> mImage;
+    uint64_t mAttachTime;
+    std::set<uint16_t> mAnswered;
+
+    /* Legacy patch replay */
+    size_t mPatchPos;
+
+    /* Secure send progress through the .sfi */
+    uint32_t mHeaderReceived[4];
+    uint32_t mDataReceived;
+    uint32_t mFragmentIndex;
+
+    FakeTransport *mTransport;
+    std::deque<Event> mEvents;
+    bool mReadPosted;
+    bool mReadBulk;
+    int mAborted;               /* aborted reads still to complete */
+    bool mDelivering;
+    FakeControllerStats mStats;
+};
+
+/* Entry point of the driver into the controller */
+class FakeTransport : public BtTransport {
+
+public:
+
+    FakeTransport(FakeController *controller) : mController(controller), mImage(NULL), mImageLength(0) {}
+
+    ~FakeTransport() override { mController->detach(this); }
+
+    IOReturn sendHCICommand(const void *command, uint16_t length) override
+    {
+        return mController->command((const uint8_t *)command, length);
+    }
+
+    IOReturn bulkWrite(const void *data, uint16_t length) override
+    {
+        return mController->bulk((const uint8_t *)data, length);
+    }
+
+    bool mapImage(const void *bytes, uint32_t length) override
+    {
+        mImage = (const uint8_t *)bytes;
+        mImageLength = length;
+        return true;
+    }
+
+    void unmapImage() override { mImage = NULL; }
+
+    /* Like USBTransport, data inside the mapped image is not copied. The
+     * controller gets header and data as one buffer the way DMA of the
+     * two descriptors would put them on the wire.
+     */
+    IOReturn bulkWriteGather(const void *header, uint16_t headerLength, const void *data, uint16_t dataLength) override
+    {
+        const uint8_t *bytes = (const uint8_t *)data;
+        if (!mImage || bytes < mImage || bytes + dataLength > mImage + mImageLength) {
+            return BtTransport::bulkWriteGather(header, headerLength, data, dataLength);
+        }
+        std::vector<uint8_t> wire((const uint8_t *)header, (const uint8_t *)header + headerLength);
+        wire.insert(wire.end(), bytes, bytes + dataLength);
+        return mController->bulk(wire.data(), (uint16_t)wire.size());
+    }
+
+    bool interruptRead() override { return mController->postRead(this, false); }
+
+    bool bulkRead() override { return mController->postRead(this, true); }
+
+    void abort() override { mController->abort(this, false, true); }
+
+    void abortRead(bool bulk) override { mController->abort(this, bulk, false); }
+
+    void complete(IOReturn status, const void *data, uint32_t length) { notifyRead(status, data, length); }
+
+private:
+    FakeController *mController;
+    const uint8_t *mImage;
+    uint32_t mImageLength;
+};
+
+#endif /* FakeController_h */
@@ -0,0 +1,907 @@
+//
+//  HostKernel.cpp
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "HostKernel.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <mutex>
+#include <thread>
+
+task_t kernel_task = NULL;
+const IORegistryPlane *gIOServicePlane = NULL;
+const OSMetaClass *const OSObject::metaClass = new OSMetaClass();
+
+static OSBoolean sTrue(true);
+static OSBoolean sFalse(false);
+OSBoolean *const kOSBooleanTrue = &sTrue;
+OSBoolean *const kOSBooleanFalse = &sFalse;
+
+/* Room for the largest container, FWData.h sees it as the embedded one.
+ * HostKernelLoadContainer maps the file over it, aligned for 64 KB pages.
+ */
+#define kHostContainerSize (64 << 20)
+
+__asm__(
+#if defined(__APPLE__)
+        "    .zerofill __DATA,__bss,_fwContainer,67108864,16\n"
+        "    .globl _fwContainer\n"
+        "    .globl _fwContainerEnd\n"
+        "    .set _fwContainerEnd, _fwContainer + 67108864\n"
+#else
+        "    .bss\n"
+        "    .balign 65536\n"
+        "    .globl fwContainer\n"
+        "fwContainer:\n"
+        "    .zero 67108864\n"
+        "    .globl fwContainerEnd\n"
+        "fwContainerEnd:\n"
+        "    .previous\n"
+#endif
+        );
+
+extern "C" unsigned char fwContainer[];
+
+static std::mutex sStatsLock;
+static HostKernelStats sStats;
+static bool sVerbose;
+static std::string sResourceDirectory;
+
+void HostKernelGetStats(HostKernelStats *stats)
+{
+    std::lock_guard<std::mutex> guard(sStatsLock);
+    *stats = sStats;
+}
+
+void HostKernelResetPeak()
+{
+    std::lock_guard<std::mutex> guard(sStatsLock);
+    sStats.peakLiveBytes = sStats.liveBytes;
+}
+
+void HostKernelSetVerbose(bool verbose)
+{
+    sVerbose = verbose;
+}
+
+void HostKernelSetResourceDirectory(const char *path)
+{
+    sResourceDirectory = path ? path : "";
+}
+
+static bool readFile(const char *path, std::vector<uint8_t> &out)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    uint8_t buffer[65536];
+    size_t n;
+    out.clear();
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        out.insert(out.end(), buffer, buffer + n);
+    }
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+/* Read only, as the kext's constant data is, so a write into the
+ * container faults instead of changing what the next test sees. The
+ * file is mapped over the start of fwContainer and zero pages over the
+ * rest, each call replaces the mappings of the last.
+ */
+bool HostKernelLoadContainer(const char *path)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if ((uintptr_t)fwContainer % page) {
+        return false;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0 || (size_t)info.st_size > kHostContainerSize) {
+        close(fd);
+        return false;
+    }
+    size_t mapped = ((size_t)info.st_size + page - 1) / page * page;
+    void *file = mmap(fwContainer, mapped, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        return false;
+    }
+    if (mapped < kHostContainerSize && mmap(fwContainer + mapped, kHostContainerSize - mapped, PROT_READ,
+                                            MAP_PRIVATE | MAP_FIXED | MAP_ANON, -1, 0) == MAP_FAILED) {
+        return false;
+    }
+    return true;
+}
+
+/* ---- IOLib ---- */
+
+void IOLog(const char *format, ...)
+{
+    if (!sVerbose) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+void IOSleep(unsigned milliseconds)
+{
+    usleep(milliseconds * 1000);
+}
+
+void IODelay(unsigned microseconds)
+{
+    usleep(microseconds);
+}
+
+void *IOMalloc(size_t size)
+{
+    void *address = malloc(size);
+    if (address) {
+        std::lock_guard<std::mutex> guard(sStatsLock);
+        sStats.mallocs++;
+        sStats.mallocBytes += size;
+        sStats.liveBytes += size;
+        if (sStats.liveBytes > sStats.peakLiveBytes) {
+            sStats.peakLiveBytes = sStats.liveBytes;
+        }
+    }
+    return address;
+}
+
+void IOFree(void *address, size_t size)
+{
+    if (address) {
+        std::lock_guard<std::mutex> guard(sStatsLock);
+        sStats.liveBytes -= size;
+    }
+    free(address);
+}
+
+struct IOLock {
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+};
+
+IOLock *IOLockAlloc()
+{
+    IOLock *lock = new IOLock;
+    pthread_condattr_t attributes;
+    pthread_mutex_init(&lock->mutex, NULL);
+    pthread_condattr_init(&attributes);
+#if !defined(__APPLE__)
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&lock->condition, &attributes);
+    pthread_condattr_destroy(&attributes);
+    return lock;
+}
+
+void IOLockFree(IOLock *lock)
+{
+    pthread_cond_destroy(&lock->condition);
+    pthread_mutex_destroy(&lock->mutex);
+    delete lock;
+}
+
+void IOLockLock(IOLock *lock)
+{
+    pthread_mutex_lock(&lock->mutex);
+}
+
+void IOLockUnlock(IOLock *lock)
+{
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+/* Every sleeper wakes up on any event, the callers all sleep in loops */
+int IOLockSleep(IOLock *lock, void *event, int interruptible)
+{
+    pthread_cond_wait(&lock->condition, &lock->mutex);
+    return THREAD_AWAKENED;
+}
+
+int IOLockSleepDeadline(IOLock *lock, void *event, AbsoluteTime deadline, int interruptible)
+{
+#if defined(__APPLE__)
+    uint64_t now = mach_absolute_time();
+    uint64_t wait = deadline > now ? deadline - now : 0;
+    timespec relative = { (time_t)(wait / 1000000000ULL), (long)(wait % 1000000000ULL) };
+    int ret = pthread_cond_timedwait_relative_np(&lock->condition, &lock->mutex, &relative);
+#else
+    timespec absolute = { (time_t)(deadline / 1000000000ULL), (long)(deadline % 1000000000ULL) };
+    int ret = pthread_cond_timedwait(&lock->condition, &lock->mutex, &absolute);
+#endif
+    return ret == ETIMEDOUT ? THREAD_TIMED_OUT : THREAD_AWAKENED;
+}
+
+void IOLockWakeup(IOLock *lock, void *event, bool oneThread)
+{
+    pthread_cond_broadcast(&lock->condition);
+}
+
+uint64_t mach_absolute_time()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void clock_get_uptime(uint64_t *result)
+{
+    *result = mach_absolute_time();
+}
+
+void clock_interval_to_deadline(uint32_t interval, uint32_t scale, uint64_t *result)
+{
+    *result = mach_absolute_time() + (uint64_t)interval * scale;
+}
+
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result)
+{
+    *result = abstime;
+}
+
+void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t *result)
+{
+    *result = nanoseconds;
+}
+
+SInt32 OSIncrementAtomic(volatile SInt32 *address)
+{
+    return __atomic_fetch_add(address, 1, __ATOMIC_SEQ_CST);
+}
+
+SInt32 OSDecrementAtomic(volatile SInt32 *address)
+{
+    return __atomic_fetch_sub(address, 1, __ATOMIC_SEQ_CST);
+}
+
+SInt32 OSAddAtomic(SInt32 amount, volatile SInt32 *address)
+{
+    return __atomic_fetch_add(address, amount, __ATOMIC_SEQ_CST);
+}
+
+void OSMemoryBarrier(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* ---- Thread calls ---- */
+
+struct HostThreadCall {
+    thread_call_func_t func;
+    thread_call_param_t param0;
+    std::mutex lock;
+    pthread_cond_t idle;
+    bool pending;
+    bool running;
+    uint64_t generation;
+};
+
+static void runThreadCall(thread_call_t call, uint64_t generation)
+{
+    {
+        std::lock_guard<std::mutex> guard(call->lock);
+        /* Cancelled, or entered again before this thread got going */
+        if (!call->pending || call->generation != generation) {
+            return;
+        }
+        call->pending = false;
+        call->running = true;
+    }
+    call->func(call->param0, NULL);
+    std::lock_guard<std::mutex> guard(call->lock);
+    call->running = false;
+}
+
+thread_call_t thread_call_allocate(thread_call_func_t func, thread_call_param_t param0)
+{
+    return thread_call_allocate_with_options(func, param0, THREAD_CALL_PRIORITY_KERNEL, 0);
+}
+
+thread_call_t thread_call_allocate_with_options(thread_call_func_t func, thread_call_param_t param0,
+                                                thread_call_priority_t priority, thread_call_options_t options)
+{
+    HostThreadCall *call = new HostThreadCall;
+    call->func = func;
+    call->param0 = param0;
+    call->pending = false;
+    call->running = false;
+    call->generation = 0;
+    return call;
+}
+
+bool thread_call_enter(thread_call_t call)
+{
+    std::lock_guard<std::mutex> guard(call->lock);
+    if (call->pending) {
+        return true;
+    }
+    call->pending = true;
+    std::thread(runThreadCall, call, ++call->generation).detach();
+    return false;
+}
+
+bool thread_call_cancel(thread_call_t call)
+{
+    std::lock_guard<std::mutex> guard(call->lock);
+    bool pending = call->pending;
+    call->pending = false;
+    return pending;
+}
+
+bool thread_call_cancel_wait(thread_call_t call)
+{
+    bool pending = thread_call_cancel(call);
+    while (true) {
+        {
+            std::lock_guard<std::mutex> guard(call->lock);
+            if (!call->running) {
+                break;
+            }
+        }
+        usleep(100);
+    }
+    return pending;
+}
+
+bool thread_call_free(thread_call_t call)
+{
+    thread_call_cancel_wait(call);
+    /* A thread that lost the race to cancel may still look at it */
+    usleep(1000);
+    delete call;
+    return true;
+}
+
+/* ---- libkern containers ---- */
+
+OSObject::OSObject()
+: mRetainCount(1)
+{
+    std::lock_guard<std::mutex> guard(sStatsLock);
+    sStats.objects++;
+}
+
+OSObject::~OSObject()
+{
+}
+
+void OSObject::free()
+{
+    delete this;
+}
+
+void OSObject::retain() const
+{
+    mRetainCount++;
+}
+
+void OSObject::release() const
+{
+    if (--mRetainCount == 0) {
+        const_cast<OSObject *>(this)->free();
+    }
+}
+
+OSString *OSString::withCString(const char *string)
+{
+    OSString *object = new OSString;
+    object->mString = string;
+    return object;
+}
+
+OSNumber *OSNumber::withNumber(unsigned long long value, unsigned int numberOfBits)
+{
+    OSNumber *object = new OSNumber;
+    object->mValue = numberOfBits < 64 ? value & ((1ULL << numberOfBits) - 1) : value;
+    return object;
+}
+
+OSData *OSData::withBytes(const void *bytes, unsigned int length)
+{
+    OSData *object = new OSData;
+    object->appendBytes(bytes, length);
+    return object;
+}
+
+OSData *OSData::withCapacity(unsigned int capacity)
+{
+    OSData *object = new OSData;
+    object->mBytes.reserve(capacity);
+    return object;
+}
+
+bool OSData::appendBytes(const void *bytes, unsigned int length)
+{
+    mBytes.insert(mBytes.end(), (const uint8_t *)bytes, (const uint8_t *)bytes + length);
+    std::lock_guard<std::mutex> guard(sStatsLock);
+    sStats.dataBytes += length;
+    return true;
+}
+
+OSArray *OSArray::withCapacity(unsigned int capacity)
+{
+    OSArray *object = new OSArray;
+    object->mObjects.reserve(capacity);
+    return object;
+}
+
+void OSArray::free()
+{
+    for (OSObject *object : mObjects) {
+        object->release();
+    }
+    mObjects.clear();
+    OSObject::free();
+}
+
+bool OSArray::setObject(const OSObject *object)
+{
+    if (!object) {
+        return false;
+    }
+    object->retain();
+    mObjects.push_back(const_cast<OSObject *>(object));
+    return true;
+}
+
+OSDictionary *OSDictionary::withCapacity(unsigned int capacity)
+{
+    return new OSDictionary;
+}
+
+void OSDictionary::free()
+{
+    for (auto &entry : mObjects) {
+        entry.second->release();
+    }
+    mObjects.clear();
+    OSObject::free();
+}
+
+bool OSDictionary::setObject(const char *key, const OSObject *object)
+{
+    if (!key || !object) {
+        return false;
+    }
+    object->retain();
+    removeObject(key);
+    mObjects[key] = const_cast<OSObject *>(object);
+    return true;
+}
+
+OSObject *OSDictionary::getObject(const char *key) const
+{
+    auto entry = mObjects.find(key);
+    return entry == mObjects.end() ? NULL : entry->second;
+}
+
+void OSDictionary::removeObject(const char *key)
+{
+    auto entry = mObjects.find(key);
+    if (entry != mObjects.end()) {
+        entry->second->release();
+        mObjects.erase(entry);
+    }
+}
+
+OSIterator *OSIterator::withObjects(const std::vector<OSObject *> &objects)
+{
+    OSIterator *iterator = new OSIterator;
+    iterator->mObjects = objects;
+    return iterator;
+}
+
+/* ---- Kext resources, delivered from a thread of their own like kextd does ---- */
+
+const char *OSKextGetCurrentIdentifier(void)
+{
+    return "com.zxystd.IntelBluetoothFirmware";
+}
+
+OSReturn OSKextRequestResource(const char *kextIdentifier, const char *resourceName,
+                               OSKextRequestResourceCallback callback, void *context, OSKextRequestTag *requestTagOut)
+{
+    static std::atomic<uint32_t> tags(0);
+    if (sResourceDirectory.empty()) {
+        return kOSReturnError;
+    }
+    OSKextRequestTag tag = ++tags;
+    if (requestTagOut) {
+        *requestTagOut = tag;
+    }
+    std::string path = sResourceDirectory + "/" + resourceName;
+    std::thread([=]() {
+        std::vector<uint8_t> bytes;
+        if (readFile(path.c_str(), bytes)) {
+            callback(tag, kOSReturnSuccess, bytes.data(), (uint32_t)bytes.size(), context);
+        } else {
+            callback(tag, kOSReturnError, NULL, 0, context);
+        }
+    }).detach();
+    return kOSReturnSuccess;
+}
+
+/* ---- Memory descriptors ---- */
+
+IOMemoryDescriptor *IOMemoryDescriptor::withAddress(void *address, IOByteCount length, IODirection direction)
+{
+    IOMemoryDescriptor *descriptor = new IOMemoryDescriptor;
+    descriptor->mAddress = (uint8_t *)address;
+    descriptor->mLength = length;
+    return descriptor;
+}
+
+IOReturn IOMemoryDescriptor::prepare(IODirection direction)
+{
+    mPrepared++;
+    return kIOReturnSuccess;
+}
+
+IOReturn IOMemoryDescriptor::complete(IODirection direction)
+{
+    if (!mPrepared) {
+        return kIOReturnNotReady;
+    }
+    mPrepared--;
+    return kIOReturnSuccess;
+}
+
+IOByteCount IOMemoryDescriptor::readBytes(IOByteCount offset, void *bytes, IOByteCount length)
+{
+    if (offset >= mLength) {
+        return 0;
+    }
+    if (length > mLength - offset) {
+        length = mLength - offset;
+    }
+    memcpy(bytes, mAddress + offset, length);
+    return length;
+}
+
+IOByteCount IOMemoryDescriptor::writeBytes(IOByteCount offset, const void *bytes, IOByteCount length)
+{
+    if (offset >= mLength) {
+        return 0;
+    }
+    if (length > mLength - offset) {
+        length = mLength - offset;
+    }
+    memcpy(mAddress + offset, bytes, length);
+    return length;
+}
+
+IOBufferMemoryDescriptor *IOBufferMemoryDescriptor::inTaskWithOptions(task_t inTask, IOOptionBits options,
+                                                                      mach_vm_size_t capacity, mach_vm_size_t alignment)
+{
+    IOBufferMemoryDescriptor *descriptor = new IOBufferMemoryDescriptor;
+    descriptor->mAddress = (uint8_t *)calloc(1, capacity);
+    descriptor->mLength = capacity;
+    descriptor->mCapacity = capacity;
+    return descriptor;
+}
+
+void IOBufferMemoryDescriptor::free()
+{
+    ::free(mAddress);
+    mAddress = NULL;
+    IOMemoryDescriptor::free();
+}
+
+IOSubMemoryDescriptor *IOSubMemoryDescriptor::withSubRange(IOMemoryDescriptor *of, IOByteCount offset,
+                                                           IOByteCount length, IOOptionBits options)
+{
+    IOSubMemoryDescriptor *descriptor = new IOSubMemoryDescriptor;
+    if (!descriptor->initSubRange(of, offset, length, (IODirection)options)) {
+        descriptor->release();
+        return NULL;
+    }
+    return descriptor;
+}
+
+bool IOSubMemoryDescriptor::initSubRange(IOMemoryDescriptor *parent, IOByteCount offset, IOByteCount length,
+                                         IODirection withDirection)
+{
+    if (!parent || offset + length > parent->getLength()) {
+        return false;
+    }
+    parent->retain();
+    if (mParent) {
+        mParent->release();
+    }
+    mParent = parent;
+    mStart = offset;
+    mLength = length;
+    return true;
+}
+
+void IOSubMemoryDescriptor::free()
+{
+    if (mParent) {
+        mParent->release();
+        mParent = NULL;
+    }
+    IOMemoryDescriptor::free();
+}
+
+IOReturn IOSubMemoryDescriptor::prepare(IODirection direction)
+{
+    IOReturn ret = mParent->prepare(direction);
+    return ret == kIOReturnSuccess ? IOMemoryDescriptor::prepare(direction) : ret;
+}
+
+IOReturn IOSubMemoryDescriptor::complete(IODirection direction)
+{
+    IOReturn ret = IOMemoryDescriptor::complete(direction);
+    return ret == kIOReturnSuccess ? mParent->complete(direction) : ret;
+}
+
+IOByteCount IOSubMemoryDescriptor::readBytes(IOByteCount offset, void *bytes, IOByteCount length)
+{
+    if (offset >= mLength) {
+        return 0;
+    }
+    if (length > mLength - offset) {
+        length = mLength - offset;
+    }
+    return mParent->readBytes(mStart + offset, bytes, length);
+}
+
+IOMultiMemoryDescriptor *IOMultiMemoryDescriptor::withDescriptors(IOMemoryDescriptor **descriptors, UInt32 withCount,
+                                                                  IODirection withDirection, bool asReference)
+{
+    IOMultiMemoryDescriptor *descriptor = new IOMultiMemoryDescriptor;
+    if (!descriptor->initWithDescriptors(descriptors, withCount, withDirection, asReference)) {
+        descriptor->release();
+        return NULL;
+    }
+    return descriptor;
+}
+
+bool IOMultiMemoryDescriptor::initWithDescriptors(IOMemoryDescriptor **descriptors, UInt32 withCount,
+                                                  IODirection withDirection, bool asReference)
+{
+    if (mPrepared) {
+        return false;
+    }
+    for (UInt32 i = 0; i < withCount; i++) {
+        descriptors[i]->retain();
+    }
+    releaseDescriptors();
+    for (UInt32 i = 0; i < withCount; i++) {
+        mDescriptors.push_back(descriptors[i]);
+        mLength += descriptors[i]->getLength();
+    }
+    return true;
+}
+
+void IOMultiMemoryDescriptor::releaseDescriptors()
+{
+    for (IOMemoryDescriptor *descriptor : mDescriptors) {
+        descriptor->release();
+    }
+    mDescriptors.clear();
+    mLength = 0;
+}
+
+void IOMultiMemoryDescriptor::free()
+{
+    releaseDescriptors();
+    IOMemoryDescriptor::free();
+}
+
+IOReturn IOMultiMemoryDescriptor::prepare(IODirection direction)
+{
+    for (IOMemoryDescriptor *descriptor : mDescriptors) {
+        descriptor->prepare(direction);
+    }
+    return IOMemoryDescriptor::prepare(direction);
+}
+
+IOReturn IOMultiMemoryDescriptor::complete(IODirection direction)
+{
+    for (IOMemoryDescriptor *descriptor : mDescriptors) {
+        descriptor->complete(direction);
+    }
+    return IOMemoryDescriptor::complete(direction);
+}
+
+IOByteCount IOMultiMemoryDescriptor::readBytes(IOByteCount offset, void *bytes, IOByteCount length)
+{
+    IOByteCount done = 0;
+    for (IOMemoryDescriptor *descriptor : mDescriptors) {
+        IOByteCount size = descriptor->getLength();
+        if (offset < size && done < length) {
+            done += descriptor->readBytes(offset, (uint8_t *)bytes + done, length - done);
+            offset = 0;
+        } else {
+            offset -= offset < size ? offset : size;
+        }
+    }
+    return done;
+}
+
+/* ---- IOService ---- */
+
+bool IOService::init(OSDictionary *dictionary)
+{
+    mProperties = OSDictionary::withCapacity(16);
+    return mProperties != NULL;
+}
+
+void IOService::free()
+{
+    OSSafeReleaseNULL(mProperties);
+    OSObject::free();
+}
+
+bool IOService::setProperty(const char *key, OSObject *object)
+{
+    if (!mProperties) {
+        mProperties = OSDictionary::withCapacity(16);
+    }
+    return mProperties->setObject(key, object);
+}
+
+bool IOService::setProperty(const char *key, const char *string)
+{
+    OSString *object = OSString::withCString(string);
+    bool ret = setProperty(key, object);
+    object->release();
+    return ret;
+}
+
+bool IOService::setProperty(const char *key, bool value)
+{
+    return setProperty(key, value ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+bool IOService::setProperty(const char *key, unsigned long long value, unsigned int numberOfBits)
+{
+    OSNumber *object = OSNumber::withNumber(value, numberOfBits);
+    bool ret = setProperty(key, object);
+    object->release();
+    return ret;
+}
+
+void IOService::removeProperty(const char *key)
+{
+    if (mProperties) {
+        mProperties->removeObject(key);
+    }
+}
+
+OSObject *IOService::getProperty(const char *key) const
+{
+    return mProperties ? mProperties->getObject(key) : NULL;
+}
+
+const char *IOService::stringFromReturn(IOReturn rtn) const
+{
+    switch (rtn) {
+        case kIOReturnSuccess: return "success";
+        case kIOReturnError: return "general error";
+        case kIOReturnNoMemory: return "memory allocation error";
+        case kIOReturnTimeout: return "I/O timeout";
+        case kIOReturnAborted: return "operation aborted";
+        case kIOReturnNotResponding: return "device not responding";
+        case kIOReturnNotFound: return "data was not found";
+        case kIOUSBPipeStalled: return "pipe stalled";
+        default: return "unknown error";
+    }
+}
+
+/* ---- USB host family ---- */
+
+const EndpointDescriptor *StandardUSB::getNextEndpointDescriptor(const ConfigurationDescriptor *configurationDescriptor,
+                                                                 const InterfaceDescriptor *interfaceDescriptor,
+                                                                 const EndpointDescriptor *currentDescriptor)
+{
+    const EndpointDescriptor *next = currentDescriptor ? currentDescriptor + 1 : interfaceDescriptor->endpoints;
+    return next < interfaceDescriptor->endpoints + interfaceDescriptor->bNumEndpoints ? next : NULL;
+}
+
+IOUSBHostInterface::IOUSBHostInterface(HostUSBBackend *backend)
+: mBackend(backend)
+{
+    mConfiguration.bConfigurationValue = 1;
+    mInterface.bNumEndpoints = 3;
+    mInterface.endpoints[0] = { 0x81, kUSBInterrupt };
+    mInterface.endpoints[1] = { 0x02, kUSBBulk };
+    mInterface.endpoints[2] = { 0x82, kUSBBulk };
+}
+
+IOReturn IOUSBHostInterface::deviceRequest(StandardUSB::DeviceRequest &request, void *data, uint32_t &bytesTransferred,
+                                           uint32_t completionTimeoutMs)
+{
+    return mBackend ? mBackend->deviceRequest(request, data, bytesTransferred) : kIOReturnNotAttached;
+}
+
+IOUSBHostPipe *IOUSBHostInterface::copyPipe(uint8_t address)
+{
+    return new IOUSBHostPipe(mBackend, address);
+}
+
+bool IOUSBHostInterface::open(IOService *forClient, IOOptionBits options, void *arg)
+{
+    if (mOpen) {
+        return false;
+    }
+    mOpen = true;
+    return true;
+}
+
+void IOUSBHostInterface::close(IOService *forClient, IOOptionBits options)
+{
+    mOpen = false;
+}
+
+IOUSBHostDevice::IOUSBHostDevice(uint16_t productID, IOUSBHostInterface *interface)
+: mInterface(interface)
+{
+    mDevice.idVendor = 0x8087;
+    mDevice.idProduct = productID;
+    mDevice.bNumConfigurations = 1;
+    mConfiguration.bConfigurationValue = 1;
+    if (mInterface) {
+        mInterface->retain();
+    }
+}
+
+void IOUSBHostDevice::free()
+{
+    OSSafeReleaseNULL(mInterface);
+    IOService::free();
+}
+
+IOReturn IOUSBHostDevice::setConfiguration(uint8_t bConfigurationValue, bool matchInterfaces)
+{
+    if (bConfigurationValue && configurationFailures) {
+        configurationFailures--;
+        return kIOReturnNotResponding;
+    }
+    return kIOReturnSuccess;
+}
+
+bool IOUSBHostDevice::open(IOService *forClient, IOOptionBits options, void *arg)
+{
+    if (mOpen) {
+        return false;
+    }
+    mOpen = true;
+    return true;
+}
+
+void IOUSBHostDevice::close(IOService *forClient, IOOptionBits options)
+{
+    mOpen = false;
+}
+
+OSIterator *IOUSBHostDevice::getChildIterator(const IORegistryPlane *plane) const
+{
+    std::vector<OSObject *> children;
+    if (mInterface) {
+        children.push_back(mInterface);
+    }
+    return OSIterator::withObjects(children);
+}
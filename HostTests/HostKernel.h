@@ -0,0 +1,565 @@
+//
+//  HostKernel.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+//  Just enough of IOKit, libkern and the USB host family to build the
+//  driver sources as a user space program. The Makefile points every
+//  kernel header they include here. Objects are reference counted the
+//  way libkern does it, locks and thread calls run on pthreads, and
+//  absolute time is CLOCK_MONOTONIC in nanoseconds.
+//
+
+#ifndef HostKernel_h
+#define HostKernel_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+
+typedef uint8_t UInt8;
+typedef uint16_t UInt16;
+typedef uint32_t UInt32;
+typedef uint64_t UInt64;
+typedef int8_t SInt8;
+typedef int16_t SInt16;
+typedef int32_t SInt32;
+typedef int64_t SInt64;
+typedef int IOReturn;
+typedef int OSReturn;
+typedef int kern_return_t;
+typedef uint64_t AbsoluteTime;
+typedef uint32_t IOOptionBits;
+typedef uint64_t IOByteCount;
+typedef uint64_t mach_vm_size_t;
+typedef void *task_t;
+typedef int wait_result_t;
+
+extern task_t kernel_task;
+
+#define kIOReturnSuccess        0
+#define kIOReturnError          0x2bc
+#define kIOReturnNoMemory       0x2bd
+#define kIOReturnNoResources    0x2be
+#define kIOReturnNoDevice       0x2c0
+#define kIOReturnBadArgument    0x2c2
+#define kIOReturnUnsupported    0x2c7
+#define kIOReturnIOError        0x2ca
+#define kIOReturnBusy           0x2d5
+#define kIOReturnTimeout        0x2d6
+#define kIOReturnNotReady       0x2d8
+#define kIOReturnNotAttached    0x2dd
+#define kIOReturnAborted        0x2eb
+#define kIOReturnNotResponding  0x2ed
+#define kIOReturnNotFound       0x2f0
+#define kIOUSBPipeStalled       ((IOReturn)0xe000404f)
+#define kOSReturnSuccess        0
+#define kOSReturnError          0xdc000001
+
+#define THREAD_AWAKENED         0
+#define THREAD_TIMED_OUT        1
+#define THREAD_INTERRUPTED      2
+#define THREAD_UNINT            0
+#define THREAD_INTERRUPTIBLE    1
+#define THREAD_ABORTSAFE        2
+
+#define kNanosecondScale        1
+#define kMicrosecondScale       1000
+#define kMillisecondScale       1000000
+#define kSecondScale            1000000000
+
+#define kIOPMPowerOn            2
+#define IOPMAckImplied          0
+
+#define USBToHost16(x)          (x)
+#define HostToUSB16(x)          (x)
+#define USBToHost32(x)          (x)
+
+#define __unused
+
+enum IODirection {
+    kIODirectionNone = 0,
+    kIODirectionIn = 1,
+    kIODirectionOut = 2,
+    kIODirectionOutIn = 3,
+};
+
+/* ---- IOLib ---- */
+
+void IOLog(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void IOSleep(unsigned milliseconds);
+void IODelay(unsigned microseconds);
+void *IOMalloc(size_t size);
+void IOFree(void *address, size_t size);
+
+struct IOLock;
+IOLock *IOLockAlloc();
+void IOLockFree(IOLock *lock);
+void IOLockLock(IOLock *lock);
+void IOLockUnlock(IOLock *lock);
+int IOLockSleep(IOLock *lock, void *event, int interruptible);
+int IOLockSleepDeadline(IOLock *lock, void *event, AbsoluteTime deadline, int interruptible);
+void IOLockWakeup(IOLock *lock, void *event, bool oneThread);
+
+uint64_t mach_absolute_time();
+void clock_get_uptime(uint64_t *result);
+void clock_interval_to_deadline(uint32_t interval, uint32_t scale, uint64_t *result);
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t *result);
+void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t *result);
+
+SInt32 OSIncrementAtomic(volatile SInt32 *address);
+SInt32 OSDecrementAtomic(volatile SInt32 *address);
+SInt32 OSAddAtomic(SInt32 amount, volatile SInt32 *address);
+void OSMemoryBarrier(void);
+
+/* ---- Thread calls, each one runs on a thread of its own ---- */
+
+typedef void *thread_call_param_t;
+typedef struct HostThreadCall *thread_call_t;
+typedef void (*thread_call_func_t)(thread_call_param_t param0, thread_call_param_t param1);
+typedef int thread_call_priority_t;
+typedef int thread_call_options_t;
+#define THREAD_CALL_PRIORITY_HIGH       0
+#define THREAD_CALL_PRIORITY_KERNEL     1
+#define THREAD_CALL_OPTIONS_ONCE        0x1
+
+thread_call_t thread_call_allocate(thread_call_func_t func, thread_call_param_t param0);
+thread_call_t thread_call_allocate_with_options(thread_call_func_t func, thread_call_param_t param0,
+                                                thread_call_priority_t priority, thread_call_options_t options);
+bool thread_call_enter(thread_call_t call);
+bool thread_call_cancel(thread_call_t call);
+bool thread_call_cancel_wait(thread_call_t call);
+bool thread_call_free(thread_call_t call);
+
+/* ---- libkern containers ---- */
+
+class OSMetaClass {
+public:
+    const char *getClassName() const { return "HostObject"; }
+};
+
+class OSObject {
+public:
+    static const OSMetaClass *const metaClass;
+    OSObject();
+    virtual ~OSObject();
+    /* The kernel zero fills objects, drivers leave members to that */
+    static void *operator new(size_t size) { return calloc(1, size); }
+    static void operator delete(void *object) { ::free(object); }
+    virtual bool init() { return true; }
+    virtual void free();
+    void retain() const;
+    void release() const;
+    int getRetainCount() const { return mRetainCount; }
+private:
+    mutable std::atomic<int> mRetainCount;
+};
+
+class OSString : public OSObject {
+public:
+    static OSString *withCString(const char *string);
+    const char *getCStringNoCopy() const { return mString.c_str(); }
+    bool isEqualTo(const char *string) const { return mString == string; }
+private:
+    std::string mString;
+};
+
+class OSSymbol : public OSString {
+};
+
+class OSNumber : public OSObject {
+public:
+    static OSNumber *withNumber(unsigned long long value, unsigned int numberOfBits);
+    unsigned int unsigned32BitValue() const { return (unsigned int)mValue; }
+    unsigned long long unsigned64BitValue() const { return mValue; }
+private:
+    unsigned long long mValue;
+};
+
+class OSBoolean : public OSObject {
+public:
+    explicit OSBoolean(bool value) : mValue(value) {}
+    bool isTrue() const { return mValue; }
+private:
+    bool mValue;
+};
+
+extern OSBoolean *const kOSBooleanTrue;
+extern OSBoolean *const kOSBooleanFalse;
+
+class OSData : public OSObject {
+public:
+    static OSData *withBytes(const void *bytes, unsigned int length);
+    static OSData *withCapacity(unsigned int capacity);
+    const void *getBytesNoCopy() const { return mBytes.empty() ? NULL : mBytes.data(); }
+    unsigned int getLength() const { return (unsigned int)mBytes.size(); }
+    bool appendBytes(const void *bytes, unsigned int length);
+private:
+    std::vector<uint8_t> mBytes;
+};
+
+class OSArray : public OSObject {
+public:
+    static OSArray *withCapacity(unsigned int capacity);
+    void free() override;
+    bool setObject(const OSObject *object);
+    unsigned int getCount() const { return (unsigned int)mObjects.size(); }
+    OSObject *getObject(unsigned int index) const { return index < mObjects.size() ? mObjects[index] : NULL; }
+private:
+    std::vector<OSObject *> mObjects;
+};
+
+class OSDictionary : public OSObject {
+public:
+    static OSDictionary *withCapacity(unsigned int capacity);
+    void free() override;
+    bool setObject(const char *key, const OSObject *object);
+    OSObject *getObject(const char *key) const;
+    void removeObject(const char *key);
+    unsigned int getCount() const { return (unsigned int)mObjects.size(); }
+private:
+    std::map<std::string, OSObject *> mObjects;
+};
+
+class OSIterator : public OSObject {
+public:
+    static OSIterator *withObjects(const std::vector<OSObject *> &objects);
+    OSObject *getNextObject() { return mNext < mObjects.size() ? mObjects[mNext++] : NULL; }
+private:
+    std::vector<OSObject *> mObjects;
+    size_t mNext = 0;
+};
+
+#define OSDynamicCast(type, object) (dynamic_cast<type *>(object))
+#define OSSafeReleaseNULL(object) do { if (object) { (object)->release(); (object) = NULL; } } while (0)
+#define OSDeclareDefaultStructors(className) public: className(); virtual ~className(); private:
+#define OSDefineMetaClassAndStructors(className, superclassName) \
+className::className() {} \
+className::~className() {}
+
+/* ---- Kext resources ---- */
+
+typedef uint32_t OSKextRequestTag;
+typedef void (*OSKextRequestResourceCallback)(OSKextRequestTag requestTag, OSReturn result,
+                                              const void *resourceData, uint32_t resourceDataLength, void *context);
+const char *OSKextGetCurrentIdentifier(void);
+OSReturn OSKextRequestResource(const char *kextIdentifier, const char *resourceName,
+                               OSKextRequestResourceCallback callback, void *context, OSKextRequestTag *requestTagOut);
+
+/* ---- Memory descriptors ---- */
+
+class IOMemoryDescriptor : public OSObject {
+public:
+    static IOMemoryDescriptor *withAddress(void *address, IOByteCount length, IODirection direction);
+    virtual IOReturn prepare(IODirection direction = kIODirectionNone);
+    virtual IOReturn complete(IODirection direction = kIODirectionNone);
+    IOByteCount getLength() const { return mLength; }
+    /* Reads length bytes at offset, the host stand in for DMA */
+    virtual IOByteCount readBytes(IOByteCount offset, void *bytes, IOByteCount length);
+    IOByteCount writeBytes(IOByteCount offset, const void *bytes, IOByteCount length);
+protected:
+    uint8_t *mAddress = NULL;
+    IOByteCount mLength = 0;
+    int mPrepared = 0;
+};
+
+class IOBufferMemoryDescriptor : public IOMemoryDescriptor {
+public:
+    static IOBufferMemoryDescriptor *inTaskWithOptions(task_t inTask, IOOptionBits options,
+                                                       mach_vm_size_t capacity, mach_vm_size_t alignment = 1);
+    void free() override;
+    void *getBytesNoCopy() { return mAddress; }
+    void setLength(size_t length) { mLength = length <= mCapacity ? length : mCapacity; }
+private:
+    size_t mCapacity = 0;
+};
+
+class IOSubMemoryDescriptor : public IOMemoryDescriptor {
+public:
+    static IOSubMemoryDescriptor *withSubRange(IOMemoryDescriptor *of, IOByteCount offset, IOByteCount length,
+                                               IOOptionBits options);
+    /* Retargets the descriptor, the way the kernel's does */
+    bool initSubRange(IOMemoryDescriptor *parent, IOByteCount offset, IOByteCount length, IODirection withDirection);
+    void free() override;
+    IOReturn prepare(IODirection direction = kIODirectionNone) override;
+    IOReturn complete(IODirection direction = kIODirectionNone) override;
+    IOByteCount readBytes(IOByteCount offset, void *bytes, IOByteCount length) override;
+private:
+    IOMemoryDescriptor *mParent = NULL;
+    IOByteCount mStart = 0;
+};
+
+class IOMultiMemoryDescriptor : public IOMemoryDescriptor {
+public:
+    static IOMultiMemoryDescriptor *withDescriptors(IOMemoryDescriptor **descriptors, UInt32 withCount,
+                                                    IODirection withDirection, bool asReference = false);
+    /* Drops the descriptors it had, the way the kernel's does */
+    bool initWithDescriptors(IOMemoryDescriptor **descriptors, UInt32 withCount, IODirection withDirection,
+                             bool asReference = false);
+    void free() override;
+    IOReturn prepare(IODirection direction = kIODirectionNone) override;
+    IOReturn complete(IODirection direction = kIODirectionNone) override;
+    IOByteCount readBytes(IOByteCount offset, void *bytes, IOByteCount length) override;
+private:
+    void releaseDescriptors();
+    std::vector<IOMemoryDescriptor *> mDescriptors;
+};
+
+/* ---- IOService ---- */
+
+struct IOPMPowerState {
+    unsigned long version, capabilityFlags, outputPowerCharacter, inputPowerRequirement;
+    unsigned long staticPower, unbudgetedPower, powerToAttain, timeToAttain;
+    unsigned long settleUpTime, timeToLower, settleDownTime, powerDomainBudget;
+};
+
+class IORegistryPlane;
+extern const IORegistryPlane *gIOServicePlane;
+
+class IOService : public OSObject {
+public:
+    virtual bool init(OSDictionary *dictionary = NULL);
+    void free() override;
+    virtual IOService *probe(IOService *provider, SInt32 *score) { return this; }
+    virtual bool start(IOService *provider) { return true; }
+    virtual void stop(IOService *provider) {}
+    virtual IOReturn setPowerState(unsigned long powerStateOrdinal, IOService *whatDevice) { return IOPMAckImplied; }
+    virtual IOReturn setProperties(OSObject *properties) { return kIOReturnUnsupported; }
+    virtual bool open(IOService *forClient, IOOptionBits options = 0, void *arg = NULL) { return true; }
+    virtual void close(IOService *forClient, IOOptionBits options = 0) {}
+    virtual OSIterator *getChildIterator(const IORegistryPlane *plane) const { return OSIterator::withObjects({}); }
+    virtual const char *getName() const { return "IOService"; }
+
+    void PMinit() {}
+    void PMstop() {}
+    IOReturn registerPowerDriver(IOService *controllingDriver, IOPMPowerState *powerStates, unsigned long numberOfStates) { return kIOReturnSuccess; }
+    void joinPMtree(IOService *driver) {}
+    void makeUsable() {}
+    void registerService(IOOptionBits options = 0) { mRegistered = true; }
+    bool isRegistered() const { return mRegistered; }
+    /* Only marks the service, stopping and detaching it is up to the test */
+    virtual bool terminate(IOOptionBits options = 0) { mInactive = true; return true; }
+    bool isInactive() const { return mInactive; }
+
+    bool setProperty(const char *key, OSObject *object);
+    bool setProperty(const char *key, const char *string);
+    bool setProperty(const char *key, bool value);
+    bool setProperty(const char *key, unsigned long long value, unsigned int numberOfBits);
+    void removeProperty(const char *key);
+    OSObject *getProperty(const char *key) const;
+    const char *stringFromReturn(IOReturn rtn) const;
+
+private:
+    OSDictionary *mProperties = NULL;
+    bool mRegistered = false;
+    std::atomic<bool> mInactive{false};
+};
+
+/* ---- USB host family ---- */
+
+enum {
+    kUSBOut = 0,
+    kUSBIn = 1,
+};
+
+enum {
+    kUSBControl = 0,
+    kUSBIsoc = 1,
+    kUSBBulk = 2,
+    kUSBInterrupt = 3,
+};
+
+enum {
+    kRequestDirectionOut = 0,
+    kRequestDirectionIn = 1,
+};
+
+enum {
+    kRequestTypeStandard = 0,
+    kRequestTypeClass = 1,
+    kRequestTypeVendor = 2,
+};
+
+enum {
+    kRequestRecipientDevice = 0,
+    kRequestRecipientInterface = 1,
+};
+
+static inline uint8_t makeDeviceRequestbmRequestType(int direction, int type, int recipient)
+{
+    return (uint8_t)((direction << 7) | (type << 5) | recipient);
+}
+
+namespace StandardUSB {
+
+struct DeviceRequest {
+    uint8_t bmRequestType;
+    uint8_t bRequest;
+    uint16_t wValue;
+    uint16_t wIndex;
+    uint16_t wLength;
+};
+
+struct DeviceDescriptor {
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint8_t bNumConfigurations;
+};
+
+struct ConfigurationDescriptor {
+    uint8_t bConfigurationValue;
+};
+
+struct EndpointDescriptor {
+    uint8_t bEndpointAddress;
+    uint8_t bmAttributes;
+};
+
+struct InterfaceDescriptor {
+    uint8_t bNumEndpoints;
+    EndpointDescriptor endpoints[3];
+};
+
+const EndpointDescriptor *getNextEndpointDescriptor(const ConfigurationDescriptor *configurationDescriptor,
+                                                    const InterfaceDescriptor *interfaceDescriptor,
+                                                    const EndpointDescriptor *currentDescriptor);
+static inline uint8_t getEndpointAddress(const EndpointDescriptor *descriptor) { return descriptor->bEndpointAddress; }
+static inline uint8_t getEndpointDirection(const EndpointDescriptor *descriptor) { return descriptor->bEndpointAddress >> 7; }
+static inline uint8_t getEndpointType(const EndpointDescriptor *descriptor) { return descriptor->bmAttributes & 0x3; }
+
+}
+
+using StandardUSB::EndpointDescriptor;
+
+struct IOUSBHostCompletion {
+    void *owner;
+    void (*action)(void *owner, void *parameter, IOReturn status, uint32_t bytesTransferred);
+    void *parameter;
+};
+
+class IOUSBHostPipe;
+
+/* What a host test puts behind the pipes and control endpoint of an
+ * interface.
+ */
+class HostUSBBackend {
+public:
+    virtual ~HostUSBBackend() {}
+    virtual IOReturn deviceRequest(StandardUSB::DeviceRequest &request, void *data, uint32_t &bytesTransferred) = 0;
+    /* An asynchronous io, completion has to be called later from another thread */
+    virtual IOReturn io(IOUSBHostPipe *pipe, IOMemoryDescriptor *buffer, uint32_t length, IOUSBHostCompletion *completion) = 0;
+    virtual IOReturn io(IOUSBHostPipe *pipe, IOMemoryDescriptor *buffer, uint32_t length, uint32_t &bytesTransferred) = 0;
+    virtual IOReturn abort(IOUSBHostPipe *pipe, IOReturn withError) = 0;
+    virtual IOReturn clearStall(IOUSBHostPipe *pipe, bool withRequest) = 0;
+};
+
+class IOUSBHostPipe : public OSObject {
+public:
+    IOUSBHostPipe(HostUSBBackend *backend, uint8_t address) : mBackend(backend), mAddress(address) {}
+    uint8_t address() const { return mAddress; }
+    /* Without a completion the io is synchronous, as the driver's bulk writes expect */
+    IOReturn io(IOMemoryDescriptor *dataBuffer, uint32_t dataBufferLength, IOUSBHostCompletion *completion, uint32_t completionTimeoutMs = 0)
+    {
+        if (!completion) {
+            uint32_t bytesTransferred;
+            return io(dataBuffer, dataBufferLength, bytesTransferred, completionTimeoutMs);
+        }
+        return mBackend ? mBackend->io(this, dataBuffer, dataBufferLength, completion) : kIOReturnNotAttached;
+    }
+    IOReturn io(IOMemoryDescriptor *dataBuffer, uint32_t dataBufferLength, uint32_t &bytesTransferred, uint32_t completionTimeoutMs = 0)
+    {
+        return mBackend ? mBackend->io(this, dataBuffer, dataBufferLength, bytesTransferred) : kIOReturnNotAttached;
+    }
+    IOReturn abort(IOOptionBits options = 0, IOReturn withError = kIOReturnAborted, IOService *forClient = NULL)
+    {
+        return mBackend ? mBackend->abort(this, withError) : kIOReturnNotAttached;
+    }
+    IOReturn clearStall(bool withRequest)
+    {
+        return mBackend ? mBackend->clearStall(this, withRequest) : kIOReturnNotAttached;
+    }
+private:
+    HostUSBBackend *mBackend;
+    uint8_t mAddress;
+};
+
+class IOUSBHostInterface : public IOService {
+public:
+    /* Interrupt in 0x81, bulk out 0x02 and bulk in 0x82 as on the Intel parts */
+    explicit IOUSBHostInterface(HostUSBBackend *backend);
+    IOReturn deviceRequest(StandardUSB::DeviceRequest &request, void *data, uint32_t &bytesTransferred, uint32_t completionTimeoutMs = 5000);
+    const StandardUSB::ConfigurationDescriptor *getConfigurationDescriptor() { return &mConfiguration; }
+    const StandardUSB::InterfaceDescriptor *getInterfaceDescriptor() { return &mInterface; }
+    IOUSBHostPipe *copyPipe(uint8_t address);
+    bool open(IOService *forClient, IOOptionBits options = 0, void *arg = NULL) override;
+    void close(IOService *forClient, IOOptionBits options = 0) override;
+    bool isOpen() const { return mOpen; }
+private:
+    HostUSBBackend *mBackend;
+    StandardUSB::ConfigurationDescriptor mConfiguration;
+    StandardUSB::InterfaceDescriptor mInterface;
+    bool mOpen = false;
+};
+
+class IOUSBHostDevice : public IOService {
+public:
+    IOUSBHostDevice(uint16_t productID, IOUSBHostInterface *interface);
+    void free() override;
+    const char *getName() const override { return "Bluetooth USB Host Controller"; }
+    const StandardUSB::DeviceDescriptor *getDeviceDescriptor() { return &mDevice; }
+    const StandardUSB::ConfigurationDescriptor *getConfigurationDescriptor(uint8_t index) { return index ? NULL : &mConfiguration; }
+    IOReturn setConfiguration(uint8_t bConfigurationValue, bool matchInterfaces = true);
+    IOReturn reset() { mResets++; return kIOReturnSuccess; }
+    bool open(IOService *forClient, IOOptionBits options = 0, void *arg = NULL) override;
+    void close(IOService *forClient, IOOptionBits options = 0) override;
+    OSIterator *getChildIterator(const IORegistryPlane *plane) const override;
+
+    /* setConfiguration() to a configuration fails this many more times */
+    uint32_t configurationFailures = 0;
+    uint32_t resets() const { return mResets; }
+    bool isOpen() const { return mOpen; }
+private:
+    StandardUSB::DeviceDescriptor mDevice;
+    StandardUSB::ConfigurationDescriptor mConfiguration;
+    IOUSBHostInterface *mInterface;
+    uint32_t mResets = 0;
+    bool mOpen = false;
+};
+
+/* ---- What the tests look at ---- */
+
+struct HostKernelStats {
+    uint64_t mallocs;           /* IOMalloc calls */
+    uint64_t mallocBytes;
+    uint64_t liveBytes;         /* IOMalloc bytes not freed yet */
+    uint64_t peakLiveBytes;
+    uint64_t objects;           /* OSObjects created */
+    uint64_t dataBytes;         /* bytes held by OSData created */
+};
+
+void HostKernelGetStats(HostKernelStats *stats);
+
+/* Resets peakLiveBytes to liveBytes */
+void HostKernelResetPeak();
+
+/* IOLog goes to stdout while verbose, nowhere otherwise */
+void HostKernelSetVerbose(bool verbose);
+
+/* OSKextRequestResource() serves files of this directory, NULL fails every request */
+void HostKernelSetResourceDirectory(const char *path);
+
+/* Replaces the embedded container by the one FwGenerator wrote to path,
+ * mapped read only
+ */
+bool HostKernelLoadContainer(const char *path);
+
+#endif /* HostKernel_h */
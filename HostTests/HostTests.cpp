@@ -0,0 +1,1170 @@
+//
+//  HostTests.cpp
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+//  Runs the driver against FakeController: every container FwGenerator
+//  can build, both download flows. Usage: HostTests <build dir> [-v | -b],
+//  -b runs the benchmarks instead
+//
+
+#include "BtIntel.h"
+#include "IntelBluetoothFirmware.hpp"
+#include "FakeController.h"
+#include "USBTransport.h"
+#include <atomic>
+#include <chrono>
+#include <dirent.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef HOST_FW_DIR
+#define HOST_FW_DIR "../IntelBluetoothFirmware/fw"
+#endif
+
+static const char *sBuildDir;
+static int sFailures;
+static int sChecks;
+
+#define CHECK(condition, fmt, ...) check((condition), "%s:%d: " fmt, __FILE__, __LINE__, ##__VA_ARGS__)
+
+static bool check(bool condition, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static bool check(bool condition, const char *fmt, ...)
+{
+    sChecks++;
+    if (!condition) {
+        va_list args;
+        va_start(args, fmt);
+        printf("    FAIL ");
+        vprintf(fmt, args);
+        printf("\n");
+        va_end(args);
+        sFailures++;
+    }
+    return condition;
+}
+
+static std::vector<uint8_t> readFile(const std::string &path)
+{
+    std::vector<uint8_t> bytes;
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return bytes;
+    }
+    uint8_t buffer[65536];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        bytes.insert(bytes.end(), buffer, buffer + length);
+    }
+    fclose(file);
+    return bytes;
+}
+
+static std::vector<uint8_t> readFirmware(const char *name)
+{
+    return readFile(std::string(HOST_FW_DIR) + "/" + name);
+}
+
+static bool loadContainer(const char *name)
+{
+    std::string path = std::string(sBuildDir) + "/" + name;
+    return HostKernelLoadContainer(path.c_str());
+}
+
+/* The driver with its transport to the controller swapped for the fake */
+class HostFirmware : public IntelBluetoothFirmware {
+
+public:
+
+    FakeController *controller;
+
+    BtTransport *createTransport() override
+    {
+        BtTransport *transport = controller->createTransport();
+        if (transport) {
+            transport->setReadAction(this, onRead);
+        }
+        return transport;
+    }
+
+    unsigned long long number(const char *key)
+    {
+        OSNumber *value = OSDynamicCast(OSNumber, getProperty(key));
+        return value ? value->unsigned64BitValue() : 0;
+    }
+
+    bool loaded() { return getProperty("FirmwareLoaded") == kOSBooleanTrue; }
+};
+
+/* Attaches a driver to a device of productID backed by controller and
+ * runs the download synchronously in start(), or on the download thread
+ * call and waits for it. The device reported whether it came up in loaded.
+ */
+struct Attach {
+    bool probed;
+    bool started;
+    bool loaded;
+    unsigned long long downloadMs;
+    unsigned long long startUs;
+    unsigned long long loadedUs;          /* from the call to start() */
+    uint32_t fragments;
+    uint32_t resumes;
+    unsigned long long bytesCopied;
+};
+
+static Attach attach(FakeController &controller, uint16_t productID, void (*inspect)(HostFirmware *driver) = NULL,
+                     bool synchronous = true)
+{
+    Attach result;
+    bzero(&result, sizeof(result));
+    IOUSBHostInterface *interface = new IOUSBHostInterface(NULL);
+    IOUSBHostDevice *device = new IOUSBHostDevice(productID, interface);
+    interface->release();
+    HostFirmware *driver = new HostFirmware;
+    driver->controller = &controller;
+    driver->init();
+    driver->setProperty("SynchronousDownload", synchronous);
+    SInt32 score = 0;
+    result.probed = driver->probe(device, &score) == driver;
+    unsigned long long begin = mach_absolute_time();
+    if (result.probed) {
+        result.started = driver->start(device);
+    }
+    for (int waited = 0; result.started && !synchronous && !driver->loaded() && waited < 10000; waited++) {
+        usleep(1000);
+    }
+    result.loadedUs = (mach_absolute_time() - begin) / 1000;
+    if (result.started) {
+        result.loaded = driver->loaded() && device->getProperty("FirmwareLoaded") == kOSBooleanTrue;
+        result.downloadMs = driver->number("DownloadTime");
+        result.startUs = driver->number("StartLatency");
+        result.fragments = (uint32_t)driver->number("SecureSendFragments");
+        result.resumes = (uint32_t)driver->number("SecureSendResumes");
+        result.bytesCopied = driver->number("SecureSendBytesCopied");
+        if (inspect) {
+            inspect(driver);
+        }
+        driver->stop(device);
+    }
+    driver->release();
+    device->release();
+    return result;
+}
+
+/* FirmwareLoadStats of the last attach, kept by keepLoadStats */
+struct LoadStats {
+    bool published;
+    unsigned long long downloadMs;
+    unsigned long long phaseUs[8];
+    unsigned long long readyMs;
+    unsigned long long bootMs;
+    unsigned long long readyLatency;
+    unsigned long long bootLatency;
+};
+
+static LoadStats sLoadStats;
+static const char *const *sPhases;
+
+/* No Reset, the readiness probe already reset the controller */
+static const char *const kLegacyPhases[] = {
+    "GetIntelVersion", "EnterMfg", "LoadFW", "ExitMfg", "SetEventMask", NULL
+};
+
+static const char *const kNewPhases[] = {
+    "GetVersion", "GetBootParams", "LoadFW", "IntelReset", "SetEventMask", NULL
+};
+
+static unsigned long long dictNumber(OSDictionary *dict, const char *key, bool *present = NULL)
+{
+    OSNumber *value = dict ? OSDynamicCast(OSNumber, dict->getObject(key)) : NULL;
+    if (present) {
+        *present = value != NULL;
+    }
+    return value ? value->unsigned64BitValue() : 0;
+}
+
+/* Reads FirmwareLoadStats and the latencies published next to it for
+ * the phases in sPhases.
+ */
+static void keepLoadStats(HostFirmware *driver)
+{
+    bzero(&sLoadStats, sizeof(sLoadStats));
+    OSDictionary *stats = OSDynamicCast(OSDictionary, driver->getProperty("FirmwareLoadStats"));
+    OSDictionary *phases = stats ? OSDynamicCast(OSDictionary, stats->getObject("PhaseUs")) : NULL;
+    sLoadStats.published = stats && phases;
+    sLoadStats.downloadMs = dictNumber(stats, "DownloadMs");
+    for (int i = 0; sPhases[i]; i++) {
+        sLoadStats.phaseUs[i] = dictNumber(phases, sPhases[i]);
+    }
+    sLoadStats.readyMs = dictNumber(stats, "ReadyMs");
+    sLoadStats.bootMs = dictNumber(stats, "BootMs");
+    sLoadStats.readyLatency = driver->number("ReadyLatency");
+    sLoadStats.bootLatency = driver->number("BootLatency");
+}
+
+/* Every phase the download went through took time, and together no more
+ * than the download. DownloadTime is in whole ms, the phases in us.
+ */
+static void checkLoadStats(const char *container, const Attach &result, bool booted)
+{
+    CHECK(sLoadStats.published, "%s: no FirmwareLoadStats with PhaseUs", container);
+    CHECK(sLoadStats.downloadMs == result.downloadMs, "%s: DownloadMs %llu, DownloadTime %llu", container,
+          sLoadStats.downloadMs, result.downloadMs);
+    unsigned long long totalUs = 0;
+    for (int i = 0; sPhases[i]; i++) {
+        CHECK(sLoadStats.phaseUs[i], "%s: phase %s missing", container, sPhases[i]);
+        totalUs += sLoadStats.phaseUs[i];
+    }
+    CHECK(totalUs < (result.downloadMs + 1) * 1000, "%s: phases took %llu us, the download %llu ms", container,
+          totalUs, result.downloadMs);
+    CHECK(sLoadStats.readyLatency && sLoadStats.readyMs == sLoadStats.readyLatency, "%s: ReadyLatency %llu, "
+          "ReadyMs %llu", container, sLoadStats.readyLatency, sLoadStats.readyMs);
+    CHECK(!booted || (sLoadStats.bootLatency && sLoadStats.bootMs == sLoadStats.bootLatency), "%s: BootLatency %llu, "
+          "BootMs %llu", container, sLoadStats.bootLatency, sLoadStats.bootMs);
+    CHECK(sLoadStats.readyMs + sLoadStats.bootMs <= result.downloadMs, "%s: ready %llu ms and boot %llu ms in a %llu ms "
+          "download", container, sLoadStats.readyMs, sLoadStats.bootMs, result.downloadMs);
+}
+
+static IntelVersion legacyVersion(const char *bseq)
+{
+    unsigned values[8] = {};
+    IntelVersion version;
+    bzero(&version, sizeof(version));
+    sscanf(bseq, "ibt-hw-%x.%x.%x-fw-%x.%x.%x.%x.%x.bseq", &values[0], &values[1], &values[2], &values[3],
+           &values[4], &values[5], &values[6], &values[7]);
+    version.hw_platform = values[0];
+    version.hw_variant = values[1];
+    version.hw_revision = values[2];
+    version.fw_variant = values[3];
+    version.fw_revision = values[4];
+    version.fw_build_num = values[5];
+    version.fw_build_ww = values[6];
+    version.fw_build_yy = values[7];
+    return version;
+}
+
+static IntelVersion bootloaderVersion(uint8_t hw_variant, uint8_t hw_revision, uint8_t fw_revision)
+{
+    IntelVersion version;
+    bzero(&version, sizeof(version));
+    version.hw_platform = 0x37;
+    version.hw_variant = hw_variant;
+    version.hw_revision = hw_revision;
+    version.fw_variant = 0x06;
+    version.fw_revision = fw_revision;
+    return version;
+}
+
+static IntelBootParams bootParams(uint16_t dev_revid)
+{
+    IntelBootParams params;
+    bzero(&params, sizeof(params));
+    params.dev_revid = dev_revid;
+    params.secure_boot = 1;
+    return params;
+}
+
+static void testLegacyDownload(const char *container)
+{
+    static const char *kBseq = "ibt-hw-37.8.10-fw-22.50.19.14.f.bseq";
+    FakeController controller;
+    controller.setLegacy(legacyVersion(kBseq), readFirmware(kBseq));
+    /* Long enough to show in the ms latencies */
+    controller.readyAfterMs = 20;
+    sPhases = kLegacyPhases;
+    Attach result = attach(controller, 0x0a2a, keepLoadStats);
+    FakeControllerStats stats = controller.stats();
+    CHECK(result.probed && result.started, "%s: driver did not start", container);
+    checkLoadStats(container, result, false);
+    CHECK(result.loaded, "%s: FirmwareLoaded not set", container);
+    CHECK(stats.patched, "%s: %u patch commands, controller left unpatched", container, stats.patchCommands);
+    CHECK(!stats.patchMismatches, "%s: %u commands off the patch", container, stats.patchMismatches);
+    CHECK(!stats.inManufacturerMode, "%s: controller left in manufacturer mode", container);
+    printf("    %s: %u patch commands, download %llu ms\n", container, stats.patchCommands, result.downloadMs);
+}
+
+/* Product IDs of the legacy parts by hw_variant */
+static uint16_t legacyProduct(uint8_t hw_variant)
+{
+    return hw_variant == 0x07 ? 0x07dc : 0x0aa7;
+}
+
+/* Every .bseq of the container against a controller reporting its key,
+ * the patch has to run to the end whatever events its commands list.
+ */
+static void testEveryPatch(const char *container)
+{
+    const FwContainerHeader *header = getFWContainer();
+    uint32_t patches = 0;
+    uint32_t commands = 0;
+    for (uint32_t i = 0; header && i < header->entryCount; i++) {
+        const FwContainerEntry *entry = FwContainerEntryAt(header, i);
+        if (!entry || entry->type != kFwImageBseq) {
+            continue;
+        }
+        IntelVersion version;
+        if (entry->keyKind == kFwKeyBseq) {
+            version = legacyVersion(entry->name);
+        } else {
+            /* A firmware build no specific patch exists for */
+            memset(&version, 0xee, sizeof(version));
+            version.status = 0;
+            version.fw_patch_num = 0;
+            version.hw_platform = (uint8_t)(entry->key >> 8);
+            version.hw_variant = (uint8_t)entry->key;
+        }
+        FwView image(header, i);
+        for (int c = 0; c < image.patchCount(); c++) {
+            bool complete = false;
+            const uint8_t *stream = NULL;
+            std::vector<uint8_t> bseq = readFirmware(entry->name);
+            stream = bseq.data() + image.patch()[c].offset + image.patch()[c].plen;
+            for (uint8_t e = 0; e < image.patch()[c].events; e++) {
+                complete |= stream[1] == HCI_EV_CMD_COMPLETE;
+                stream += 3 + stream[2];
+            }
+            CHECK(complete == !(image.patch()[c].flags & kFwPatchAnyEvent), "%s: %s command %d 0x%04x flags 0x%x",
+                  container, entry->name, c, image.patch()[c].opcode, image.patch()[c].flags);
+        }
+        FakeController controller;
+        controller.setLegacy(version, readFirmware(entry->name));
+        Attach result = attach(controller, legacyProduct(version.hw_variant));
+        FakeControllerStats stats = controller.stats();
+        CHECK(result.loaded, "%s: %s FirmwareLoaded not set", container, entry->name);
+        CHECK(stats.patched && stats.patchCommands == (uint32_t)image.patchCount(), "%s: %s %u of %d patch commands",
+              container, entry->name, stats.patchCommands, image.patchCount());
+        CHECK(!stats.patchMismatches, "%s: %s %u commands off the patch", container, entry->name, stats.patchMismatches);
+        CHECK(!stats.inManufacturerMode, "%s: %s left in manufacturer mode", container, entry->name);
+        patches++;
+        commands += stats.patchCommands;
+    }
+    CHECK(patches == 9, "%s: %u patches", container, patches);
+    printf("    %s: %u patches, %u commands\n", container, patches, commands);
+}
+
+/* A legacy part that wants HCI_Reset first and answers it late: probing
+ * it with anything else only ever times out, and a late answer to a probe
+ * must not be taken for the answer to a later command.
+ */
+static void testLegacySlowReset(const char *container)
+{
+    static const char *kBseq = "ibt-hw-37.8.10-fw-22.50.19.14.f.bseq";
+    FakeController controller;
+    controller.setLegacy(legacyVersion(kBseq), readFirmware(kBseq));
+    controller.resetFirst = true;
+    controller.slowOpcodes = { HCI_OP_RESET };
+    controller.slowDelayMs = 120;
+    unsigned long long begin = mach_absolute_time();
+    Attach result = attach(controller, 0x0a2a);
+    unsigned long long elapsedMs = (mach_absolute_time() - begin) / 1000000;
+    FakeControllerStats stats = controller.stats();
+    CHECK(result.loaded, "%s: FirmwareLoaded not set", container);
+    CHECK(stats.patched && !stats.patchMismatches, "%s: patch incomplete", container);
+    CHECK(stats.versionReads == 1, "%s: %u version reads", container, stats.versionReads);
+    /* Version probes would go unanswered until the 3 s budget ran out */
+    CHECK(elapsedMs < 1000, "%s: took %llu ms", container, elapsedMs);
+    printf("    %s: %u resets, ready after %llu ms\n", container, stats.resets, elapsedMs);
+}
+
+static void testLegacyPatched(const char *container)
+{
+    FakeController controller;
+    IntelVersion version = legacyVersion("ibt-hw-37.8.10-fw-22.50.19.14.f.bseq");
+    version.fw_patch_num = 1;
+    controller.setLegacy(version, std::vector<uint8_t>());
+    Attach result = attach(controller, 0x0a2a);
+    FakeControllerStats stats = controller.stats();
+    CHECK(result.loaded, "%s: FirmwareLoaded not set", container);
+    CHECK(!stats.patchCommands && !stats.inManufacturerMode, "%s: patched controller patched again", container);
+}
+
+static void testNewDownload(const char *container)
+{
+    FakeController controller;
+    std::vector<uint8_t> sfi = readFirmware("ibt-18-16-1.sfi");
+    controller.setBootloader(bootloaderVersion(0x12, 16, 1), bootParams(0), sfi);
+    controller.readyAfterMs = 20;
+    controller.bootDelayMs = 20;
+    sPhases = kNewPhases;
+    Attach result = attach(controller, 0x0025, keepLoadStats);
+    FakeControllerStats stats = controller.stats();
+    CHECK(result.probed && result.started, "%s: driver did not start", container);
+    checkLoadStats(container, result, true);
+    CHECK(result.loaded, "%s: FirmwareLoaded not set", container);
+    CHECK(stats.downloaded, "%s: image incomplete after %u fragments", container, stats.fragments);
+    CHECK(stats.booted, "%s: operational firmware not booted", container);
+    CHECK(!stats.duplicates && !stats.corrupt, "%s: %u duplicate and %u corrupt fragments", container,
+          stats.duplicates, stats.corrupt);
+    CHECK(!stats.bootloaderResets, "%s: reset to the bootloader", container);
+    /* Moving the read between pipes must not touch bulk out */
+    CHECK(!stats.transportAborts, "%s: %u aborts of every pipe", container, stats.transportAborts);
+    CHECK(stats.aborts, "%s: read never moved between pipes", container);
+    CHECK(result.fragments == stats.fragments, "%s: driver counted %u fragments, controller took %u", container,
+          result.fragments, stats.fragments);
+    /* A raw image goes out from where it is embedded. Packed ones are
+     * decoded and then copied into the wired buffer.
+     */
+    if (!strcmp(container, "container-raw.bin")) {
+        CHECK(!result.bytesCopied, "%s: %llu bytes copied", container, result.bytesCopied);
+    } else {
+        unsigned long long floor = 2 * (unsigned long long)(sfi.size() - FW_SFI_HEADER_LEN);
+        CHECK(result.bytesCopied >= floor, "%s: %llu bytes copied, at least %llu were", container,
+              result.bytesCopied, floor);
+    }
+    printf("    %s: %u fragments, %llu bytes copied, download %llu ms\n", container, stats.fragments,
+           result.bytesCopied, result.downloadMs);
+}
+
+/* Memory a download took on top of what was live before it */
+struct Footprint {
+    unsigned long long peakBytes;         /* IOMalloc */
+    unsigned long long dataBytes;         /* OSData */
+    uint32_t imageBytes;
+};
+
+static Footprint footprint(FakeController &controller, uint16_t productID, uint32_t imageBytes)
+{
+    HostKernelStats before, after;
+    HostKernelResetPeak();
+    HostKernelGetStats(&before);
+    Attach result = attach(controller, productID);
+    HostKernelGetStats(&after);
+    CHECK(result.loaded, "download for 0x%04x failed", productID);
+    Footprint footprint = { after.peakLiveBytes - before.liveBytes, after.dataBytes - before.dataBytes, imageBytes };
+    return footprint;
+}
+
+static void testFootprint(const char *container)
+{
+    static const char *kBseq = "ibt-hw-37.8.10-fw-22.50.19.14.f.bseq";
+    FakeController legacy;
+    std::vector<uint8_t> bseq = readFirmware(kBseq);
+    legacy.setLegacy(legacyVersion(kBseq), bseq);
+    Footprint small = footprint(legacy, 0x0a2a, (uint32_t)bseq.size());
+
+    FakeController bootloader;
+    std::vector<uint8_t> sfi = readFirmware("ibt-18-16-1.sfi");
+    bootloader.setBootloader(bootloaderVersion(0x12, 16, 1), bootParams(0), sfi);
+    Footprint large = footprint(bootloader, 0x0025, (uint32_t)sfi.size());
+
+    /* Past the buffer the trace is drained into, a load holds at most the
+     * decode windows of the image and of a delta's base. Those are never
+     * larger than the image, nor than FW_LZ_BLOCK_WINDOWS blocks.
+     */
+    const Footprint *loads[] = { &small, &large };
+    for (const Footprint *load : loads) {
+        unsigned long long windows = load->imageBytes < FW_LZ_BLOCK_WINDOWS * FW_LZ_BLOCK_SIZE ? load->imageBytes :
+                           FW_LZ_BLOCK_WINDOWS * FW_LZ_BLOCK_SIZE;
+        unsigned long long bound = BT_TRACE_ENTRIES * sizeof(BtTraceRecord) + 4096 + 2 * windows;
+        CHECK(load->peakBytes <= bound, "%s: %llu bytes peak for %u bytes of image, at most %llu", container,
+              load->peakBytes, load->imageBytes, bound);
+    }
+    CHECK(large.dataBytes < 4096 && small.dataBytes < 4096, "%s: %llu and %llu bytes of OSData", container,
+          large.dataBytes, small.dataBytes);
+    printf("    %s: peak %llu bytes for %u bytes of image, %llu for %u\n", container, large.peakBytes,
+           large.imageBytes, small.peakBytes, small.imageBytes);
+}
+
+static void testSecureSendLateAck(const char *container)
+{
+    /* The first ack comes after the driver gave up waiting for it once */
+    FakeController controller;
+    controller.setBootloader(bootloaderVersion(0x12, 16, 1), bootParams(0), readFirmware("ibt-18-16-1.sfi"));
+    controller.slowOpcodes.insert(HCI_OP_INTEL_SECURE_SEND);
+    controller.slowDelayMs = 2500;
+    Attach result = attach(controller, 0x0025);
+    FakeControllerStats stats = controller.stats();
+    CHECK(result.loaded && stats.booted, "%s: download did not survive a late ack", container);
+    CHECK(result.resumes >= 1, "%s: no resume", container);
+    CHECK(!stats.duplicates && !stats.corrupt, "%s: %u duplicate and %u corrupt fragments", container,
+          stats.duplicates, stats.corrupt);
+    CHECK(!stats.bootloaderResets, "%s: reset to the bootloader", container);
+    CHECK(result.fragments == stats.fragments && stats.fragments == 2708, "%s: driver counted %u fragments, "
+          "controller took %u", container, result.fragments, stats.fragments);
+    printf("    %s: %u resumes, download %llu ms\n", container, result.resumes, result.downloadMs);
+}
+
+static void testSecureSendLostAck(const char *container)
+{
+    /* Nothing tells whether the bootloader kept the fragment, so it is
+     * never sent twice and the download starts over from the bootloader.
+     */
+    FakeController controller;
+    controller.setBootloader(bootloaderVersion(0x12, 16, 1), bootParams(0), readFirmware("ibt-18-16-1.sfi"));
+    controller.dropAcks.insert(100);
+    Attach result = attach(controller, 0x0025);
+    FakeControllerStats stats = controller.stats();
+    CHECK(!result.loaded, "%s: loaded without an ack", container);
+    CHECK(stats.acksDropped == 1, "%s: %u acks dropped", container, stats.acksDropped);
+    CHECK(!stats.duplicates && !stats.corrupt, "%s: %u duplicate and %u corrupt fragments", container,
+          stats.duplicates, stats.corrupt);
+    CHECK(stats.bootloaderResets == 1, "%s: %u resets to the bootloader", container, stats.bootloaderResets);
+    CHECK(stats.fragments == 2708, "%s: controller took %u fragments", container, stats.fragments);
+}
+
+/* Pipes whose bulk in is stalled until clearStall(true) was tried
+ * clearFailures + 1 times, each attempt taking clearMs.
+ */
+class StallBackend : public HostUSBBackend {
+
+public:
+
+    uint32_t clearFailures = 0;
+    uint32_t clearMs = 0;
+    std::atomic<bool> stalled{true};
+    std::atomic<uint32_t> reads{0};
+    std::atomic<uint32_t> clears{0};
+    std::atomic<bool> clearedOnCaller{false};
+    std::thread::id caller;
+    IOUSBHostCompletion *posted = NULL;
+    IOMemoryDescriptor *written = NULL;     /* by the last bulk out write */
+    uint8_t wire[512];                      /* what it put on the wire */
+    uint32_t writes = 0;
+    std::mutex lock;
+
+    IOReturn deviceRequest(StandardUSB::DeviceRequest &request, void *data, uint32_t &bytesTransferred) override
+    {
+        return kIOReturnSuccess;
+    }
+
+    IOReturn io(IOUSBHostPipe *pipe, IOMemoryDescriptor *buffer, uint32_t length, IOUSBHostCompletion *completion) override
+    {
+        if (stalled) {
+            return kIOUSBPipeStalled;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        reads++;
+        posted = completion;
+        return kIOReturnSuccess;
+    }
+
+    IOReturn io(IOUSBHostPipe *pipe, IOMemoryDescriptor *buffer, uint32_t length, uint32_t &bytesTransferred) override
+    {
+        written = buffer;
+        writes++;
+        bytesTransferred = (uint32_t)buffer->readBytes(0, wire, length < sizeof(wire) ? length : sizeof(wire));
+        return kIOReturnSuccess;
+    }
+
+    IOReturn abort(IOUSBHostPipe *pipe, IOReturn withError) override
+    {
+        complete(withError);
+        return kIOReturnSuccess;
+    }
+
+    IOReturn clearStall(IOUSBHostPipe *pipe, bool withRequest) override
+    {
+        if (std::this_thread::get_id() == caller) {
+            clearedOnCaller = true;
+        }
+        usleep(clearMs * 1000);
+        if (clears++ < clearFailures) {
+            return kIOReturnNotResponding;
+        }
+        stalled = false;
+        return kIOReturnSuccess;
+    }
+
+    /* Completes the posted read, if any */
+    void complete(IOReturn status)
+    {
+        IOUSBHostCompletion *completion;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            completion = posted;
+            posted = NULL;
+        }
+        if (completion) {
+            completion->action(completion->owner, completion->parameter, status, 0);
+        }
+    }
+};
+
+struct StallReads {
+    std::atomic<uint32_t> completed{0};
+    std::atomic<uint32_t> aborted{0};
+
+    static void onRead(void *owner, IOReturn status, const void *data, uint32_t length)
+    {
+        StallReads *that = (StallReads *)owner;
+        (status == kIOReturnAborted ? that->aborted : that->completed)++;
+    }
+};
+
+static bool waitFor(const std::atomic<uint32_t> &value, uint32_t expected, uint32_t timeoutMs)
+{
+    for (uint32_t ms = 0; value < expected && ms < timeoutMs; ms++) {
+        usleep(1000);
+    }
+    return value >= expected;
+}
+
+static USBTransport *stallTransport(StallBackend &backend, StallReads &reads, IOService *client)
+{
+    IOUSBHostInterface *interface = new IOUSBHostInterface(&backend);
+    USBTransport *transport = new USBTransport(client, interface);
+    transport->setReadAction(&reads, StallReads::onRead);
+    if (!transport->init()) {
+        delete transport;
+        transport = NULL;
+    }
+    interface->release();
+    return transport;
+}
+
+static void testStallRecovery(const char *container)
+{
+    IOService *client = new IOService;
+
+    /* Cleared off the thread that posted the read, which does not wait */
+    {
+        StallBackend backend;
+        StallReads reads;
+        backend.clearFailures = 3;
+        backend.clearMs = 5;
+        backend.caller = std::this_thread::get_id();
+        USBTransport *transport = stallTransport(backend, reads, client);
+        if (!CHECK(transport, "can not create a USB transport")) {
+            client->release();
+            return;
+        }
+        auto begin = std::chrono::steady_clock::now();
+        bool posted = transport->bulkRead();
+        auto took = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin);
+        CHECK(posted, "stalled read not posted");
+        CHECK(took.count() < 10, "posting a stalled read took %lld ms", (long long)took.count());
+        CHECK(waitFor(backend.reads, 1, 1000), "read not posted once the stall cleared");
+        CHECK(!backend.clearedOnCaller, "stall cleared on the thread posting the read");
+        backend.complete(kIOReturnSuccess);
+        CHECK(reads.completed == 1 && !reads.aborted, "%u reads completed, %u aborted",
+              reads.completed.load(), reads.aborted.load());
+        BtStallStats stats[kBtPipeCount];
+        transport->getStallStats(stats);
+        CHECK(stats[kBtPipeBulkIn].stalls == 1 && stats[kBtPipeBulkIn].recovered == 1 &&
+              stats[kBtPipeBulkIn].clears == 4, "bulk in %u stalls, %u recovered, %u clears",
+              stats[kBtPipeBulkIn].stalls, stats[kBtPipeBulkIn].recovered, stats[kBtPipeBulkIn].clears);
+        delete transport;
+    }
+
+    /* Aborting the read while its stall is cleared reports it once and
+     * posts nothing afterwards.
+     */
+    {
+        StallBackend backend;
+        StallReads reads;
+        backend.clearFailures = 2;
+        backend.clearMs = 20;
+        USBTransport *transport = stallTransport(backend, reads, client);
+        if (CHECK(transport, "can not create a USB transport")) {
+            CHECK(transport->bulkRead(), "stalled read not posted");
+            usleep(5000);
+            transport->abortRead(true);
+            CHECK(reads.aborted == 1, "%u aborted reads reported", reads.aborted.load());
+            usleep(200000);
+            CHECK(!backend.reads && reads.aborted == 1 && !reads.completed,
+                  "cancelled read went on: %u posted, %u aborted, %u completed", backend.reads.load(),
+                  reads.aborted.load(), reads.completed.load());
+            delete transport;
+        }
+    }
+
+    /* Going away waits for a recovery still clearing the halt */
+    {
+        StallBackend backend;
+        StallReads reads;
+        backend.clearMs = 50;
+        USBTransport *transport = stallTransport(backend, reads, client);
+        if (CHECK(transport, "can not create a USB transport")) {
+            CHECK(transport->bulkRead(), "stalled read not posted");
+            usleep(10000);
+            delete transport;
+            CHECK(!backend.reads, "read posted after the transport went away");
+        }
+    }
+    client->release();
+}
+
+static void testBulkBuffer(const char *container)
+{
+    IOService *client = new IOService;
+    StallBackend backend;
+    StallReads reads;
+    backend.stalled = false;
+    USBTransport *transport = stallTransport(backend, reads, client);
+    if (!CHECK(transport, "can not create a USB transport")) {
+        client->release();
+        return;
+    }
+    /* Writes are synchronous, the one wired buffer is free again after each */
+    IOMemoryDescriptor *wired = NULL;
+    for (int i = 0; i < 3; i++) {
+        uint8_t *bytes = transport->acquireBulkBuffer(HCI_COMMAND_HDR_SIZE + 253);
+        CHECK(bytes, "wired buffer not free for write %d", i);
+        CHECK(!transport->acquireBulkBuffer(4), "wired buffer handed out twice");
+        if (!bytes) {
+            break;
+        }
+        memset(bytes, i, HCI_COMMAND_HDR_SIZE + 253);
+        CHECK(transport->bulkWrite(bytes, HCI_COMMAND_HDR_SIZE + 253) == kIOReturnSuccess, "bulk write %d failed", i);
+        CHECK(!wired || backend.written == wired, "write %d did not go out of the wired buffer", i);
+        wired = backend.written;
+    }
+    uint32_t hits, misses;
+    transport->getBulkBufferStats(&hits, &misses);
+    CHECK(hits == 3 && !misses && !transport->bytesCopied(), "%u hits, %u misses, %llu bytes copied", hits, misses,
+          (unsigned long long)transport->bytesCopied());
+
+    /* Bytes from elsewhere are copied into it */
+    uint8_t command[8] = { 0x09, 0xfc, 0x05 };
+    CHECK(transport->bulkWrite(command, sizeof(command)) == kIOReturnSuccess && backend.written == wired,
+          "bulk write of a stack buffer did not use the wired buffer");
+    transport->getBulkBufferStats(&hits, &misses);
+    CHECK(hits == 4 && !misses && transport->bytesCopied() == sizeof(command), "%u hits, %u misses, %llu bytes copied",
+          hits, misses, (unsigned long long)transport->bytesCopied());
+
+    /* Fragments of a mapped image go out from where they are, through
+     * descriptors allocated once by mapImage()
+     */
+    std::vector<uint8_t> image = readFirmware("ibt-18-16-1.sfi");
+    uint8_t header[4] = { 0x09, 0xfc, 0xfd, 0x01 };
+    unsigned long long copied = transport->bytesCopied();
+    CHECK(transport->mapImage(image.data(), (uint32_t)image.size()), "image not mapped");
+    HostKernelStats before, after;
+    HostKernelGetStats(&before);
+    IOMemoryDescriptor *gather = NULL;
+    bool sameDescriptor = true;
+    bool onWire = true;
+    uint32_t fragments = 0;
+    for (uint32_t offset = FW_SFI_HEADER_LEN; offset + 252 <= image.size(); offset += 252, fragments++) {
+        if (transport->bulkWriteGather(header, sizeof(header), &image[offset], 252) != kIOReturnSuccess) {
+            break;
+        }
+        sameDescriptor &= !gather || backend.written == gather;
+        gather = backend.written;
+        onWire &= !memcmp(backend.wire, header, sizeof(header)) &&
+                  !memcmp(backend.wire + sizeof(header), &image[offset], 252);
+    }
+    HostKernelGetStats(&after);
+    CHECK(fragments == (image.size() - FW_SFI_HEADER_LEN) / 252, "%u fragments written", fragments);
+    CHECK(sameDescriptor && gather != wired, "fragments did not share the image descriptors");
+    CHECK(onWire, "fragment bytes differ on the wire");
+    CHECK(transport->bytesCopied() == copied, "%llu image bytes copied", (unsigned long long)transport->bytesCopied() - copied);
+    CHECK(after.objects == before.objects && after.mallocs == before.mallocs, "%llu objects and %llu allocations "
+          "for %u fragments", (unsigned long long)(after.objects - before.objects),
+          (unsigned long long)(after.mallocs - before.mallocs), fragments);
+
+    /* Bytes outside the image are still copied */
+    CHECK(transport->bulkWriteGather(header, sizeof(header), command, sizeof(command)) == kIOReturnSuccess &&
+          backend.written == wired && transport->bytesCopied() == copied + sizeof(command),
+          "bytes outside the image not copied into the wired buffer");
+    transport->unmapImage();
+    CHECK(transport->bulkWriteGather(header, sizeof(header), &image[FW_SFI_HEADER_LEN], 252) == kIOReturnSuccess &&
+          backend.written == wired, "unmapped image not copied into the wired buffer");
+    delete transport;
+    client->release();
+}
+
+static bool probes(uint16_t productID)
+{
+    IOUSBHostInterface *interface = new IOUSBHostInterface(NULL);
+    IOUSBHostDevice *device = new IOUSBHostDevice(productID, interface);
+    interface->release();
+    HostFirmware *driver = new HostFirmware;
+    driver->init();
+    SInt32 score = 0;
+    bool probed = driver->probe(device, &score) == driver;
+    driver->release();
+    device->release();
+    return probed;
+}
+
+static void testProbe(const char *container)
+{
+    /* AX210 has no image anywhere, full builds still take it */
+    CHECK(probes(0x0032), "%s: refused 0x0032", container);
+    CHECK(probes(0x0025), "%s: refused 0x0025", container);
+    CHECK(probes(0x0a2a), "%s: refused 0x0a2a", container);
+    if (!CHECK(loadContainer("container-slim.bin"), "can not load container-slim.bin")) {
+        return;
+    }
+    CHECK(probes(0x0025), "%s: slimmed build refused 0x0025", container);
+    CHECK(!probes(0x0032), "%s: slimmed build took 0x0032", container);
+    CHECK(!probes(0x0a2a), "%s: slimmed build took 0x0a2a", container);
+    loadContainer(container);
+}
+
+/* The container is constant data in the kext, a write into it has to
+ * fault here as well. Tried in a child, which is expected to die of it.
+ */
+static void testContainerReadOnly(const char *container)
+{
+    const FwContainerHeader *header = getFWContainer();
+    if (!CHECK(header, "%s: no container", container)) {
+        return;
+    }
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        /* Sanitizers would turn the fault into an exit */
+        signal(SIGSEGV, SIG_DFL);
+        signal(SIGBUS, SIG_DFL);
+        ((volatile uint8_t *)header)[header->length / 2] ^= 1;
+        _exit(0);
+    }
+    int status = 0;
+    CHECK(child > 0 && waitpid(child, &status, 0) == child, "%s: can not fork", container);
+    CHECK(WIFSIGNALED(status) && (WTERMSIG(status) == SIGSEGV || WTERMSIG(status) == SIGBUS),
+          "%s: write into the container did not fault", container);
+}
+
+/* With the device held open by another client the download fails before
+ * the first command, in start() or on the thread call. Either way the
+ * driver lets go of the device and asks to be detached.
+ */
+static void testFailedDownload(const char *container)
+{
+    for (int synchronous = 0; synchronous < 2; synchronous++) {
+        const char *how = synchronous ? "in start()" : "on its thread call";
+        FakeController controller;
+        controller.setBootloader(bootloaderVersion(0x12, 16, 1), bootParams(0), readFirmware("ibt-18-16-1.sfi"));
+        IOUSBHostInterface *interface = new IOUSBHostInterface(NULL);
+        IOUSBHostDevice *device = new IOUSBHostDevice(0x0025, interface);
+        interface->release();
+        device->open(NULL);
+        HostFirmware *driver = new HostFirmware;
+        driver->controller = &controller;
+        driver->init();
+        driver->setProperty("SynchronousDownload", synchronous != 0);
+        SInt32 score = 0;
+        CHECK(driver->probe(device, &score) == driver, "%s: probe failed", container);
+        bool started = driver->start(device);
+        for (int waited = 0; started && !driver->isInactive() && waited < 10000; waited++) {
+            usleep(1000);
+        }
+        CHECK(synchronous ? !started : started && driver->isInactive(), "%s: driver stayed attached, download %s",
+              container, how);
+        CHECK(!driver->loaded(), "%s: loaded without a device, download %s", container, how);
+        CHECK(!interface->isOpen(), "%s: interface left open, download %s", container, how);
+        /* What the termination thread does after terminate() */
+        if (started) {
+            driver->stop(device);
+        }
+        driver->release();
+        device->release();
+    }
+}
+
+/* Copies every resource of from into to with one byte flipped halfway */
+static bool corruptResources(const std::string &from, const std::string &to)
+{
+    DIR *dir = opendir(from.c_str());
+    if (!dir) {
+        return false;
+    }
+    mkdir(to.c_str(), 0755);
+    int copied = 0;
+    while (struct dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        FILE *in = fopen((from + "/" + entry->d_name).c_str(), "rb");
+        FILE *out = fopen((to + "/" + entry->d_name).c_str(), "wb");
+        std::vector<uint8_t> bytes;
+        int c;
+        while (in && (c = fgetc(in)) != EOF) {
+            bytes.push_back((uint8_t)c);
+        }
+        if (!bytes.empty()) {
+            bytes[bytes.size() / 2] ^= 0x01;
+        }
+        if (out && fwrite(bytes.data(), 1, bytes.size(), out) == bytes.size()) {
+            copied++;
+        }
+        if (in) {
+            fclose(in);
+        }
+        if (out) {
+            fclose(out);
+        }
+    }
+    closedir(dir);
+    return copied > 0;
+}
+
+static void testOnDemand(const char *container)
+{
+    std::string resources = std::string(sBuildDir) + "/resources";
+    HostKernelSetResourceDirectory(resources.c_str());
+    FakeController controller;
+    controller.setBootloader(bootloaderVersion(0x12, 16, 1), bootParams(0), readFirmware("ibt-18-16-1.sfi"));
+    Attach result = attach(controller, 0x0025);
+    FakeControllerStats stats = controller.stats();
+    CHECK(result.loaded && stats.downloaded && !stats.corrupt, "%s: resource download failed", container);
+
+    /* A resource that does not rebuild into its image never reaches the controller */
+    std::string corrupt = std::string(sBuildDir) + "/resources-corrupt";
+    if (CHECK(corruptResources(resources, corrupt), "can not write %s", corrupt.c_str())) {
+        HostKernelSetResourceDirectory(corrupt.c_str());
+        FakeController damaged;
+        damaged.setBootloader(bootloaderVersion(0x12, 16, 1), bootParams(0), readFirmware("ibt-18-16-1.sfi"));
+        result = attach(damaged, 0x0025);
+        stats = damaged.stats();
+        CHECK(!result.loaded, "%s: corrupt resource loaded", container);
+        CHECK(!stats.fragments, "%s: %u fragments of a corrupt resource sent", container, stats.fragments);
+    }
+    HostKernelSetResourceDirectory(NULL);
+}
+
+/* Benchmarks, run by make bench */
+
+/* What the kext carries, how fast FwReader hands it out and how long a
+ * download of it takes.
+ */
+static void benchStore(const char *container)
+{
+    const FwContainerHeader *header = getFWContainer();
+    unsigned long long imageBytes = 0;
+    unsigned long long decodeNs = 0;
+    for (uint32_t i = 0; i < header->entryCount; i++) {
+        FwView image(header, i);
+        FwReader reader;
+        unsigned long long begin = mach_absolute_time();
+        bool read = reader.open(image);
+        for (uint32_t offset = 0; read && offset < image.length(); offset += FW_READER_MAX_MAP) {
+            uint32_t length = image.length() - offset;
+            if (length > FW_READER_MAX_MAP) {
+                length = FW_READER_MAX_MAP;
+            }
+            read = reader.map(offset, length) != NULL;
+        }
+        decodeNs += mach_absolute_time() - begin;
+        reader.close();
+        CHECK(read, "%s: can not read %s", container, image.name());
+        imageBytes += image.length();
+    }
+
+    FakeController controller;
+    controller.setBootloader(bootloaderVersion(0x12, 16, 1), bootParams(0), readFirmware("ibt-18-16-1.sfi"));
+    unsigned long long begin = mach_absolute_time();
+    Attach result = attach(controller, 0x0025);
+    unsigned long long elapsedMs = (mach_absolute_time() - begin) / 1000000;
+    CHECK(result.loaded, "%s: download failed", container);
+    printf("    %s: %u bytes for %llu bytes of images, read at %.0f MB/s, ibt-18-16-1.sfi download %llu ms, "
+           "attach %llu ms\n", container, header->length, imageBytes, imageBytes * 1000.0 / (decodeNs ? decodeNs : 1),
+           result.downloadMs, elapsedMs);
+}
+
+/* How long start() holds up the matching thread, with the download on
+ * its thread call and in start() the way it used to be.
+ */
+static void benchStart(const char *container)
+{
+    for (int synchronous = 0; synchronous < 2; synchronous++) {
+        FakeController controller;
+        controller.setBootloader(bootloaderVersion(0x12, 16, 1), bootParams(0), readFirmware("ibt-18-16-1.sfi"));
+        Attach result = attach(controller, 0x0025, NULL, synchronous);
+        CHECK(result.loaded, "%s: download failed", container);
+        printf("    %s, download %s: start() %llu us, loaded after %llu us\n", container,
+               synchronous ? "in start()" : "on its thread call", result.startUs, result.loadedUs);
+    }
+}
+
+/* Secure send fragments through USBTransport, out of the mapped image and
+ * copied into the wired buffer. The backend reads every write back the
+ * way DMA would.
+ */
+static void benchBulkWrite(const char *container)
+{
+    std::vector<uint8_t> image = readFirmware("ibt-18-16-1.sfi");
+    uint8_t header[4] = { 0x09, 0xfc, 0xfd, 0x01 };
+    for (int mapped = 1; mapped >= 0; mapped--) {
+        IOService *client = new IOService;
+        StallBackend backend;
+        StallReads reads;
+        backend.stalled = false;
+        USBTransport *transport = stallTransport(backend, reads, client);
+        if (!CHECK(transport, "can not create a USB transport")) {
+            client->release();
+            return;
+        }
+        CHECK(!mapped || transport->mapImage(image.data(), (uint32_t)image.size()), "image not mapped");
+        HostKernelStats before, after;
+        HostKernelGetStats(&before);
+        uint32_t fragments = 0;
+        unsigned long long begin = mach_absolute_time();
+        for (int pass = 0; pass < 20; pass++) {
+            for (uint32_t offset = FW_SFI_HEADER_LEN; offset + 252 <= image.size(); offset += 252, fragments++) {
+                transport->bulkWriteGather(header, sizeof(header), &image[offset], 252);
+            }
+        }
+        unsigned long long elapsedNs = mach_absolute_time() - begin;
+        HostKernelGetStats(&after);
+        printf("    %s: %u fragments, %llu ns each, %llu bytes copied, %llu allocations\n",
+               mapped ? "mapped image" : "wired buffer copy", fragments, elapsedNs / fragments,
+               (unsigned long long)transport->bytesCopied(),
+               (unsigned long long)((after.mallocs - before.mallocs) + (after.objects - before.objects)));
+        delete transport;
+        client->release();
+    }
+}
+
+static std::string sTracePath;
+
+static void drainTrace(HostFirmware *driver)
+{
+    OSDictionary *request = OSDictionary::withCapacity(1);
+    request->setObject("DrainTrace", kOSBooleanTrue);
+    CHECK(driver->setProperties(request) == kIOReturnSuccess, "DrainTrace refused");
+    request->release();
+    OSData *trace = OSDynamicCast(OSData, driver->getProperty("Trace"));
+    FILE *file = fopen(sTracePath.c_str(), "wb");
+    if (CHECK(trace && file, "no Trace property to write to %s", sTracePath.c_str())) {
+        fwrite(trace->getBytesNoCopy(), 1, trace->getLength(), file);
+    }
+    if (file) {
+        fclose(file);
+    }
+}
+
+/* Output of TraceDecoder for path, one string per line */
+static std::vector<std::string> decodeTrace(const std::string &path)
+{
+    std::vector<std::string> lines;
+    std::string command = std::string(sBuildDir) + "/TraceDecoder " + path;
+    FILE *output = popen(command.c_str(), "r");
+    if (!output) {
+        return lines;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), output)) {
+        lines.push_back(line);
+    }
+    CHECK(pclose(output) == 0, "%s failed", command.c_str());
+    return lines;
+}
+
+static std::string base64(const uint8_t *bytes, size_t length)
+{
+    static const char *kDigits = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string text;
+    for (size_t i = 0; i < length; i += 3) {
+        uint32_t bits = bytes[i] << 16 | (i + 1 < length ? bytes[i + 1] << 8 : 0) | (i + 2 < length ? bytes[i + 2] : 0);
+        for (size_t d = 0; d < 4; d++) {
+            text += i + d <= length ? kDigits[(bits >> (18 - 6 * d)) & 0x3f] : '=';
+        }
+    }
+    return text;
+}
+
+/* What the ring recorded of a download comes back out of TraceDecoder,
+ * from the property and from an ioreg plist of it.
+ */
+static void testTrace(const char *container)
+{
+    sTracePath = std::string(sBuildDir) + "/trace.bin";
+    FakeController controller;
+    controller.setBootloader(bootloaderVersion(0x12, 16, 1), bootParams(0), readFirmware("ibt-18-16-1.sfi"));
+    Attach result = attach(controller, 0x0025, drainTrace);
+    CHECK(result.loaded, "%s: download failed", container);
+
+    std::vector<std::string> lines = decodeTrace(sTracePath);
+    unsigned records = 0, dropped = 0;
+    if (!CHECK(!lines.empty() && sscanf(lines[0].c_str(), "%u records, %u dropped", &records, &dropped) == 2,
+               "%s: no trace header decoded", container)) {
+        return;
+    }
+    CHECK(records == lines.size() - 1 && records <= BT_TRACE_ENTRIES, "%s: %u records, %zu lines", container,
+          records, lines.size() - 1);
+    const char *events[] = { "state", "submit", "complete", "event", "vendor", "fragment" };
+    for (const char *event : events) {
+        bool found = false;
+        for (size_t i = 1; i < lines.size() && !found; i++) {
+            found = lines[i].find(std::string(" ") + event + " ") != std::string::npos;
+        }
+        CHECK(found, "%s: no %s record decoded", container, event);
+    }
+    CHECK(lines.back().find("download  succeeded=1") != std::string::npos, "%s: last record %s", container,
+          lines.back().c_str());
+
+    std::vector<uint8_t> trace = readFile(sTracePath);
+    std::string plistPath = std::string(sBuildDir) + "/trace.plist";
+    FILE *plist = fopen(plistPath.c_str(), "w");
+    if (CHECK(plist, "can not write %s", plistPath.c_str())) {
+        fprintf(plist, "<dict>\n\t<key>Trace</key>\n\t<data>\n\t%s\n\t</data>\n</dict>\n",
+                base64(trace.data(), trace.size()).c_str());
+        fclose(plist);
+        CHECK(decodeTrace(plistPath) == lines, "%s: the plist decodes differently", container);
+    }
+    printf("    %s: %u records decoded, %u dropped\n", container, records, dropped);
+}
+
+static const char *kContainers[] = {
+    "container-raw.bin",    /* FW_COMPRESS=0 */
+    "container-lz.bin",     /* FW_DELTA=0 */
+    "container-delta.bin",  /* the default build */
+};
+
+/* Tests with a container of their own run only against that one */
+struct Test {
+    const char *name;
+    void (*run)(const char *container);
+    const char *container;
+};
+
+static const Test kTests[] = {
+    { "legacy download", testLegacyDownload },
+    { "every legacy patch", testEveryPatch },
+    { "legacy slow to answer its first reset", testLegacySlowReset },
+    { "legacy already patched", testLegacyPatched },
+    { "new bootloader download", testNewDownload },
+    { "memory per load", testFootprint },
+    { "secure send ack late", testSecureSendLateAck, "container-delta.bin" },
+    { "secure send ack lost", testSecureSendLostAck, "container-delta.bin" },
+    { "probe", testProbe },
+    { "container read only", testContainerReadOnly },
+    { "download fails", testFailedDownload, "container-delta.bin" },
+    { "usb stall recovery", testStallRecovery, "container-raw.bin" },
+    { "usb bulk buffer", testBulkBuffer, "container-raw.bin" },
+    { "on demand resources", testOnDemand, "container-ondemand.bin" },
+    { "trace", testTrace, "container-delta.bin" },
+};
+
+static const Test kBenches[] = {
+    { "firmware store", benchStore },
+    { "start latency", benchStart, "container-delta.bin" },
+    { "bulk writes", benchBulkWrite, "container-raw.bin" },
+};
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <build dir> [-v | -b]\n", argv[0]);
+        return 2;
+    }
+    sBuildDir = argv[1];
+    HostKernelSetVerbose(argc > 2 && !strcmp(argv[2], "-v"));
+    bool bench = argc > 2 && !strcmp(argv[2], "-b");
+    const Test *tests = bench ? kBenches : kTests;
+    size_t testCount = bench ? sizeof(kBenches) / sizeof(kBenches[0]) : sizeof(kTests) / sizeof(kTests[0]);
+    for (size_t t = 0; t < testCount; t++) {
+        printf("%s\n", tests[t].name);
+        size_t count = tests[t].container ? 1 : sizeof(kContainers) / sizeof(kContainers[0]);
+        for (size_t c = 0; c < count; c++) {
+            const char *container = tests[t].container ? tests[t].container : kContainers[c];
+            if (!CHECK(loadContainer(container), "can not load %s", container)) {
+                continue;
+            }
+            int failures = sFailures;
+            tests[t].run(container);
+            printf("  %s %s\n", failures == sFailures ? "ok" : "FAILED", container);
+        }
+    }
+    printf("%d checks, %d failed\n", sChecks, sFailures);
+    return sFailures ? 1 : 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/bash
+
+#  bench_build.sh
+#  IntelBluetoothFirmware
+#
+#  Created by agent on 2026/10/16.
+#  Copyright © 2026 agent. All rights reserved.
+#
+#  Times the firmware payload through the xxd -i arrays fw_gen.sh used to
+#  write and through FwGenerator and .incbin, generation and compile each.
+#  Usage: bench_build.sh <build dir> <FwGenerator> <fw files>
+
+build_dir="$1/bench"
+generator="$2"
+shift 2
+cxx="${CXX:-c++}"
+TIMEFORMAT="%R s"
+
+rm -rf "$build_dir" && mkdir -p "$build_dir" || exit 1
+
+arrays="$build_dir/FwBinary.cpp"
+xxd_arrays() {
+    for fw in "$@"; do
+        fw_var_name=$(basename "$fw")
+        fw_var_name=${fw_var_name//./_}
+        fw_var_name=${fw_var_name//-/_}
+        echo "extern const unsigned char ${fw_var_name}[] = {"
+        xxd -i <"$fw"
+        echo "};"
+        echo "extern const long int ${fw_var_name}_size = sizeof(${fw_var_name});"
+    done >"$arrays"
+}
+
+echo "xxd -i arrays"
+echo -n "  generate: " && time xxd_arrays "$@" || exit 1
+echo -n "  compile:  " && time "$cxx" -O2 -c -o "$build_dir/FwBinary.o" "$arrays" || exit 1
+echo "  $(wc -c <"$arrays") bytes of source"
+
+payload="$build_dir/FwPayload"
+echo "FwGenerator -z -d, .incbin"
+echo -n "  generate: " && time "$generator" -z -d -o "$payload.bin" -s "$payload.S" "$@" >/dev/null || exit 1
+echo -n "  assemble: " && time "$cxx" -c -o "$payload.o" "$payload.S" || exit 1
+echo "  $(wc -c <"$payload.S") bytes of source, $(wc -c <"$payload.bin") bytes of payload"
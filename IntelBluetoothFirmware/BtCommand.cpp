@@ -0,0 +1,598 @@
+//
+//  BtCommand.cpp
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "BtCommand.h"
+#include "Log.h"
+
+BtCompletion::BtCompletion()
+: mLock(NULL), mSequence(0)
+{
+}
+
+BtCompletion::~BtCompletion()
+{
+    if (mLock) {
+        IOLockFree(mLock);
+        mLock = NULL;
+    }
+}
+
+bool BtCompletion::init()
+{
+    if (!mLock) {
+        mLock = IOLockAlloc();
+    }
+    return mLock != NULL;
+}
+
+bool BtCompletion::sleep(uint32_t seen, uint64_t deadline)
+{
+    while (mSequence == seen) {
+        if (IOLockSleepDeadline(mLock, &mSequence, deadline, THREAD_INTERRUPTIBLE) == THREAD_TIMED_OUT) {
+            return mSequence != seen;
+        }
+    }
+    return true;
+}
+
+void BtCompletion::signal()
+{
+    mSequence++;
+    IOLockWakeup(mLock, &mSequence, false);
+}
+
+BtCommandEngine::BtCommandEngine()
+: mTransport(NULL), mTrace(NULL), mNextToken(0), mListeners(0), mListenBulk(false),
+mDetachedStatus(kIOReturnSuccess), mReadPending(false), mReadBulk(false), mStopped(true)
+{
+    bzero(mSlots, sizeof(mSlots));
+    bzero(mVendorEvents, sizeof(mVendorEvents));
+    bzero(&mStats, sizeof(mStats));
+}
+
+bool BtCommandEngine::init(BtTransport *transport, BtTrace *trace)
+{
+    if (!mCompletion.init()) {
+        XYLog("fail to alloc command lock\n");
+        return false;
+    }
+    mCompletion.lock();
+    mTransport = transport;
+    mTrace = trace;
+    bzero(mSlots, sizeof(mSlots));
+    mListeners = 0;
+    mDetachedStatus = kIOReturnSuccess;
+    bzero(&mStats, sizeof(mStats));
+    mReadPending = false;
+    mStopped = false;
+    mCompletion.unlock();
+    return true;
+}
+
+void BtCommandEngine::stop()
+{
+    if (!mTransport) {
+        return;
+    }
+    mCompletion.lock();
+    mStopped = true;
+    for (int i = 0; i < BT_COMMAND_MAX_PENDING; i++) {
+        fail(&mSlots[i], kIOReturnAborted);
+    }
+    mCompletion.signal();
+    mCompletion.unlock();
+}
+
+BtCommandToken BtCommandEngine::submit(uint16_t opcode, uint8_t plen, const void *param, uint8_t events, uint32_t flags)
+{
+    Slot *slot = NULL;
+    BtCommandToken token = track(opcode, events, flags, &slot);
+    if (!token) {
+        return 0;
+    }
+
+    /* Bulk commands are built straight into a wired transport buffer */
+    HciCommandHdr *command = &mCommand;
+    if (flags & kBtCommandBulk) {
+        uint8_t *buffer = mTransport->acquireBulkBuffer(HCI_COMMAND_HDR_SIZE + plen);
+        if (buffer) {
+            command = (HciCommandHdr *)buffer;
+        }
+    }
+    command->opcode = opcode;
+    command->plen = plen;
+    if (plen) {
+        memcpy(command->pData, param, plen);
+    }
+    XYTrace(mTrace, kBtTraceCommandSubmit, opcode, plen, flags, token);
+    IOReturn ret = (flags & kBtCommandBulk) ? mTransport->bulkWrite(command, HCI_COMMAND_HDR_SIZE + plen) :
+    mTransport->sendHCICommand(command, HCI_COMMAND_HDR_SIZE + plen);
+    return sent(token, slot, opcode, ret);
+}
+
+BtCommandToken BtCommandEngine::submitGather(uint16_t opcode, const void *prefix, uint8_t prefixLength,
+                                             const void *data, uint8_t dataLength, uint8_t events, uint32_t flags)
+{
+    uint8_t header[HCI_COMMAND_HDR_SIZE + 8];
+    Slot *slot = NULL;
+
+    if (prefixLength > sizeof(header) - HCI_COMMAND_HDR_SIZE || prefixLength + dataLength > 0xff) {
+        return 0;
+    }
+    BtCommandToken token = track(opcode, events, flags | kBtCommandBulk, &slot);
+    if (!token) {
+        return 0;
+    }
+    header[0] = opcode & 0xff;
+    header[1] = opcode >> 8;
+    header[2] = prefixLength + dataLength;
+    memcpy(header + HCI_COMMAND_HDR_SIZE, prefix, prefixLength);
+    XYTrace(mTrace, kBtTraceCommandSubmit, opcode, header[2], flags | kBtCommandBulk, token);
+    IOReturn ret = mTransport->bulkWriteGather(header, HCI_COMMAND_HDR_SIZE + prefixLength, data, dataLength);
+    return sent(token, slot, opcode, ret);
+}
+
+BtCommandToken BtCommandEngine::track(uint16_t opcode, uint8_t events, uint32_t flags, Slot **slot)
+{
+    *slot = NULL;
+    mCompletion.lock();
+    if (mStopped) {
+        mCompletion.unlock();
+        return 0;
+    }
+    if (events) {
+        for (int i = 0; i < BT_COMMAND_MAX_PENDING; i++) {
+            if (!mSlots[i].token) {
+                *slot = &mSlots[i];
+                break;
+            }
+        }
+        if (!*slot) {
+            mCompletion.unlock();
+            XYLog("%s too many commands pending, opcode: 0x%04x\n", __FUNCTION__, opcode);
+            return 0;
+        }
+    }
+    BtCommandToken token = ++mNextToken;
+    if (!token) {
+        token = ++mNextToken;
+    }
+    if (*slot) {
+        bzero(*slot, sizeof(**slot));
+        (*slot)->token = token;
+        (*slot)->opcode = opcode;
+        (*slot)->events = events;
+        (*slot)->flags = flags;
+        (*slot)->status = kIOReturnSuccess;
+        clock_get_uptime(&(*slot)->submitTime);
+    }
+    mCompletion.unlock();
+
+    /* The read has to be waiting before the controller can answer */
+    if (*slot) {
+        kick();
+    }
+    return token;
+}
+
+BtCommandToken BtCommandEngine::sent(BtCommandToken token, Slot *slot, uint16_t opcode, IOReturn ret)
+{
+    if (ret == kIOReturnSuccess) {
+        return token;
+    }
+    XYLog("%s send opcode 0x%04x failed, 0x%08x\n", __FUNCTION__, opcode, ret);
+    if (slot) {
+        mCompletion.lock();
+        if (slot->token == token) {
+            release(slot);
+        }
+        mCompletion.unlock();
+    }
+    return 0;
+}
+
+IOReturn BtCommandEngine::wait(BtCommandToken token, uint32_t timeoutMs, void *response, uint32_t *length)
+{
+    uint64_t deadline;
+    IOReturn ret;
+
+    clock_interval_to_deadline(timeoutMs, kMillisecondScale, &deadline);
+    mCompletion.lock();
+    Slot *slot = find(token);
+    if (!slot) {
+        mCompletion.unlock();
+        return kIOReturnNotFound;
+    }
+    while (!isDone(slot)) {
+        if (!mCompletion.sleep(mCompletion.sequence(), deadline)) {
+            break;
+        }
+    }
+    if (!isDone(slot)) {
+        ret = kIOReturnTimeout;
+        timedOut(slot->flags);
+        XYTrace(mTrace, kBtTraceCommandTimeout, slot->opcode, token, timeoutMs, 0);
+    } else if ((ret = slot->status) == kIOReturnSuccess) {
+        if (response) {
+            memcpy(response, slot->response, slot->length);
+        }
+        if (length) {
+            *length = slot->length;
+        }
+    }
+    release(slot);
+    mCompletion.unlock();
+    return ret;
+}
+
+IOReturn BtCommandEngine::send(uint16_t opcode, uint8_t plen, const void *param, uint8_t events, uint32_t timeoutMs,
+                               void *response, uint32_t *length, uint32_t flags)
+{
+    BtCommandToken token = submit(opcode, plen, param, events, flags);
+    if (!token) {
+        return kIOReturnError;
+    }
+    if (!events) {
+        return kIOReturnSuccess;
+    }
+    return wait(token, timeoutMs, response, length);
+}
+
+uint32_t BtCommandEngine::pending(uint16_t opcode)
+{
+    mCompletion.lock();
+    uint32_t count = pendingLocked(opcode);
+    mCompletion.unlock();
+    return count;
+}
+
+IOReturn BtCommandEngine::waitPending(uint16_t opcode, uint32_t max, uint32_t timeoutMs)
+{
+    uint64_t deadline;
+    IOReturn ret = kIOReturnSuccess;
+
+    clock_interval_to_deadline(timeoutMs, kMillisecondScale, &deadline);
+    mCompletion.lock();
+    while (pendingLocked(opcode) > max && mDetachedStatus == kIOReturnSuccess) {
+        if (!mCompletion.sleep(mCompletion.sequence(), deadline)) {
+            ret = kIOReturnTimeout;
+            for (int i = 0; i < BT_COMMAND_MAX_PENDING; i++) {
+                if (mSlots[i].token && mSlots[i].opcode == opcode && !isDone(&mSlots[i])) {
+                    timedOut(mSlots[i].flags);
+                    break;
+                }
+            }
+            XYTrace(mTrace, kBtTraceCommandTimeout, opcode, 0, timeoutMs, 0);
+            break;
+        }
+    }
+    if (mDetachedStatus != kIOReturnSuccess) {
+        ret = mDetachedStatus;
+        mDetachedStatus = kIOReturnSuccess;
+    }
+    mCompletion.unlock();
+    return ret;
+}
+
+void BtCommandEngine::rearm()
+{
+    mCompletion.lock();
+    bool posted = mReadPending;
+    bool bulk = mReadBulk;
+    mCompletion.unlock();
+    if (posted) {
+        /* Comes back through onRead(), which posts it again */
+        mTransport->abortRead(bulk);
+    } else {
+        kick();
+    }
+}
+
+uint32_t BtCommandEngine::vendorSequence(uint8_t code)
+{
+    if (code >= BT_VENDOR_EVENT_MAX) {
+        return 0;
+    }
+    mCompletion.lock();
+    uint32_t events = mVendorEvents[code];
+    mCompletion.unlock();
+    return events;
+}
+
+IOReturn BtCommandEngine::waitVendorEvent(uint8_t code, uint32_t seen, uint32_t timeoutMs, uint32_t flags)
+{
+    uint64_t deadline;
+    IOReturn ret = kIOReturnSuccess;
+
+    if (code >= BT_VENDOR_EVENT_MAX) {
+        return kIOReturnBadArgument;
+    }
+    clock_interval_to_deadline(timeoutMs, kMillisecondScale, &deadline);
+    mCompletion.lock();
+    mListeners++;
+    mListenBulk = flags & kBtCommandBulk;
+    mCompletion.unlock();
+    kick();
+
+    mCompletion.lock();
+    while (mVendorEvents[code] == seen) {
+        if (mStopped) {
+            ret = kIOReturnAborted;
+            break;
+        }
+        if (!mCompletion.sleep(mCompletion.sequence(), deadline)) {
+            ret = kIOReturnTimeout;
+            mStats.timeouts++;
+            XYTrace(mTrace, kBtTraceCommandTimeout, code, 0, timeoutMs, 0);
+            break;
+        }
+    }
+    if (!--mListeners) {
+        mListenBulk = false;
+    }
+    mCompletion.unlock();
+    return ret;
+}
+
+void BtCommandEngine::onRead(IOReturn status, const void *data, uint32_t length)
+{
+    bool bulk = false;
+
+    mCompletion.lock();
+    mReadPending = false;
+    XYTrace(mTrace, kBtTraceReadComplete, status, length, length ? ((const uint8_t *)data)[0] : 0, mReadBulk);
+    if (status == kIOReturnSuccess && length >= sizeof(HciEventHdr)) {
+        const HciEventHdr *event = (const HciEventHdr *)data;
+        Slot *match = NULL;
+
+        if (event->evt == HCI_EV_VENDOR && length > sizeof(HciEventHdr) &&
+            ((const uint8_t *)data)[sizeof(HciEventHdr)] < BT_VENDOR_EVENT_MAX) {
+            uint8_t code = ((const uint8_t *)data)[sizeof(HciEventHdr)];
+            mVendorEvents[code]++;
+            XYTrace(mTrace, kBtTraceVendorEvent, code, mVendorEvents[code], 0, 0);
+        }
+        if (event->evt == HCI_EV_CMD_COMPLETE && length >= sizeof(HciResponse)) {
+            /* Answers come back in the order the commands went out */
+            uint16_t opcode = ((const HciResponse *)data)->opcode;
+            for (int i = 0; i < BT_COMMAND_MAX_PENDING; i++) {
+                Slot *slot = &mSlots[i];
+                if (slot->token && !slot->matched && slot->status == kIOReturnSuccess && slot->opcode == opcode &&
+                    (!match || (int32_t)(slot->token - match->token) < 0)) {
+                    match = slot;
+                }
+            }
+            if (!match) {
+                XYLog("%s unexpected command complete, opcode: 0x%04x\n", __FUNCTION__, opcode);
+            }
+        }
+        Slot *owner = match ? match : eventOwner((const uint8_t *)data, length);
+        if (owner && owner->seen < 0xff) {
+            owner->seen++;
+        }
+        if (match) {
+            match->matched = true;
+            uint32_t us = addLatency(latency(match->flags), match->submitTime);
+            XYTrace(mTrace, kBtTraceCommandComplete, match->opcode, ((const HciResponse *)data)->status, us, match->token);
+        }
+        if (owner && (match || ((owner->flags & kBtCommandAnyEvent) && !owner->matched))) {
+            owner->length = length < BT_EVENT_MAX_LEN ? length : (uint32_t)BT_EVENT_MAX_LEN;
+            memcpy(owner->response, data, owner->length);
+        }
+        for (int i = 0; i < BT_COMMAND_MAX_PENDING; i++) {
+            Slot *slot = &mSlots[i];
+            if (slot->token && (slot->flags & kBtCommandDetached) && isDone(slot)) {
+                release(slot);
+            }
+        }
+    } else if (status != kIOReturnSuccess && status != kIOReturnAborted) {
+        XYLog("%s read failed, 0x%08x\n", __FUNCTION__, status);
+    }
+    mCompletion.signal();
+    bool post = needRead(&bulk);
+    mCompletion.unlock();
+
+    if (post) {
+        postRead(bulk);
+    }
+}
+
+BtCommandEngine::Slot *BtCommandEngine::eventOwner(const uint8_t *event, uint32_t length)
+{
+    Slot *owner = NULL;
+    /* status, ncmd and the opcode of the command it answers */
+    bool status = event[0] == HCI_EV_CMD_STATUS && length >= sizeof(HciEventHdr) + 4;
+    uint16_t opcode = status ? event[4] | (event[5] << 8) : 0;
+
+    for (int i = 0; i < BT_COMMAND_MAX_PENDING; i++) {
+        Slot *slot = &mSlots[i];
+        if (!slot->token || isDone(slot) || (owner && (int32_t)(slot->token - owner->token) > 0)) {
+            continue;
+        }
+        /* A command status comes first, anything else follows one */
+        if (status ? slot->opcode == opcode && !slot->matched && !slot->seen : slot->seen > 0) {
+            owner = slot;
+        }
+    }
+    if (owner && status && event[2] != 0) {
+        XYLog("%s command 0x%04x failed with status 0x%02x\n", __FUNCTION__, opcode, event[2]);
+        fail(owner, kIOReturnError);
+        return NULL;
+    }
+    return owner;
+}
+
+void BtCommandEngine::getStats(BtCommandStats *stats)
+{
+    mCompletion.lock();
+    *stats = mStats;
+    mCompletion.unlock();
+}
+
+uint32_t BtCommandEngine::timeout(uint32_t flags, uint32_t floorMs, uint32_t ceilingMs)
+{
+    mCompletion.lock();
+    const BtLatencyStats *stats = latency(flags);
+    uint64_t rtoUs = ceilingMs * 1000ULL;
+    if (stats->srttUs) {
+        uint64_t deviation = 4ULL * stats->rttvarUs;
+        rtoUs = (stats->srttUs + (deviation > BT_RTT_GRANULARITY_US ? deviation : BT_RTT_GRANULARITY_US)) << stats->backoff;
+    }
+    mCompletion.unlock();
+    uint64_t ms = (rtoUs + 999) / 1000;
+    if (ms < floorMs) {
+        ms = floorMs;
+    }
+    return ms < ceilingMs ? (uint32_t)ms : ceilingMs;
+}
+
+void BtCommandEngine::timedOut(uint32_t flags)
+{
+    BtLatencyStats *stats = latency(flags);
+    mStats.timeouts++;
+    if (stats->backoff < BT_RTT_MAX_BACKOFF) {
+        stats->backoff++;
+    }
+}
+
+uint32_t BtCommandEngine::addLatency(BtLatencyStats *stats, uint64_t since)
+{
+    uint64_t now, elapsedNs;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - since, &elapsedNs);
+    uint64_t us = elapsedNs / 1000;
+    int bucket = 0;
+    while (bucket < BT_LATENCY_BUCKETS - 1 && us >= ((uint64_t)BT_LATENCY_BUCKET_BASE_US << bucket)) {
+        bucket++;
+    }
+    stats->buckets[bucket]++;
+    stats->count++;
+    stats->totalUs += us;
+    if (us > stats->maxUs) {
+        stats->maxUs = (uint32_t)us;
+    }
+    uint32_t rtt = us < 0xffffffff ? (uint32_t)us : 0xffffffff;
+    if (!stats->srttUs) {
+        stats->srttUs = rtt ? rtt : 1;
+        stats->rttvarUs = rtt / 2;
+    } else {
+        uint32_t error = rtt > stats->srttUs ? rtt - stats->srttUs : stats->srttUs - rtt;
+        stats->rttvarUs = stats->rttvarUs - stats->rttvarUs / 4 + error / 4;
+        stats->srttUs = stats->srttUs - stats->srttUs / 8 + rtt / 8;
+    }
+    stats->backoff = 0;
+    return (uint32_t)us;
+}
+
+BtCommandEngine::Slot *BtCommandEngine::find(BtCommandToken token)
+{
+    if (!token) {
+        return NULL;
+    }
+    for (int i = 0; i < BT_COMMAND_MAX_PENDING; i++) {
+        if (mSlots[i].token == token) {
+            return &mSlots[i];
+        }
+    }
+    return NULL;
+}
+
+void BtCommandEngine::release(Slot *slot)
+{
+    slot->token = 0;
+}
+
+void BtCommandEngine::fail(Slot *slot, IOReturn status)
+{
+    if (!slot->token || isDone(slot)) {
+        return;
+    }
+    slot->status = status;
+    if (slot->flags & kBtCommandDetached) {
+        if (mDetachedStatus == kIOReturnSuccess) {
+            mDetachedStatus = status;
+        }
+        release(slot);
+    }
+}
+
+uint32_t BtCommandEngine::pendingLocked(uint16_t opcode)
+{
+    uint32_t count = 0;
+    for (int i = 0; i < BT_COMMAND_MAX_PENDING; i++) {
+        if (mSlots[i].token && mSlots[i].opcode == opcode && !isDone(&mSlots[i])) {
+            count++;
+        }
+    }
+    return count;
+}
+
+bool BtCommandEngine::wantBulk()
+{
+    Slot *oldest = NULL;
+    for (int i = 0; i < BT_COMMAND_MAX_PENDING; i++) {
+        Slot *slot = &mSlots[i];
+        if (slot->token && !isDone(slot) && (!oldest || (int32_t)(slot->token - oldest->token) < 0)) {
+            oldest = slot;
+        }
+    }
+    return oldest ? (oldest->flags & kBtCommandBulk) : mListenBulk;
+}
+
+bool BtCommandEngine::needRead(bool *bulk)
+{
+    if (mStopped || mReadPending) {
+        return false;
+    }
+    bool waiting = mListeners > 0;
+    for (int i = 0; i < BT_COMMAND_MAX_PENDING && !waiting; i++) {
+        waiting = mSlots[i].token && !isDone(&mSlots[i]);
+    }
+    if (!waiting) {
+        return false;
+    }
+    *bulk = wantBulk();
+    mReadPending = true;
+    mReadBulk = *bulk;
+    return true;
+}
+
+void BtCommandEngine::kick()
+{
+    bool bulk = false;
+
+    mCompletion.lock();
+    bool post = needRead(&bulk);
+    bool abort = !post && mReadPending && mReadBulk != wantBulk();
+    bool abortBulk = mReadBulk;
+    mCompletion.unlock();
+    if (post) {
+        postRead(bulk);
+    } else if (abort) {
+        /* Only one read at a time, the aborted one comes back through
+         * onRead() which posts it again on the other pipe. Bulk out may
+         * have a secure send fragment in flight, it is left alone.
+         */
+        mTransport->abortRead(abortBulk);
+    }
+}
+
+void BtCommandEngine::postRead(bool bulk)
+{
+    XYTrace(mTrace, kBtTraceReadPost, bulk, 0, 0, 0);
+    if (bulk ? mTransport->bulkRead() : mTransport->interruptRead()) {
+        return;
+    }
+    XYLog("%s fail to post %s read\n", __FUNCTION__, bulk ? "bulk" : "interrupt");
+    mCompletion.lock();
+    mReadPending = false;
+    for (int i = 0; i < BT_COMMAND_MAX_PENDING; i++) {
+        fail(&mSlots[i], kIOReturnNotResponding);
+    }
+    mCompletion.signal();
+    mCompletion.unlock();
+}
@@ -0,0 +1,257 @@
+//
+//  BtCommand.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef BtCommand_h
+#define BtCommand_h
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include "BtTransport.h"
+#include "BtTrace.h"
+#include "Hci.h"
+
+/* Commands the engine tracks at once, enough for the largest secure send
+ * window plus the command being waited for.
+ */
+#define BT_COMMAND_MAX_PENDING  24
+
+/* Vendor events counted by code, see waitVendorEvent() */
+#define BT_VENDOR_EVENT_MAX     16
+
+/* Largest HCI event, header included */
+#define BT_EVENT_MAX_LEN        (sizeof(HciEventHdr) + 255)
+
+/* Command to command complete times, bucket i counts answers that took
+ * less than BT_LATENCY_BUCKET_BASE_US << i, the last one everything else.
+ */
+#define BT_LATENCY_BUCKETS          12
+#define BT_LATENCY_BUCKET_BASE_US   128
+
+/* The same times smoothed the way TCP estimates its retransmission
+ * timeout (RFC 6298), see BtCommandEngine::timeout().
+ */
+#define BT_RTT_GRANULARITY_US   1000
+#define BT_RTT_MAX_BACKOFF      4
+
+struct BtLatencyStats {
+    uint32_t count;
+    uint32_t maxUs;
+    uint64_t totalUs;
+    uint32_t buckets[BT_LATENCY_BUCKETS];
+    uint32_t srttUs;
+    uint32_t rttvarUs;
+    uint32_t backoff;           /* timeouts since the last sample */
+};
+
+struct BtCommandStats {
+    BtLatencyStats control;     /* commands on the control endpoint */
+    BtLatencyStats bulk;        /* secure send fragments */
+    uint32_t timeouts;          /* waits that gave up */
+};
+
+/* Counts signals instead of remembering whether someone slept through
+ * one. A waiter reads sequence() before it starts whatever it waits for
+ * and sleeps only while the count is still the one it read, so a signal
+ * that comes first is never lost.
+ */
+class BtCompletion {
+
+public:
+
+    BtCompletion();
+
+    ~BtCompletion();
+
+    bool init();
+
+    void lock() { IOLockLock(mLock); }
+
+    void unlock() { IOLockUnlock(mLock); }
+
+    /* Caller holds the lock */
+    uint32_t sequence() const { return mSequence; }
+
+    /* Caller holds the lock, returns false once deadline passed with the
+     * count still at seen.
+     */
+    bool sleep(uint32_t seen, uint64_t deadline);
+
+    /* Caller holds the lock */
+    void signal();
+
+private:
+    IOLock *mLock;
+    uint32_t mSequence;
+};
+
+typedef uint32_t BtCommandToken;
+
+enum {
+    kBtCommandBulk = 0x01,          /* goes out on bulk, answered on bulk in */
+    kBtCommandDetached = 0x02,      /* nobody waits, dropped once answered */
+    kBtCommandAnyEvent = 0x08,      /* done after its events, no command complete among them */
+};
+
+/* Sends HCI commands and matches the command complete events coming back
+ * to them by opcode, oldest first. Every event counts against one command
+ * only: a command complete or command status against the oldest command
+ * of its opcode still waiting for it, any other event against the oldest
+ * command that already got part of its events. Reads are kept posted on the transport
+ * for as long as a command is outstanding or someone waits for an event,
+ * completions are only ever handed to waiters through a BtCompletion.
+ * Commands are submitted from one thread, read completions may come in on
+ * any.
+ */
+class BtCommandEngine {
+
+public:
+
+    BtCommandEngine();
+
+    /* trace, if any, gets a record for every command and read */
+    bool init(BtTransport *transport, BtTrace *trace = NULL);
+
+    /* Fails everything outstanding with kIOReturnAborted and stops posting
+     * reads, the transport can go away afterwards.
+     */
+    void stop();
+
+    /* Returns 0 if the command could not be sent. A command that expects no
+     * events is not tracked at all.
+     */
+    BtCommandToken submit(uint16_t opcode, uint8_t plen, const void *param, uint8_t events = 1, uint32_t flags = 0);
+
+    /* Bulk command whose parameters are prefix followed by data. The
+     * engine hands data to BtTransport::bulkWriteGather() where it is, the
+     * transport copies it unless it mapped the image data lies in.
+     */
+    BtCommandToken submitGather(uint16_t opcode, const void *prefix, uint8_t prefixLength,
+                                const void *data, uint8_t dataLength, uint8_t events = 1, uint32_t flags = 0);
+
+    /* Waits until the command complete of token and all the events it
+     * expects came in. The command complete, or with kBtCommandAnyEvent
+     * the last event, is copied to response, which has to hold
+     * BT_EVENT_MAX_LEN bytes.
+     */
+    IOReturn wait(BtCommandToken token, uint32_t timeoutMs, void *response = NULL, uint32_t *length = NULL);
+
+    IOReturn send(uint16_t opcode, uint8_t plen, const void *param, uint8_t events, uint32_t timeoutMs,
+                  void *response = NULL, uint32_t *length = NULL, uint32_t flags = 0);
+
+    uint32_t pending(uint16_t opcode);
+
+    /* Waits until at most max commands of opcode are outstanding */
+    IOReturn waitPending(uint16_t opcode, uint32_t max, uint32_t timeoutMs);
+
+    /* Aborts the read posted and posts it again, for a pipe that may have
+     * lost it. Nothing outstanding is given up, an answer still on its way
+     * matches the command it was sent for.
+     */
+    void rearm();
+
+    /* Number of vendor events of code received so far */
+    uint32_t vendorSequence(uint8_t code);
+
+    /* Waits for a vendor event of code once vendorSequence() returned seen,
+     * an event that came in between is not missed. kBtCommandBulk listens
+     * on bulk in, where the bootloader reports.
+     */
+    IOReturn waitVendorEvent(uint8_t code, uint32_t seen, uint32_t timeoutMs, uint32_t flags = 0);
+
+    /* How long to wait for the answer to a command sent with flags: the
+     * smoothed round trip time plus four deviations, doubled for every
+     * timeout since the last answer and clamped to [floorMs, ceilingMs].
+     * ceilingMs until anything was measured.
+     */
+    uint32_t timeout(uint32_t flags, uint32_t floorMs, uint32_t ceilingMs);
+
+    void getStats(BtCommandStats *stats);
+
+    /* Read completion of the transport */
+    void onRead(IOReturn status, const void *data, uint32_t length);
+
+private:
+
+    struct Slot {
+        BtCommandToken token;       /* 0 while the slot is free */
+        uint16_t opcode;
+        uint8_t events;
+        uint8_t seen;
+        uint32_t flags;
+        bool matched;
+        uint64_t submitTime;
+        IOReturn status;
+        uint32_t length;
+        uint8_t response[BT_EVENT_MAX_LEN];
+    };
+
+    Slot *find(BtCommandToken token);
+
+    /* Takes a slot for a command that expects events, returns 0 if none is
+     * free or the engine stopped.
+     */
+    BtCommandToken track(uint16_t opcode, uint8_t events, uint32_t flags, Slot **slot);
+
+    /* Drops the slot of a command that could not be sent */
+    BtCommandToken sent(BtCommandToken token, Slot *slot, uint16_t opcode, IOReturn ret);
+
+    /* The helpers below expect the lock held */
+    void release(Slot *slot);
+
+    void fail(Slot *slot, IOReturn status);
+
+    uint32_t pendingLocked(uint16_t opcode);
+
+    /* Whether the oldest outstanding command is answered on bulk in, or
+     * with none the listener wants it.
+     */
+    bool wantBulk();
+
+    bool isDone(const Slot *slot) const
+    {
+        return slot->status != kIOReturnSuccess ||
+        (slot->seen >= slot->events && (slot->matched || (slot->flags & kBtCommandAnyEvent)));
+    }
+
+    /* The slot an event other than a command complete counts against */
+    Slot *eventOwner(const uint8_t *event, uint32_t length);
+
+    /* Returns whether a read has to be posted and marks it posted */
+    bool needRead(bool *bulk);
+
+    /* Posts the read needed now, or moves it to the other pipe */
+    void kick();
+
+    void postRead(bool bulk);
+
+    BtLatencyStats *latency(uint32_t flags) { return (flags & kBtCommandBulk) ? &mStats.bulk : &mStats.control; }
+
+    /* Returns the latency added, in us */
+    static uint32_t addLatency(BtLatencyStats *stats, uint64_t since);
+
+    /* A wait for commands sent with flags gave up */
+    void timedOut(uint32_t flags);
+
+private:
+    BtTransport *mTransport;
+    BtTrace *mTrace;
+    BtCompletion mCompletion;
+    Slot mSlots[BT_COMMAND_MAX_PENDING];
+    BtCommandToken mNextToken;
+    uint32_t mListeners;
+    bool mListenBulk;
+    uint32_t mVendorEvents[BT_VENDOR_EVENT_MAX];
+    BtCommandStats mStats;
+    IOReturn mDetachedStatus;       /* first failure of a detached command */
+    bool mReadPending;
+    bool mReadBulk;
+    bool mStopped;
+    HciCommandHdr mCommand;
+};
+
+#endif /* BtCommand_h */
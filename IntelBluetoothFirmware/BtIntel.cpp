@@ -63,18 +63,25 @@ void BtIntel::printIntelVersion(IntelVersion *ver)
 }
 
 
+/* Dumps size bytes at addr 16 to a line, only in debug builds as it runs
+ * for every event.
+ */
 void BtIntel::printAllByte(void *addr, int size)
 {
+#if XY_LOG_LEVEL >= XY_LOG_DEBUG
     unsigned char *ptr = (unsigned char*)addr;
-    int print_bytes = 0;
+    char line[16 * 3 + 1];
  
     if(NULL == ptr) {
         return;
     }
     
-//    while(print_bytes < size) {
-//        XYLog("%02x", *ptr);
-//        ptr++;
-//        print_bytes++;
-//    }
+    for (int print_bytes = 0; print_bytes < size; print_bytes += 16) {
+        int count = size - print_bytes < 16 ? size - print_bytes : 16;
+        for (int i = 0; i < count; i++) {
+            snprintf(line + i * 3, 4, "%02x ", ptr[print_bytes + i]);
+        }
+        XYLogDebug("%s\n", line);
+    }
+#endif
 }
@@ -0,0 +1,88 @@
+//
+//  BtTrace.cpp
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "BtTrace.h"
+#include "Log.h"
+
+BtTrace::BtTrace()
+: mRecords(NULL), mNext(0), mDrained(0)
+{
+}
+
+bool BtTrace::init()
+{
+    if (mRecords) {
+        return true;
+    }
+    mRecords = (BtTraceRecord *)IOMalloc(sizeof(BtTraceRecord) * BT_TRACE_ENTRIES);
+    if (!mRecords) {
+        XYLog("fail to alloc trace ring\n");
+        return false;
+    }
+    bzero(mRecords, sizeof(BtTraceRecord) * BT_TRACE_ENTRIES);
+    mNext = 0;
+    mDrained = 0;
+    return true;
+}
+
+void BtTrace::free()
+{
+    if (mRecords) {
+        IOFree(mRecords, sizeof(BtTraceRecord) * BT_TRACE_ENTRIES);
+        mRecords = NULL;
+    }
+}
+
+OSData *BtTrace::drain()
+{
+    if (!mRecords) {
+        return NULL;
+    }
+    uint32_t next = (uint32_t)mNext;
+    uint32_t first = mDrained;
+    uint32_t dropped = 0;
+    if (next - first > BT_TRACE_ENTRIES) {
+        dropped = next - first - BT_TRACE_ENTRIES;
+        first = next - BT_TRACE_ENTRIES;
+    }
+    uint32_t size = sizeof(BtTraceHeader) + (next - first) * sizeof(BtTraceRecord);
+    uint8_t *buffer = (uint8_t *)IOMalloc(size);
+    if (!buffer) {
+        return NULL;
+    }
+    BtTraceHeader *header = (BtTraceHeader *)buffer;
+    BtTraceRecord *out = (BtTraceRecord *)(header + 1);
+    uint32_t count = 0;
+    for (uint32_t i = first; i != next; i++) {
+        const BtTraceRecord *r = &mRecords[i & (BT_TRACE_ENTRIES - 1)];
+        /* Still being written, or already overwritten by a later writer */
+        if (r->sequence != i + 1) {
+            dropped++;
+            continue;
+        }
+        OSMemoryBarrier();
+        out[count] = *r;
+        OSMemoryBarrier();
+        if (r->sequence != i + 1) {
+            dropped++;
+            continue;
+        }
+        count++;
+    }
+    mDrained = next;
+
+    header->magic = BT_TRACE_MAGIC;
+    header->version = BT_TRACE_VERSION;
+    header->recordSize = sizeof(BtTraceRecord);
+    header->count = count;
+    header->dropped = dropped;
+    nanoseconds_to_absolutetime(1000000000ULL, &header->ticksPerSecond);
+    OSData *data = OSData::withBytes(buffer, sizeof(BtTraceHeader) + count * sizeof(BtTraceRecord));
+    IOFree(buffer, size);
+    return data;
+}
@@ -0,0 +1,78 @@
+//
+//  BtTrace.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef BtTrace_h
+#define BtTrace_h
+
+#include <IOKit/IOLib.h>
+#include <libkern/OSAtomic.h>
+#include <libkern/c++/OSData.h>
+#include "BtTraceFormat.h"
+
+/* Records kept per driver instance, a power of two */
+#define BT_TRACE_ENTRIES    1024
+
+/* XY_TRACE=0 in the preprocessor definitions compiles every XYTrace out */
+#ifndef XY_TRACE
+#define XY_TRACE 1
+#endif
+
+#define XYTrace(trace, event, a0, a1, a2, a3)\
+do\
+{\
+if (XY_TRACE && (trace)) (trace)->record(event, a0, a1, a2, a3);\
+}while(0)
+
+/* Fixed size ring of binary records for the paths that run once per
+ * command, where IOLog would cost more than the command. Writers only take
+ * a slot with one atomic increment and may run on any thread, including
+ * USB completions. drain() is called by one thread at a time and skips
+ * records that are being rewritten while it copies them.
+ */
+class BtTrace {
+
+public:
+
+    BtTrace();
+
+    bool init();
+
+    void free();
+
+    void record(uint16_t event, uint32_t a0 = 0, uint32_t a1 = 0, uint32_t a2 = 0, uint32_t a3 = 0)
+    {
+        if (!mRecords) {
+            return;
+        }
+        uint32_t sequence = (uint32_t)OSIncrementAtomic(&mNext) + 1;
+        BtTraceRecord *r = &mRecords[(sequence - 1) & (BT_TRACE_ENTRIES - 1)];
+        r->sequence = 0;
+        OSMemoryBarrier();
+        r->time = mach_absolute_time();
+        r->event = event;
+        r->reserved = 0;
+        r->args[0] = a0;
+        r->args[1] = a1;
+        r->args[2] = a2;
+        r->args[3] = a3;
+        OSMemoryBarrier();
+        r->sequence = sequence;
+    }
+
+    /* Everything recorded since the last drain, in the BtTraceFormat.h
+     * layout.
+     */
+    OSData *drain();
+
+private:
+    BtTraceRecord *mRecords;
+    volatile SInt32 mNext;
+    uint32_t mDrained;
+};
+
+#endif /* BtTrace_h */
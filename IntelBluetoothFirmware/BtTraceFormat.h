@@ -0,0 +1,53 @@
+//
+//  BtTraceFormat.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef BtTraceFormat_h
+#define BtTraceFormat_h
+
+#include <stdint.h>
+
+/* Layout of the Trace property the driver publishes when DrainTrace is
+ * set, shared with TraceDecoder. A header followed by count records,
+ * oldest first, all fields in host byte order.
+ */
+#define BT_TRACE_MAGIC      0x54425449      /* "ITBT" */
+#define BT_TRACE_VERSION    1
+
+struct BtTraceHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize;
+    uint32_t count;
+    uint32_t dropped;           /* overwritten before they were drained */
+    uint64_t ticksPerSecond;    /* of the record timestamps */
+};
+
+struct BtTraceRecord {
+    uint64_t time;              /* mach absolute time */
+    uint32_t sequence;          /* reservation + 1, stored last */
+    uint16_t event;
+    uint16_t reserved;
+    uint32_t args[4];
+};
+
+/* Record events, TraceDecoder names the arguments in the same order */
+enum {
+    kBtTraceState = 1,          /* new flow, state */
+    kBtTraceCommandSubmit,      /* opcode, length, flags, token */
+    kBtTraceCommandComplete,    /* opcode, status, latency us, token */
+    kBtTraceCommandTimeout,     /* opcode or vendor event code, token, timeout ms */
+    kBtTraceReadPost,           /* bulk */
+    kBtTraceReadComplete,       /* status, length, event code, bulk */
+    kBtTraceVendorEvent,        /* code, count */
+    kBtTraceFragment,           /* type, length, in flight */
+    kBtTraceDownload,           /* succeeded, elapsed ms */
+    kBtTraceResume,             /* acked fragments, unacked, resumes */
+    kBtTraceEventCount
+};
+
+#endif /* BtTraceFormat_h */
@@ -0,0 +1,135 @@
+//
+//  BtTransport.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef BtTransport_h
+#define BtTransport_h
+
+#include <IOKit/IOTypes.h>
+#include <string.h>
+
+/* Called when an interrupt or bulk read posted on the transport completes.
+ * The data pointer is only valid for the duration of the call.
+ */
+typedef void (*BtTransportReadAction)(void *owner, IOReturn status, const void *data, uint32_t length);
+
+enum {
+    kBtPipeInterrupt,
+    kBtPipeBulkIn,
+    kBtPipeBulkOut,
+    kBtPipeCount
+};
+
+/* Stalls of one endpoint and how they were dealt with */
+struct BtStallStats {
+    uint32_t stalls;
+    uint32_t recovered;
+    uint32_t failed;
+    uint32_t clears;            /* clear halt attempts */
+    uint32_t maxUs;
+    uint64_t totalUs;
+};
+
+/* The firmware download state machines only talk to the controller through
+ * this interface: HCI commands go out on the control endpoint, secure send
+ * fragments on the bulk out endpoint, and events come back on the interrupt
+ * or bulk in endpoint.
+ */
+class BtTransport {
+
+public:
+
+    BtTransport() : mBytesCopied(0), mOwner(NULL), mReadAction(NULL) {}
+
+    virtual ~BtTransport() {}
+
+    void setReadAction(void *owner, BtTransportReadAction action)
+    {
+        mOwner = owner;
+        mReadAction = action;
+    }
+
+    virtual IOReturn sendHCICommand(const void *command, uint16_t length) = 0;
+
+    virtual IOReturn bulkWrite(const void *data, uint16_t length) = 0;
+
+    /* Returns a wired buffer for a bulk write of length bytes, filled in
+     * place and handed to bulkWrite() it goes out without a copy or a
+     * descriptor allocation. NULL if the transport has none free.
+     */
+    virtual uint8_t *acquireBulkBuffer(uint16_t length) { return NULL; }
+
+    /* Bulk writes that went out of the wired buffer and those that needed
+     * a descriptor of their own.
+     */
+    virtual void getBulkBufferStats(uint32_t *hits, uint32_t *misses) { *hits = *misses = 0; }
+
+    /* Lets bulkWriteGather() send data that lies in [bytes, bytes + length)
+     * without copying it. The image has to stay where it is until
+     * unmapImage(). Returns false if the transport can not, data is copied
+     * then.
+     */
+    virtual bool mapImage(const void *bytes, uint32_t length) { return false; }
+
+    virtual void unmapImage() {}
+
+    /* Writes header followed by data as one bulk transfer. By default both
+     * are copied into the wired buffer if there is one, transports that
+     * mapped the image send data inside it from where it is.
+     */
+    virtual IOReturn bulkWriteGather(const void *header, uint16_t headerLength, const void *data, uint16_t dataLength)
+    {
+        uint8_t buffer[258];
+        if (headerLength + dataLength > sizeof(buffer)) {
+            return kIOReturnBadArgument;
+        }
+        uint8_t *bytes = acquireBulkBuffer(headerLength + dataLength);
+        if (!bytes) {
+            bytes = buffer;
+        }
+        memcpy(bytes, header, headerLength);
+        memcpy(bytes + headerLength, data, dataLength);
+        mBytesCopied += dataLength;
+        return bulkWrite(bytes, headerLength + dataLength);
+    }
+
+    /* Fills kBtPipeCount entries, indexed by kBtPipeInterrupt... */
+    virtual void getStallStats(BtStallStats *stats) { bzero(stats, sizeof(*stats) * kBtPipeCount); }
+
+    /* Bytes of bulk writes copied on their way to the bulk out pipe */
+    uint64_t bytesCopied() const { return mBytesCopied; }
+
+    virtual bool interruptRead() = 0;
+
+    virtual bool bulkRead() = 0;
+
+    /* Aborts every pipe, writes in flight included */
+    virtual void abort() = 0;
+
+    /* Aborts the read posted on bulk in or the interrupt pipe, it comes
+     * back with kIOReturnAborted. The other pipes carry on.
+     */
+    virtual void abortRead(bool bulk) = 0;
+
+protected:
+
+    void notifyRead(IOReturn status, const void *data, uint32_t length)
+    {
+        if (mReadAction) {
+            mReadAction(mOwner, status, data, length);
+        }
+    }
+
+protected:
+    uint64_t mBytesCopied;
+
+private:
+    void *mOwner;
+    BtTransportReadAction mReadAction;
+};
+
+#endif /* BtTransport_h */
@@ -9,27 +9,124 @@
 #ifndef FWData_h
 #define FWData_h
 #include <string.h>
+#include "FwPlan.h"
+#include "FwKey.h"
+#include "FwContainer.h"
 
-struct FwDesc {
-    const char *name;
-    const unsigned char *var;
-    const long int size;
-};
+/* Firmware container built by FwGenerator and linked in by FwPayload.S */
+extern "C" const unsigned char fwContainer[];
+extern "C" const unsigned char fwContainerEnd[];
+
+static inline const struct FwContainerHeader *getFWContainer() {
+    const struct FwContainerHeader *container = (const struct FwContainerHeader *)fwContainer;
+    return FwContainerCheck(container, (uint32_t)(fwContainerEnd - fwContainer)) ? container : NULL;
+}
+
+/* Read-only view of an embedded firmware image. The bytes stay in the
+ * kext's constant data, loading a controller never copies them. Packed
+ * and delta images have to be read through FwReader, bytes() is the
+ * stored stream and length() the size of the image once rebuilt. The
+ * stream of a resource entry is NULL until withStream() attaches the
+ * requested resource.
+ */
+class FwView {
+
+public:
+
+    FwView() : container(NULL), entry(NULL), stream(NULL) {}
+
+    FwView(const struct FwContainerHeader *container, uint32_t index)
+    : container(container), entry(container ? FwContainerEntryAt(container, index) : NULL), stream(NULL) {}
+
+    bool isValid() const { return entry != NULL; }
+
+    void reset() { container = NULL; entry = NULL; stream = NULL; }
+
+    bool isResource() const { return (entry->flags & kFwEntryResource) != 0; }
+
+    /* Returns the view reading a resource entry from bytes, or an invalid
+     * view if length is not what the entry expects.
+     */
+    FwView withStream(const uint8_t *bytes, uint32_t length) const {
+        FwView view(*this);
+        if (!isResource() || !bytes || length != entry->storedLength) {
+            view.reset();
+        } else {
+            view.stream = bytes;
+        }
+        return view;
+    }
+
+    const char *name() const { return entry->name; }
+
+    uint32_t type() const { return entry->type; }
+
+    uint32_t checksum() const { return entry->checksum; }
+
+    const uint8_t *bytes() const { return isResource() ? stream : (const uint8_t *)container + entry->offset; }
 
-#define IBT_FW(fw_name, fw_var, fw_size) \
-    .name = fw_name, .var = fw_var, .size = fw_size
+    uint32_t length() const { return entry->length; }
 
+    bool isPacked() const { return entry->packedLength != 0; }
 
-extern const struct FwDesc fwList[];
-extern const int fwNumber;
+    uint32_t packedLength() const { return entry->packedLength; }
 
-static inline struct FwDesc getFWDescByName(const char* name) {
-    for (int i = 0; i < fwNumber; i++) {
-        if (strcmp(fwList[i].name, name) == 0) {
-            return fwList[i];
+    bool isDelta() const { return entry->base != FW_CONTAINER_NO_BASE; }
+
+    FwView base() const { return FwView(container, entry->base); }
+
+    uint32_t deltaLength() const { return entry->deltaLength; }
+
+    const struct FwFragment *plan() const {
+        return (const struct FwFragment *)((const uint8_t *)container + container->planOffset) + entry->plan;
+    }
+
+    int planCount() const { return (int)entry->planCount; }
+
+    uint32_t bootParam() const { return entry->bootParam; }
+
+    const struct FwPatchCommand *patch() const {
+        return (const struct FwPatchCommand *)((const uint8_t *)container + container->patchOffset) + entry->patch;
+    }
+
+    int patchCount() const { return (int)entry->patchCount; }
+
+private:
+    const struct FwContainerHeader *container;
+    const struct FwContainerEntry *entry;
+    const uint8_t *stream;
+};
+
+/* Builds made with FW_VARIANTS only carry firmware for some hardware,
+ * every other build takes any controller it matches.
+ */
+static inline bool hasFWVariant(uint8_t hw_variant) {
+    const struct FwContainerHeader *container = getFWContainer();
+    if (container && !(container->flags & kFwContainerSlim)) {
+        return true;
+    }
+    const struct FwContainerEntry *entries = container ?
+    (const struct FwContainerEntry *)((const uint8_t *)container + container->entryOffset) : NULL;
+    for (uint32_t i = 0; container && i < container->entryCount; i++) {
+        if (FwKeyVariant(entries[i].keyKind, entries[i].key) == hw_variant) {
+            return true;
         }
     }
-    return fwList[0];
+    return false;
+}
+
+/* Perfect hash over the identity keys of the container, see FwKey.h */
+static inline FwView getFWImageByKey(uint16_t kind, uint64_t key) {
+    const struct FwContainerHeader *container = getFWContainer();
+    if (!container) {
+        return FwView();
+    }
+    const struct FwKeySlot *slot = (const struct FwKeySlot *)((const uint8_t *)container + container->keyOffset) +
+    (FwKeyHash(kind, key, container->keySeed) & (container->keyCount - 1));
+    if (slot->kind == kind && slot->key == key) {
+        return FwView(container, slot->index);
+    }
+    return FwView();
 }
 
 #endif /* FWData_h */
@@ -0,0 +1,156 @@
+//
+//  FwContainer.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef FwContainer_h
+#define FwContainer_h
+
+#include <stdint.h>
+#include <string.h>
+#include "FwPlan.h"
+#include "FwKey.h"
+
+/* Everything the driver knows about its firmware lives in one container
+ * that FwGenerator writes at build time: a header, a fixed size entry per
+ * image, the key table, the precomputed fragments and patch commands and
+ * then the stored images, each one starting on its own page. All fields
+ * are little endian. The container is used in place, linked into the kext
+ * by FwPayload.S or mapped from a file, nothing is parsed beyond checking
+ * that offsets stay inside it.
+ */
+#define FW_CONTAINER_MAGIC      0x46425449      /* "ITBF" */
+#define FW_CONTAINER_VERSION    3
+#define FW_CONTAINER_ALIGN      4096
+#define FW_CONTAINER_NAME_LEN   64
+#define FW_CONTAINER_NO_BASE    0xffffffff
+
+/* Built with FW_ON_DEMAND=1 the container keeps only the index and every
+ * stored stream becomes a kext resource named after the checksum, the
+ * driver requests the one it needs with OSKextRequestResource.
+ */
+#define FW_CONTAINER_RESOURCE_FMT       "ibt-%08x.fw"
+#define FW_CONTAINER_RESOURCE_NAME_LEN  16
+
+enum {
+    kFwImageSfi = 1,        /* secure send download, has a fragment plan */
+    kFwImageBseq,           /* HCI patch stream, has patch commands */
+};
+
+enum {
+    kFwEntryResource = 0x0001,      /* stored stream is a kext resource */
+};
+
+enum {
+    kFwContainerSlim = 0x0001,      /* built with FW_VARIANTS, only carries some hardware */
+};
+
+struct FwContainerHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t headerSize;
+    uint32_t length;        /* of the whole container */
+    uint32_t entryCount;
+    uint32_t entrySize;
+    uint32_t entryOffset;
+    uint32_t keyOffset;     /* FwKeySlot table, keyCount is a power of two */
+    uint32_t keyCount;
+    uint32_t keySeed;
+    uint32_t planOffset;    /* FwFragment table shared by all .sfi entries */
+    uint32_t planCount;
+    uint32_t patchOffset;   /* FwPatchCommand table shared by all .bseq entries */
+    uint32_t patchCount;
+    uint32_t payloadOffset;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct FwContainerEntry {
+    char name[FW_CONTAINER_NAME_LEN];
+    uint32_t type;
+    uint16_t keyKind;       /* hardware identity, see FwKey.h */
+    uint16_t flags;
+    uint64_t key;
+    uint32_t offset;        /* of the stored stream, page aligned, 0 for a resource */
+    uint32_t storedLength;
+    uint32_t length;        /* of the image once rebuilt */
+    uint32_t packedLength;  /* 0 unless LZ packed, see FwLz.h */
+    uint32_t base;          /* entry a delta is taken against, see FwDelta.h */
+    uint32_t deltaLength;
+    uint32_t checksum;      /* CRC-32 of the rebuilt image */
+    uint32_t plan;          /* first fragment in the plan table */
+    uint32_t planCount;
+    uint32_t bootParam;
+    uint32_t patch;         /* first command in the patch table */
+    uint32_t patchCount;
+};
+
+static_assert(sizeof(FwContainerHeader) == 64, "container header layout changed");
+static_assert(sizeof(FwContainerEntry) == 128, "container entry layout changed");
+static_assert(sizeof(FwKeySlot) == 16 && sizeof(FwFragment) == 8 && sizeof(FwPatchCommand) == 12,
+              "container table layout changed");
+
+/* CRC-32 as in zlib, continued over length more bytes from crc, start
+ * from 0.
+ */
+static inline uint32_t FwCrc32(uint32_t crc, const uint8_t *bytes, size_t length)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= bytes[i];
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xedb88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+static inline bool FwContainerRange(uint32_t length, uint32_t offset, uint32_t count, uint32_t size)
+{
+    return offset <= length && count <= (length - offset) / size;
+}
+
+/* Checks the header and that every table lies inside length bytes */
+static inline bool FwContainerCheck(const struct FwContainerHeader *c, uint32_t length)
+{
+    if (length < sizeof(*c) || c->magic != FW_CONTAINER_MAGIC || c->version != FW_CONTAINER_VERSION ||
+        c->headerSize != sizeof(*c) || c->entrySize != sizeof(struct FwContainerEntry) || c->length > length) {
+        return false;
+    }
+    return FwContainerRange(c->length, c->entryOffset, c->entryCount, sizeof(struct FwContainerEntry)) &&
+    FwContainerRange(c->length, c->keyOffset, c->keyCount, sizeof(struct FwKeySlot)) &&
+    c->keyCount && !(c->keyCount & (c->keyCount - 1)) &&
+    FwContainerRange(c->length, c->planOffset, c->planCount, sizeof(struct FwFragment)) &&
+    FwContainerRange(c->length, c->patchOffset, c->patchCount, sizeof(struct FwPatchCommand)) &&
+    c->entryOffset % 8 == 0 && c->keyOffset % 8 == 0 && c->planOffset % 4 == 0 && c->patchOffset % 4 == 0;
+}
+
+/* Returns entry index of a checked container if everything it points to
+ * lies inside the container, NULL otherwise.
+ */
+static inline const struct FwContainerEntry *FwContainerEntryAt(const struct FwContainerHeader *c, uint32_t index)
+{
+    if (index >= c->entryCount) {
+        return NULL;
+    }
+    const struct FwContainerEntry *e = (const struct FwContainerEntry *)((const uint8_t *)c + c->entryOffset) + index;
+    if (!memchr(e->name, 0, sizeof(e->name)) || !FwContainerRange(c->planCount, e->plan, e->planCount, 1) ||
+        !FwContainerRange(c->patchCount, e->patch, e->patchCount, 1)) {
+        return NULL;
+    }
+    /* A resource arrives on its own, it can not lean on a base */
+    if ((e->flags & kFwEntryResource) ? e->offset || e->base != FW_CONTAINER_NO_BASE :
+        !FwContainerRange(c->length, e->offset, e->storedLength, 1)) {
+        return NULL;
+    }
+    uint32_t stream = e->base != FW_CONTAINER_NO_BASE ? e->deltaLength : e->length;
+    if (e->packedLength ? e->packedLength != e->storedLength : stream != e->storedLength) {
+        return NULL;
+    }
+    return e;
+}
+
+#endif /* FwContainer_h */
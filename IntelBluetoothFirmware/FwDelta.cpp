@@ -0,0 +1,44 @@
+//
+//  FwDelta.cpp
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "FwDelta.h"
+
+static int readVarint(const uint8_t *p, uint32_t avail, uint32_t *value)
+{
+    uint32_t v = 0;
+    for (uint32_t i = 0; i < avail && i < 5; i++) {
+        v |= (uint32_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *value = v;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+int FwDeltaReadOp(const uint8_t *p, uint32_t avail, FwDeltaOp *op)
+{
+    uint32_t header;
+    int len = readVarint(p, avail, &header);
+    if (len < 0 || header >> 1 == 0) {
+        return -1;
+    }
+    op->length = header >> 1;
+    op->copy = header & 1;
+    op->skew = 0;
+    if (!op->copy) {
+        return len;
+    }
+    uint32_t zigzag;
+    int skewLen = readVarint(p + len, avail - len, &zigzag);
+    if (skewLen < 0) {
+        return -1;
+    }
+    op->skew = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+    return len + skewLen;
+}
@@ -0,0 +1,34 @@
+//
+//  FwDelta.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef FwDelta_h
+#define FwDelta_h
+
+#include <stdint.h>
+
+/* A delta rebuilds an image from a base image of the same hw_variant. It
+ * is a list of ops, each starting with a LEB128 header: bit 0 clear means
+ * header >> 1 literal bytes follow, bit 0 set copies header >> 1 bytes of
+ * the base. A copy is followed by a zigzag LEB128 skew of its base offset
+ * against where the previous copy ended, so copies that keep following the
+ * base cost a single byte.
+ */
+#define FW_DELTA_OP_MAX_HDR 10
+
+struct FwDeltaOp {
+    uint32_t length;
+    int32_t skew;
+    bool copy;
+};
+
+/* Parses the op header at p, returns its length or -1 when it is malformed
+ * or does not fit avail.
+ */
+int FwDeltaReadOp(const uint8_t *p, uint32_t avail, FwDeltaOp *op);
+
+#endif /* FwDelta_h */
@@ -0,0 +1,84 @@
+//
+//  FwKey.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef FwKey_h
+#define FwKey_h
+
+#include <stdint.h>
+
+/* Firmware images are looked up by the hardware identity the controller
+ * reports instead of by file name. Every naming scheme of the Linux
+ * btintel driver gets its own kind of key.
+ */
+enum {
+    kFwKeyNone = 0,
+    kFwKeySfi,              /* ibt-<hw_variant>-<hw_revision>-<fw_revision>.sfi */
+    kFwKeySfiRevId,         /* ibt-<hw_variant>-<dev_revid>.sfi */
+    kFwKeyBseq,             /* ibt-hw-<hw_platform>.<hw_variant>.<hw_revision>-fw-<fw_variant>.
+                             * <fw_revision>.<fw_build_num>.<fw_build_ww>.<fw_build_yy>.bseq */
+    kFwKeyBseqDefault,      /* ibt-hw-<hw_platform>.<hw_variant>.bseq */
+};
+
+struct FwKeySlot {
+    uint64_t key;
+    uint16_t kind;          /* kFwKeyNone for an empty slot */
+    uint16_t index;         /* of the container entry */
+};
+
+static inline uint64_t FwKeySfi(uint8_t hw_variant, uint8_t hw_revision, uint8_t fw_revision)
+{
+    return ((uint64_t)hw_variant << 16) | (hw_revision << 8) | fw_revision;
+}
+
+static inline uint64_t FwKeySfiRevId(uint8_t hw_variant, uint16_t dev_revid)
+{
+    return ((uint64_t)hw_variant << 16) | dev_revid;
+}
+
+static inline uint64_t FwKeyBseq(uint8_t hw_platform, uint8_t hw_variant, uint8_t hw_revision,
+                                 uint8_t fw_variant, uint8_t fw_revision, uint8_t fw_build_num,
+                                 uint8_t fw_build_ww, uint8_t fw_build_yy)
+{
+    return ((uint64_t)hw_platform << 56) | ((uint64_t)hw_variant << 48) |
+    ((uint64_t)hw_revision << 40) | ((uint64_t)fw_variant << 32) |
+    ((uint64_t)fw_revision << 24) | (fw_build_num << 16) | (fw_build_ww << 8) | fw_build_yy;
+}
+
+static inline uint64_t FwKeyBseqDefault(uint8_t hw_platform, uint8_t hw_variant)
+{
+    return ((uint64_t)hw_platform << 8) | hw_variant;
+}
+
+/* Recovers the hw_variant a key was built from */
+static inline uint8_t FwKeyVariant(uint16_t kind, uint64_t key)
+{
+    switch (kind) {
+        case kFwKeySfi:
+        case kFwKeySfiRevId:
+            return (uint8_t)(key >> 16);
+        case kFwKeyBseq:
+            return (uint8_t)(key >> 48);
+        case kFwKeyBseqDefault:
+            return (uint8_t)key;
+        default:
+            return 0;
+    }
+}
+
+/* FwGenerator searches a seed that sends every key of the container to its
+ * own slot, a lookup is a single probe.
+ */
+static inline uint32_t FwKeyHash(uint16_t kind, uint64_t key, uint32_t seed)
+{
+    uint64_t h = (key ^ ((uint64_t)kind << 60) ^ seed) * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ull;
+    return (uint32_t)(h >> 32);
+}
+
+#endif /* FwKey_h */
@@ -0,0 +1,90 @@
+//
+//  FwLz.cpp
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "FwLz.h"
+
+#define FW_LZ_MIN_MATCH 4
+
+int FwLzDecodeBlock(const uint8_t *src, uint32_t srcLength, uint8_t *dst, uint32_t dstCapacity)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + srcLength;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dstCapacity;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        uint32_t length = token >> 4;
+        if (length == 15) {
+            uint8_t s;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                s = *ip++;
+                length += s;
+            } while (s == 255);
+        }
+        if ((uint32_t)(iend - ip) < length || (uint32_t)(oend - op) < length) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < length; i++) {
+            op[i] = ip[i];
+        }
+        ip += length;
+        op += length;
+        /* The last sequence only carries literals */
+        if (ip == iend) {
+            break;
+        }
+        if (iend - ip < 2) {
+            return -1;
+        }
+        uint32_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (uint32_t)(op - dst)) {
+            return -1;
+        }
+        length = token & 0x0f;
+        if (length == 15) {
+            uint8_t s;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                s = *ip++;
+                length += s;
+            } while (s == 255);
+        }
+        length += FW_LZ_MIN_MATCH;
+        if ((uint32_t)(oend - op) < length) {
+            return -1;
+        }
+        /* Matches may overlap their own output, copy forward byte by byte
+         * unless the distance allows word sized moves.
+         */
+        const uint8_t *match = op - offset;
+        if (offset >= 8) {
+            uint32_t i = 0;
+            for (; i + 8 <= length; i += 8) {
+                uint64_t v;
+                __builtin_memcpy(&v, match + i, 8);
+                __builtin_memcpy(op + i, &v, 8);
+            }
+            for (; i < length; i++) {
+                op[i] = match[i];
+            }
+        } else {
+            for (uint32_t i = 0; i < length; i++) {
+                op[i] = match[i];
+            }
+        }
+        op += length;
+    }
+    return (int)(op - dst);
+}
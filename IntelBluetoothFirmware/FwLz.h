@@ -0,0 +1,40 @@
+//
+//  FwLz.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef FwLz_h
+#define FwLz_h
+
+#include <stdint.h>
+
+/* Compressed images are a sequence of independent blocks, each decoding to
+ * FW_LZ_BLOCK_SIZE bytes except the last one. Every block starts with a 32
+ * bit little endian header holding the payload length, FW_LZ_BLOCK_STORED
+ * marks a block that did not compress and is kept as is. The payload uses
+ * the LZ4 block format.
+ */
+#define FW_LZ_BLOCK_SIZE        65536
+#define FW_LZ_BLOCK_HDR_LEN     4
+#define FW_LZ_BLOCK_STORED      0x80000000u
+#define FW_LZ_BLOCK_LEN_MASK    0x7fffffffu
+
+/* Decoded blocks a reader keeps around, deltas copy from two neighbouring
+ * blocks of their base most of the time.
+ */
+#define FW_LZ_BLOCK_WINDOWS     2
+
+static inline uint32_t FwLzBlockHeader(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Decodes one LZ4 block into dst, returns the number of bytes produced or
+ * -1 if the block is malformed or does not fit dstCapacity.
+ */
+int FwLzDecodeBlock(const uint8_t *src, uint32_t srcLength, uint8_t *dst, uint32_t dstCapacity);
+
+#endif /* FwLz_h */
@@ -0,0 +1,184 @@
+//
+//  FwPlan.cpp
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "FwPlan.h"
+#include <string.h>
+
+#define FW_CMD_HDR_LEN 3
+#define FW_EVT_HDR_LEN 2
+#define FW_EVT_CMD_COMPLETE 0x0e
+#define FW_OP_WRITE_BOOT_PARAMS 0xfc0e
+
+static const struct {
+    uint8_t type;
+    uint32_t offset;
+    uint32_t length;
+} sfiHeader[] = {
+    /* Init fragment represented by the 128 bytes of CSS header */
+    { kFwFragmentInit, 0, 128 },
+    /* 256 bytes of public key information */
+    { kFwFragmentPKey, 128, 256 },
+    /* 256 bytes of signature information */
+    { kFwFragmentSign, 388, 256 },
+};
+
+FwFragmentPlanner::FwFragmentPlanner(const uint8_t *fw, uint32_t size)
+: fw(fw), size(size), pos(FW_SFI_HEADER_LEN), headerStep(0), headerPos(0),
+aligned(0), pending(0), fragments(0), boot_param(0), corrupted(false)
+{
+}
+
+bool FwFragmentPlanner::emit(FwFragment *fragment, uint8_t type, uint32_t offset, uint32_t length)
+{
+    fragment->offset = offset;
+    fragment->length = length;
+    fragment->type = type;
+    fragment->reserved = 0;
+    fragments++;
+    return true;
+}
+
+bool FwFragmentPlanner::next(FwFragment *fragment)
+{
+    if (corrupted) {
+        return false;
+    }
+    while (headerStep < sizeof(sfiHeader) / sizeof(sfiHeader[0])) {
+        uint32_t offset = sfiHeader[headerStep].offset;
+        uint32_t length = sfiHeader[headerStep].length;
+        if (offset + length > size) {
+            corrupted = true;
+            return false;
+        }
+        if (headerPos < length) {
+            uint32_t len = length - headerPos;
+            if (len > FW_FRAGMENT_MAX_LEN) {
+                len = FW_FRAGMENT_MAX_LEN;
+            }
+            emit(fragment, sfiHeader[headerStep].type, offset + headerPos, len);
+            headerPos += len;
+            return true;
+        }
+        headerStep++;
+        headerPos = 0;
+    }
+    while (true) {
+        /* A single command group larger than one fragment */
+        if (aligned > FW_FRAGMENT_MAX_LEN) {
+            emit(fragment, kFwFragmentData, pos, FW_FRAGMENT_MAX_LEN);
+            pos += FW_FRAGMENT_MAX_LEN;
+            aligned -= FW_FRAGMENT_MAX_LEN;
+            return true;
+        }
+        uint32_t cur = pos + aligned + pending;
+        if (cur >= size) {
+            /* Trailing commands that never reach a 4 byte boundary */
+            if (pending) {
+                corrupted = true;
+                return false;
+            }
+            if (aligned) {
+                emit(fragment, kFwFragmentData, pos, aligned);
+                pos += aligned;
+                aligned = 0;
+                return true;
+            }
+            return false;
+        }
+        if (size - cur < FW_CMD_HDR_LEN || size - cur - FW_CMD_HDR_LEN < fw[cur + 2]) {
+            corrupted = true;
+            return false;
+        }
+        uint16_t opcode = fw[cur] | (fw[cur + 1] << 8);
+        uint8_t plen = fw[cur + 2];
+        /* Each SKU has a different reset parameter to use in the
+         * HCI_Intel_Reset command and it is embedded in the firmware
+         * data. The boot parameter is the first 32-bit value and rest
+         * of 3 octets are reserved.
+         */
+        if (opcode == FW_OP_WRITE_BOOT_PARAMS && plen >= 4) {
+            const uint8_t *p = fw + cur + FW_CMD_HDR_LEN;
+            boot_param = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+        }
+        pending += FW_CMD_HDR_LEN + plen;
+        if ((aligned + pending) % 4) {
+            continue;
+        }
+        if (aligned + pending <= FW_FRAGMENT_MAX_LEN) {
+            aligned += pending;
+            pending = 0;
+            continue;
+        }
+        if (aligned) {
+            emit(fragment, kFwFragmentData, pos, aligned);
+            pos += aligned;
+            aligned = pending;
+            pending = 0;
+            return true;
+        }
+        aligned = pending;
+        pending = 0;
+    }
+}
+
+FwPatchIndexer::FwPatchIndexer(const uint8_t *fw, uint32_t size)
+: fw(fw), size(size), pos(0), commands(0), corrupted(false)
+{
+}
+
+bool FwPatchIndexer::next(FwPatchCommand *command)
+{
+    if (corrupted || pos >= size) {
+        return false;
+    }
+    /* The first byte indicates the types of the patch command or event.
+     * 0x01 means HCI command and 0x02 is HCI event. A record that does not
+     * start with a complete command means the firmware file is corrupted.
+     */
+    uint32_t remain = size - pos;
+    if (remain < 1 + FW_CMD_HDR_LEN || fw[pos] != 0x01) {
+        corrupted = true;
+        return false;
+    }
+    const uint8_t *cmd = fw + pos + 1;
+    uint8_t plen = cmd[2];
+    if (remain - 1 - FW_CMD_HDR_LEN < plen) {
+        corrupted = true;
+        return false;
+    }
+    command->opcode = cmd[0] | (cmd[1] << 8);
+    command->plen = plen;
+    command->offset = pos + 1 + FW_CMD_HDR_LEN;
+    command->events = 0;
+    command->flags = kFwPatchAnyEvent;
+    memset(command->reserved, 0, sizeof(command->reserved));
+    pos = command->offset + plen;
+    /* Some vendor commands expect more than one event, for example a
+     * command status event followed by a vendor specific event. Those
+     * never see a command complete and are done after their events.
+     */
+    while (size - pos > FW_EVT_HDR_LEN && fw[pos] == 0x02) {
+        uint8_t evt_plen = fw[pos + 2];
+        if (size - pos - 1 - FW_EVT_HDR_LEN < evt_plen || command->events == 0xff) {
+            corrupted = true;
+            return false;
+        }
+        if (fw[pos + 1] == FW_EVT_CMD_COMPLETE) {
+            command->flags &= ~kFwPatchAnyEvent;
+        }
+        command->events++;
+        pos += 1 + FW_EVT_HDR_LEN + evt_plen;
+    }
+    /* Every HCI command in the firmware file has its corresponding event */
+    if (!command->events) {
+        corrupted = true;
+        return false;
+    }
+    commands++;
+    return true;
+}
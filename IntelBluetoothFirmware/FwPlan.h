@@ -0,0 +1,116 @@
+//
+//  FwPlan.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef FwPlan_h
+#define FwPlan_h
+
+#include <stdint.h>
+
+/* Fragment types of the Intel secure send (0xfc09) command */
+enum {
+    kFwFragmentInit = 0x00,
+    kFwFragmentData = 0x01,
+    kFwFragmentSign = 0x02,
+    kFwFragmentPKey = 0x03,
+};
+
+/* Maximum payload of one secure send fragment, the fragment type takes the
+ * remaining byte of the 253 bytes command parameter.
+ */
+#define FW_FRAGMENT_MAX_LEN 252
+
+/* Size of the CSS header, public key and signature in front of the
+ * command stream of an .sfi image.
+ */
+#define FW_SFI_HEADER_LEN 644
+
+struct FwFragment {
+    uint32_t offset;
+    uint16_t length;
+    uint8_t type;
+    uint8_t reserved;
+};
+
+/* Walks an .sfi image and yields the secure send fragments to download it.
+ *
+ * The data section is a stream of HCI commands padded with Intel_NOP so
+ * that command groups end on 4 byte boundaries. Consecutive aligned groups
+ * are packed into one fragment as long as it fits FW_FRAGMENT_MAX_LEN, a
+ * single group larger than that is split the way securedSend() always did.
+ */
+class FwFragmentPlanner {
+
+public:
+
+    FwFragmentPlanner(const uint8_t *fw, uint32_t size);
+
+    bool next(FwFragment *fragment);
+
+    bool isCorrupted() const { return corrupted; }
+
+    uint32_t bootParam() const { return boot_param; }
+
+    uint32_t fragmentCount() const { return fragments; }
+
+private:
+
+    bool emit(FwFragment *fragment, uint8_t type, uint32_t offset, uint32_t length);
+
+private:
+    const uint8_t *fw;
+    uint32_t size;
+    uint32_t pos;
+    uint32_t headerStep;
+    uint32_t headerPos;
+    uint32_t aligned;
+    uint32_t pending;
+    uint32_t fragments;
+    uint32_t boot_param;
+    bool corrupted;
+};
+
+enum {
+    kFwPatchAnyEvent = 0x01,        /* no command complete among the events */
+};
+
+/* One HCI command of a .bseq patch stream */
+struct FwPatchCommand {
+    uint32_t offset;        /* offset of the command parameters */
+    uint16_t opcode;
+    uint8_t plen;
+    uint8_t events;         /* events the controller answers with */
+    uint8_t flags;
+    uint8_t reserved[3];
+};
+
+/* Walks a .bseq patch stream. Every record is a 0x01 marked HCI command
+ * followed by one or more 0x02 marked events it is expected to produce.
+ */
+class FwPatchIndexer {
+
+public:
+
+    FwPatchIndexer(const uint8_t *fw, uint32_t size);
+
+    bool next(FwPatchCommand *command);
+
+    bool isCorrupted() const { return corrupted; }
+
+    uint32_t commandCount() const { return commands; }
+
+    uint32_t position() const { return pos; }
+
+private:
+    const uint8_t *fw;
+    uint32_t size;
+    uint32_t pos;
+    uint32_t commands;
+    bool corrupted;
+};
+
+#endif /* FwPlan_h */
@@ -0,0 +1,326 @@
+//
+//  FwReader.cpp
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "FwReader.h"
+#include "Log.h"
+
+FwBlockReader::FwBlockReader()
+: bytes(NULL), packedLength(0), length(0), windowSize(0), windowCount(0), decodedBlocks(0), copiedBytes(0)
+{
+    bzero(windows, sizeof(windows));
+}
+
+FwBlockReader::~FwBlockReader()
+{
+    close();
+}
+
+bool FwBlockReader::open(const uint8_t *bytes, uint32_t packedLength, uint32_t length)
+{
+    close();
+    /* A stream of fewer blocks than windows, or shorter than a block,
+     * gets no more window than it can fill.
+     */
+    uint32_t blocks = length / FW_LZ_BLOCK_SIZE + (length % FW_LZ_BLOCK_SIZE != 0);
+    windowCount = packedLength ? (blocks < FW_LZ_BLOCK_WINDOWS ? blocks : FW_LZ_BLOCK_WINDOWS) : 0;
+    windowSize = length < FW_LZ_BLOCK_SIZE ? length : FW_LZ_BLOCK_SIZE;
+    for (int i = 0; i < windowCount; i++) {
+        windows[i].data = (uint8_t *)IOMalloc(windowSize);
+        if (!windows[i].data) {
+            XYLog("can not allocate firmware decode window\n");
+            close();
+            return false;
+        }
+    }
+    this->bytes = bytes;
+    this->packedLength = packedLength;
+    this->length = length;
+    return true;
+}
+
+void FwBlockReader::close()
+{
+    for (int i = 0; i < windowCount; i++) {
+        if (windows[i].data) {
+            IOFree(windows[i].data, windowSize);
+        }
+    }
+    bzero(windows, sizeof(windows));
+    windowCount = 0;
+    bytes = NULL;
+    decodedBlocks = 0;
+    copiedBytes = 0;
+}
+
+const FwBlockReader::Window *FwBlockReader::loadBlock(uint32_t block)
+{
+    int slot = 0;
+    while (slot < windowCount - 1 &&
+           !(windows[slot].length && windows[slot].block == block)) {
+        slot++;
+    }
+    Window window = windows[slot];
+    for (; slot > 0; slot--) {
+        windows[slot] = windows[slot - 1];
+    }
+    windows[0] = window;
+    if (window.length && window.block == block) {
+        return &windows[0];
+    }
+    windows[0].length = 0;
+
+    /* Block headers chain to each other, skip forward from the closest
+     * decoded block in front of the wanted one or from the first block.
+     */
+    uint32_t index = 0;
+    uint32_t pos = 0;
+    for (int i = 1; i < windowCount; i++) {
+        if (windows[i].length && windows[i].block <= block && windows[i].block >= index) {
+            index = windows[i].block;
+            pos = windows[i].packed;
+        }
+    }
+    uint32_t header, payload;
+    while (true) {
+        if (packedLength - pos < FW_LZ_BLOCK_HDR_LEN) {
+            XYLog("packed firmware truncated at %u\n", pos);
+            return NULL;
+        }
+        header = FwLzBlockHeader(bytes + pos);
+        payload = header & FW_LZ_BLOCK_LEN_MASK;
+        if (packedLength - pos - FW_LZ_BLOCK_HDR_LEN < payload) {
+            XYLog("packed firmware truncated at %u\n", pos);
+            return NULL;
+        }
+        if (index == block) {
+            break;
+        }
+        pos += FW_LZ_BLOCK_HDR_LEN + payload;
+        index++;
+    }
+
+    uint32_t expected = length - block * FW_LZ_BLOCK_SIZE;
+    if (expected > FW_LZ_BLOCK_SIZE) {
+        expected = FW_LZ_BLOCK_SIZE;
+    }
+    const uint8_t *src = bytes + pos + FW_LZ_BLOCK_HDR_LEN;
+    int decoded;
+    if (header & FW_LZ_BLOCK_STORED) {
+        decoded = payload <= windowSize ? (int)payload : -1;
+        if (decoded > 0) {
+            memcpy(windows[0].data, src, payload);
+        }
+    } else {
+        decoded = FwLzDecodeBlock(src, payload, windows[0].data, windowSize);
+    }
+    if (decoded != (int)expected) {
+        XYLog("packed firmware block at %u is corrupted (%d != %u)\n", pos, decoded, expected);
+        return NULL;
+    }
+    windows[0].block = block;
+    windows[0].length = expected;
+    windows[0].packed = pos;
+    decodedBlocks++;
+    copiedBytes += expected;
+    return &windows[0];
+}
+
+const uint8_t *FwBlockReader::map(uint32_t offset, uint32_t length)
+{
+    if (!bytes || offset > this->length || this->length - offset < length) {
+        return NULL;
+    }
+    if (!packedLength) {
+        return bytes + offset;
+    }
+    if (!length) {
+        return staging;
+    }
+    if (length > FW_READER_MAX_MAP) {
+        return NULL;
+    }
+    uint32_t block = offset / FW_LZ_BLOCK_SIZE;
+    const Window *window = loadBlock(block);
+    if (!window) {
+        return NULL;
+    }
+    uint32_t inBlock = offset - block * FW_LZ_BLOCK_SIZE;
+    uint32_t avail = window->length - inBlock;
+    if (length <= avail) {
+        return window->data + inBlock;
+    }
+    memcpy(staging, window->data + inBlock, avail);
+    if (!(window = loadBlock(block + 1))) {
+        return NULL;
+    }
+    memcpy(staging + avail, window->data, length - avail);
+    copiedBytes += length;
+    return staging;
+}
+
+FwReader::FwReader()
+: readNs(0), copiedBytes(0), opStart(0), opLength(0), opSource(0), opCopy(false), opNext(0), copyEnd(0)
+{
+}
+
+bool FwReader::open(const FwView &image)
+{
+    close();
+    if (!image.isValid()) {
+        return false;
+    }
+    if (!image.bytes()) {
+        XYLog("firmware %s has not been loaded\n", image.name());
+        return false;
+    }
+    uint32_t streamLength = image.isDelta() ? image.deltaLength() : image.length();
+    if (!stream.open(image.bytes(), image.packedLength(), streamLength)) {
+        return false;
+    }
+    if (image.isDelta()) {
+        FwView source = image.base();
+        if (!source.isValid()) {
+            XYLog("firmware %s has no valid delta base\n", image.name());
+            return false;
+        }
+        /* Deltas are only ever taken against a complete image */
+        if (source.isDelta()) {
+            XYLog("firmware %s has a delta base %s\n", image.name(), source.name());
+            return false;
+        }
+        if (!base.open(source.bytes(), source.packedLength(), source.length())) {
+            return false;
+        }
+    }
+    this->image = image;
+    readNs = 0;
+    copiedBytes = 0;
+    return !image.isDelta() || rewindDelta();
+}
+
+void FwReader::close()
+{
+    stream.close();
+    base.close();
+    image.reset();
+}
+
+bool FwReader::rewindDelta()
+{
+    opStart = 0;
+    opLength = 0;
+    opSource = 0;
+    opCopy = false;
+    opNext = 0;
+    copyEnd = 0;
+    return nextOp();
+}
+
+bool FwReader::nextOp()
+{
+    if (!opCopy) {
+        /* Literals of the current op come before the next header */
+        opNext = opSource + opLength;
+    }
+    opStart += opLength;
+    uint32_t avail = image.deltaLength() - opNext;
+    if (avail > FW_DELTA_OP_MAX_HDR) {
+        avail = FW_DELTA_OP_MAX_HDR;
+    }
+    const uint8_t *p = stream.map(opNext, avail);
+    FwDeltaOp op;
+    int len = p ? FwDeltaReadOp(p, avail, &op) : -1;
+    if (len < 0 || image.length() - opStart < op.length) {
+        XYLog("firmware %s delta is corrupted at %u\n", image.name(), opNext);
+        opLength = 0;
+        return false;
+    }
+    opNext += len;
+    opLength = op.length;
+    opCopy = op.copy;
+    if (op.copy) {
+        opSource = copyEnd + op.skew;
+        copyEnd = opSource + op.length;
+    } else {
+        opSource = opNext;
+    }
+    return true;
+}
+
+const uint8_t *FwReader::mapDelta(uint32_t offset, uint32_t length)
+{
+    if (length > FW_READER_MAX_MAP) {
+        return NULL;
+    }
+    /* Ops only parse forward, going back means starting over */
+    if (offset < opStart || !opLength) {
+        if (!rewindDelta()) {
+            return NULL;
+        }
+    }
+    uint32_t filled = 0;
+    while (filled < length) {
+        uint32_t cur = offset + filled;
+        if (cur >= opStart + opLength) {
+            if (!nextOp()) {
+                return NULL;
+            }
+            continue;
+        }
+        uint32_t n = opStart + opLength - cur;
+        if (n > length - filled) {
+            n = length - filled;
+        }
+        uint32_t src = opSource + (cur - opStart);
+        const uint8_t *p = opCopy ? base.map(src, n) : stream.map(src, n);
+        if (!p) {
+            return NULL;
+        }
+        memcpy(staging + filled, p, n);
+        filled += n;
+        copiedBytes += n;
+    }
+    return staging;
+}
+
+bool FwReader::verify()
+{
+    if (!image.isValid()) {
+        return false;
+    }
+    uint32_t crc = 0;
+    for (uint32_t offset = 0; offset < image.length(); offset += FW_READER_MAX_MAP) {
+        uint32_t length = image.length() - offset;
+        if (length > FW_READER_MAX_MAP) {
+            length = FW_READER_MAX_MAP;
+        }
+        const uint8_t *p = map(offset, length);
+        if (!p) {
+            return false;
+        }
+        crc = FwCrc32(crc, p, length);
+    }
+    return crc == image.checksum();
+}
+
+const uint8_t *FwReader::map(uint32_t offset, uint32_t length)
+{
+    if (!image.isValid() || offset > image.length() || image.length() - offset < length) {
+        return NULL;
+    }
+    if (!image.isDelta() && !image.isPacked()) {
+        return image.bytes() + offset;
+    }
+    uint64_t begin, end, ns;
+    clock_get_uptime(&begin);
+    const uint8_t *p = image.isDelta() ? mapDelta(offset, length) : stream.map(offset, length);
+    clock_get_uptime(&end);
+    absolutetime_to_nanoseconds(end - begin, &ns);
+    readNs += ns;
+    return p;
+}
@@ -0,0 +1,126 @@
+//
+//  FwReader.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef FwReader_h
+#define FwReader_h
+
+#include <IOKit/IOLib.h>
+#include "FWData.h"
+#include "FwLz.h"
+#include "FwDelta.h"
+
+/* Maximum range one map() call hands out of a packed or delta image */
+#define FW_READER_MAX_MAP 256
+
+/* Reads one stored stream, either raw or LZ packed. Packed streams are
+ * decoded one block at a time into up to FW_LZ_BLOCK_WINDOWS windows of
+ * up to FW_LZ_BLOCK_SIZE bytes, never more than the stream fills, that
+ * are recycled least recently used first. Blocks are independent so any
+ * of them can be decoded directly.
+ */
+class FwBlockReader {
+
+public:
+
+    FwBlockReader();
+
+    ~FwBlockReader();
+
+    bool open(const uint8_t *bytes, uint32_t packedLength, uint32_t length);
+
+    void close();
+
+    /* Returns length bytes at offset of the decoded stream or NULL. The
+     * pointer stays valid until the next call. A range crossing a block
+     * boundary is assembled in a small staging buffer.
+     */
+    const uint8_t *map(uint32_t offset, uint32_t length);
+
+    uint32_t blocksDecoded() const { return decodedBlocks; }
+
+    /* Bytes written into the windows and the staging buffer */
+    uint64_t bytesCopied() const { return copiedBytes; }
+
+private:
+
+    struct Window {
+        uint8_t *data;
+        uint32_t block;
+        uint32_t length;        /* 0 while nothing is decoded into it */
+        uint32_t packed;        /* offset of the block header */
+    };
+
+    const Window *loadBlock(uint32_t block);
+
+private:
+    const uint8_t *bytes;
+    uint32_t packedLength;
+    uint32_t length;
+    uint32_t windowSize;
+    int windowCount;
+    Window windows[FW_LZ_BLOCK_WINDOWS];    /* most recently used first */
+    uint32_t decodedBlocks;
+    uint64_t copiedBytes;
+    uint8_t staging[FW_READER_MAX_MAP];
+};
+
+/* Hands out byte ranges of an embedded image. Raw images are mapped in
+ * place, packed images go through FwBlockReader and delta images are
+ * rebuilt op by op from their base as the download walks forward, so
+ * neither ever exists in memory as a whole.
+ */
+class FwReader {
+
+public:
+
+    FwReader();
+
+    bool open(const FwView &image);
+
+    void close();
+
+    const uint8_t *map(uint32_t offset, uint32_t length);
+
+    /* Reads the whole image once and checks it against its CRC-32 */
+    bool verify();
+
+    uint32_t blocksDecoded() const { return stream.blocksDecoded() + base.blocksDecoded(); }
+
+    uint64_t readTimeNs() const { return readNs; }
+
+    /* Image bytes decoded or moved before map() could hand them out,
+     * nothing for a raw image.
+     */
+    uint64_t bytesCopied() const { return copiedBytes + stream.bytesCopied() + base.bytesCopied(); }
+
+private:
+
+    const uint8_t *mapDelta(uint32_t offset, uint32_t length);
+
+    bool rewindDelta();
+
+    bool nextOp();
+
+private:
+    FwView image;
+    FwBlockReader stream;
+    FwBlockReader base;
+    uint64_t readNs;
+    uint64_t copiedBytes;       /* into staging while rebuilding a delta */
+
+    /* Delta op covering [opStart, opStart + opLength) of the image */
+    uint32_t opStart;
+    uint32_t opLength;
+    uint32_t opSource;      /* base offset of a copy, stream offset of literals */
+    bool opCopy;
+    uint32_t opNext;        /* stream offset of the next op */
+    uint32_t copyEnd;
+    uint8_t staging[FW_READER_MAX_MAP];
+};
+
+#endif /* FwReader_h */
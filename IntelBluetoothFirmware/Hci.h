@@ -85,6 +85,7 @@ struct __attribute__((packed)) HciResponse: HciEventHdr
 #define HCI_EV_NUM_COMP_BLOCKS        0x48
 #define HCI_EV_SYNC_TRAIN_COMPLETE    0x4F
 #define HCI_EV_SLAVE_PAGE_RESP_TIMEOUT    0x54
+#define HCI_EV_VENDOR        0xff
 
 /* HCI device flags */
 enum {
@@ -200,11 +201,17 @@ enum {
 #define HCI_OP_INTEL_ENTER_MFG 0xfc11
 #define HCI_OP_READ_INTEL_BOOT_PARAMS 0xfc0d
 #define HCI_OP_INTEL_EVENT_MASK 0xfc52
-
-static uint8_t EXIT_MFG_PARAM[2] = { 0x00, 0x02 };
-static uint8_t ENTER_MFG_PARAM[2] = { 0x01, 0x00 };
-static uint8_t EVENT_MASK[8] = { 0x87, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
-static uint8_t INTEL_RESET_PARAM[] = { 0x00, 0x01, 0x00, 0x01, 0x00000000 };
-static uint8_t INTEL_RESET_BL_PARAM[] = { 0x01, 0x01, 0x01, 0x00, 0x00000000 };
+#define HCI_OP_INTEL_SECURE_SEND 0xfc09
+
+/* Intel vendor events, first byte after the event header */
+#define INTEL_EV_REBOOT_DONE 0x02
+#define INTEL_EV_DOWNLOAD_DONE 0x06
+
+static const uint8_t EXIT_MFG_PARAM[2] = { 0x00, 0x02 };
+static const uint8_t ENTER_MFG_PARAM[2] = { 0x01, 0x00 };
+static const uint8_t EVENT_MASK[8] = { 0x87, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+/* IntelReset, boot_param is little endian */
+static const uint8_t INTEL_RESET_PARAM[8] = { 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00 };
+static const uint8_t INTEL_RESET_BL_PARAM[8] = { 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 };
 
 #endif /* Hci_h */
@@ -8,15 +8,64 @@
 #include <libkern/OSTypes.h>
 #include <IOKit/usb/StandardUSB.h>
 #include "Hci.h"
+#include "USBTransport.h"
+#include "FwPlan.h"
 
 #define super IOService
 OSDefineMetaClassAndStructors(IntelBluetoothFirmware, IOService)
 
-#define kReadBufferSize 4096
 //com.apple.iokit.IOBluetoothHostControllerUSBTransport
 
+#define kSecureSendDefaultWindow 4
+#define kSecureSendMaxWindow 16
+
+/* A window that got no command complete for this long gets its read
+ * posted again and another wait, at most kSecureSendMaxResumes times per
+ * download before the controller goes back to the bootloader.
+ */
+#define kSecureSendAckTimeout 2000
+#define kSecureSendMaxResumes 3
+
+/* Command waits follow the measured round trip times, never shorter than
+ * these, in ms. The fixed timeouts above and HCI_INIT_TIMEOUT cap them.
+ */
+#define kCommandMinTimeout 1000
+#define kSecureSendMinAckTimeout 250
+
+/* kextd has to be up to hand out on demand firmware */
+#define kFirmwareResourceTimeout 30000
+
+/* Readiness probe after attach, all in ms */
+#define kReadyTimeout 3000
+#define kReadyProbeTimeout 50
+#define kReadyMinBackoff 10
+#define kReadyMaxBackoff 400
+
+/* Vendor notifications of the new bootloader, in ms */
+#define kDownloadDoneTimeout 5000
+#define kBootDoneTimeout 5000
+
 enum { kMyOffPowerState = 0, kMyOnPowerState = 1 };
 
+/* Controllers of the personalities and the hw_variant values their
+ * firmware is built for.
+ */
+static const struct {
+    UInt16 productID;
+    BTType type;
+    uint8_t variants[2];
+} kDeviceTable[] = {
+    {0x07dc, kTypeOld, {0x07, 0x07}},       /* 7260 */
+    {0x0a2a, kTypeOld, {0x07, 0x08}},       /* 7260, 7265 */
+    {0x0aa7, kTypeOld, {0x08, 0x08}},       /* 3165, 3168, 7265 */
+    {0x0a2b, kTypeNew, {0x0b, 0x0c}},       /* 8260 SfP, 8265 WsP */
+    {0x0aaa, kTypeNew, {0x11, 0x11}},       /* 9460, 9560 JfP */
+    {0x0025, kTypeNew, {0x12, 0x12}},       /* 9260 ThP */
+    {0x0026, kTypeNew, {0x13, 0x13}},       /* AX201 HrP */
+    {0x0029, kTypeNew, {0x14, 0x14}},       /* AX200 CcP */
+    {0x0032, kTypeNew, {0x17, 0x17}},       /* AX210 TyP */
+};
+
 enum {
     kReset,
     kGetIntelVersion,
@@ -39,6 +88,72 @@ enum {
     kNewUpdateDone
 };
 
+static uint64_t elapsedMs(uint64_t since)
+{
+    uint64_t now, elapsedNs;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - since, &elapsedNs);
+    return elapsedNs / 1000000;
+}
+
+/* Keys of the FirmwareLoadStats phases, by state of each state machine */
+static const char *kPhaseNames[] = {
+    "Reset", "GetIntelVersion", "EnterMfg", "LoadFW", "ExitMfg", "SetEventMask", "UpdateAbort", "UpdateDone"
+};
+
+static const char *kNewPhaseNames[] = {
+    "GetVersion", "GetBootParams", "LoadFW", "IntelReset", "SetEventMask", "ResetToBL", "UpdateAbort", "UpdateDone"
+};
+
+static void setNumber(OSDictionary *dict, const char *key, uint64_t value)
+{
+    OSNumber *number = OSNumber::withNumber(value, 64);
+    if (number) {
+        dict->setObject(key, number);
+        number->release();
+    }
+}
+
+static void setLatency(OSDictionary *dict, const char *key, const BtLatencyStats *stats)
+{
+    OSDictionary *latency = OSDictionary::withCapacity(7);
+    OSArray *histogram = OSArray::withCapacity(BT_LATENCY_BUCKETS);
+    if (latency && histogram) {
+        for (int i = 0; i < BT_LATENCY_BUCKETS; i++) {
+            OSNumber *count = OSNumber::withNumber(stats->buckets[i], 32);
+            if (count) {
+                histogram->setObject(count);
+                count->release();
+            }
+        }
+        setNumber(latency, "Count", stats->count);
+        setNumber(latency, "AverageUs", stats->count ? stats->totalUs / stats->count : 0);
+        setNumber(latency, "MaxUs", stats->maxUs);
+        setNumber(latency, "SmoothedUs", stats->srttUs);
+        setNumber(latency, "DeviationUs", stats->rttvarUs);
+        setNumber(latency, "HistogramBaseUs", BT_LATENCY_BUCKET_BASE_US);
+        latency->setObject("Histogram", histogram);
+        dict->setObject(key, latency);
+    }
+    OSSafeReleaseNULL(histogram);
+    OSSafeReleaseNULL(latency);
+}
+
+static void setStalls(OSDictionary *dict, const char *key, const BtStallStats *stats)
+{
+    OSDictionary *stalls = OSDictionary::withCapacity(6);
+    if (stalls) {
+        setNumber(stalls, "Stalls", stats->stalls);
+        setNumber(stalls, "Recovered", stats->recovered);
+        setNumber(stalls, "Failed", stats->failed);
+        setNumber(stalls, "Clears", stats->clears);
+        setNumber(stalls, "MaxUs", stats->maxUs);
+        setNumber(stalls, "TotalUs", stats->totalUs);
+        dict->setObject(key, stalls);
+        stalls->release();
+    }
+}
+
 #define kIOPMPowerOff 0
 
 static IOPMPowerState myTwoStates[2] =
@@ -50,31 +165,41 @@ static IOPMPowerState myTwoStates[2] =
 bool IntelBluetoothFirmware::init(OSDictionary *dictionary)
 {
     XYLog("Driver init()\n");
-    hciCommand = (HciCommandHdr *)IOMalloc(sizeof(HciCommandHdr));
-    
     completion = IOLockAlloc();
     
     if (!completion) {
         return false;
     }
+    fwRequest = NULL;
+    fwResource = NULL;
+    /* Without the ring the driver only loses its trace */
+    mTrace.init();
+    mDownloadCall = NULL;
+    mDownloadRunning = false;
+    mStopping = false;
+    mReadyReset = false;
     return super::init(dictionary);
 }
 
 void IntelBluetoothFirmware::free() {
     XYLog("Driver free()\n");
-    if (hciCommand) {
-        IOFree(hciCommand, sizeof(HciCommandHdr));
-        hciCommand = NULL;
+    if (mDownloadCall) {
+        /* Allocated ONCE, so this is safe with the call still on its way out */
+        thread_call_free(mDownloadCall);
+        mDownloadCall = NULL;
     }
     if (completion) {
         IOLockFree(completion);
         completion = NULL;
     }
+    mTrace.free();
     super::free();
 }
 
 bool IntelBluetoothFirmware::start(IOService *provider)
 {
+    uint64_t begin, now, elapsedNs;
+    clock_get_uptime(&begin);
     XYLog("Driver Start()\n");
     m_pDevice = OSDynamicCast(IOUSBHostDevice, provider);
     
@@ -88,47 +213,106 @@ bool IntelBluetoothFirmware::start(IOService *provider)
     provider->joinPMtree(this);
     makeUsable();
     
-    mReadBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task
-                                                              , kIODirectionIn, kReadBufferSize);
-    if (!mReadBuffer) {
-        XYLog("%s::fail to alloc read buffer\n", getName());
-        cleanUp();
-        stop(this);
-        return false;
-    }
-    
-    mReadBuffer->prepare(kIODirectionIn);
-    
     super::start(provider);
     
-    m_pDevice->setConfiguration(0);
+    mStopping = false;
+    /* The download takes seconds, done here it would hold up every driver
+     * matching after us. SynchronousDownload in the personality brings the
+     * old behaviour back to compare StartLatency.
+     */
+    bool synchronous = getProperty("SynchronousDownload") == kOSBooleanTrue;
+    if (!synchronous && !mDownloadCall) {
+        mDownloadCall = thread_call_allocate_with_options(onDownload, this, THREAD_CALL_PRIORITY_KERNEL, THREAD_CALL_OPTIONS_ONCE);
+        if (!mDownloadCall) {
+            XYLog("can not allocate download thread call, downloading in start\n");
+            synchronous = true;
+        }
+    }
+    if (synchronous) {
+        if (!download()) {
+            stop(this);
+            return false;
+        }
+    } else {
+        IOLockLock(completion);
+        mDownloadRunning = true;
+        IOLockUnlock(completion);
+        thread_call_enter(mDownloadCall);
+    }
     
-    IOSleep(1500);
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - begin, &elapsedNs);
+    setProperty("StartLatency", elapsedNs / 1000, 64);
+    XYLog("start() returned after %llu us, download %s\n", (unsigned long long)(elapsedNs / 1000), synchronous ? "done" : "running");
+    return true;
+}
+
+/* A download that fails here detaches the driver, as start() returning
+ * false does for the synchronous one. terminate() is asynchronous, its
+ * stop() finds the download done and does not wait for this call.
+ */
+void IntelBluetoothFirmware::onDownload(thread_call_param_t param0, thread_call_param_t param1)
+{
+    IntelBluetoothFirmware *that = (IntelBluetoothFirmware *)param0;
+    bool succeeded = that->download();
+    /* stop() may return, and the driver go, once the download is done */
+    that->retain();
+    IOLockLock(that->completion);
+    that->mDownloadRunning = false;
+    bool stopping = that->mStopping;
+    IOLockWakeup(that->completion, &that->mDownloadRunning, false);
+    IOLockUnlock(that->completion);
+    if (!succeeded && !stopping) {
+        XYLog("download failed, detaching\n");
+        that->terminate();
+    }
+    that->release();
+}
+
+/* Everything that talks to the controller, on the download thread call
+ * unless the personality asks for SynchronousDownload.
+ */
+bool IntelBluetoothFirmware::download()
+{
+    clock_get_uptime(&mDownloadStartTime);
+    mPhase = -1;
+    bzero(mPhaseUs, sizeof(mPhaseUs));
+    mReadyLatency = 0;
+    mBootLatency = 0;
+    mRetries = 0;
     
-    usbCompletion.owner = this;
-    usbCompletion.action = onRead;
-    usbCompletion.parameter = NULL;
+    m_pDevice->setConfiguration(0);
     
     if (!m_pDevice->open(this)) {
         XYLog("start fail, can not open device\n");
         cleanUp();
-        stop(this);
         return false;
     }
     
-    if (!initUSBConfiguration()) {
-        XYLog("init usb configuration failed\n");
+    if (!waitReady()) {
         cleanUp();
-        stop(this);
         return false;
     }
-    if (!initInterface()) {
-        XYLog("init usb interface failed\n");
+    /* stop() may have come in before the command engine was up */
+    if (isStopping()) {
+        XYLog("stopped before download\n");
         cleanUp();
-        stop(this);
         return false;
     }
     XYLog("usb init succeed\n");
+    /* Bootloaders that can not take more than one outstanding secure send
+     * fragment set SecureSendWindow to 1 in their personality.
+     */
+    mSecureSendWindow = kSecureSendDefaultWindow;
+    if (OSNumber *window = OSDynamicCast(OSNumber, getProperty("SecureSendWindow"))) {
+        mSecureSendWindow = window->unsigned32BitValue();
+    }
+    if (mSecureSendWindow < 1) {
+        mSecureSendWindow = 1;
+    } else if (mSecureSendWindow > kSecureSendMaxWindow) {
+        mSecureSendWindow = kSecureSendMaxWindow;
+    }
+    XYLog("secure send window %u\n", mSecureSendWindow);
     if (currentType == kTypeOld) {
         beginDownload();
     } else {
@@ -138,6 +322,96 @@ bool IntelBluetoothFirmware::start(IOService *provider)
     return true;
 }
 
+/* Sleeps the next step of a bounded exponential backoff, false once the
+ * readiness budget that started at begin is used up.
+ */
+bool IntelBluetoothFirmware::readyBackoff(uint64_t begin, uint32_t *delay)
+{
+    uint64_t now, elapsedNs;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - begin, &elapsedNs);
+    if (isStopping() || elapsedNs / 1000000 + *delay > kReadyTimeout) {
+        return false;
+    }
+    IOSleep(*delay);
+    *delay = *delay * 2 > kReadyMaxBackoff ? kReadyMaxBackoff : *delay * 2;
+    return true;
+}
+
+/* Used to be a fixed 1.5 s sleep after setConfiguration(0). Now the
+ * configuration is retried until the device takes it, and the controller
+ * counts as ready once it answers a version read, which both bootloader
+ * and operational firmware do. Legacy parts want HCI_Reset before any
+ * vendor command, they are probed with the reset the state machine
+ * starts with, so a late answer to a probe can not stand in for the
+ * version read that follows.
+ */
+bool IntelBluetoothFirmware::waitReady()
+{
+    uint64_t begin, now, elapsedNs;
+    uint32_t delay = kReadyMinBackoff;
+    uint32_t probes = 0;
+    uint16_t probe = currentType == kTypeOld ? HCI_OP_RESET : HCI_OP_INTEL_VERSION;
+    
+    mReadyReset = false;
+    clock_get_uptime(&begin);
+    while (!initUSBConfiguration()) {
+        if (!readyBackoff(begin, &delay)) {
+            XYLog("init usb configuration failed\n");
+            return false;
+        }
+    }
+    if (!initInterface()) {
+        XYLog("init usb interface failed\n");
+        return false;
+    }
+    delay = kReadyMinBackoff;
+    while (true) {
+        probes++;
+        if (mCommands.send(probe, 0, NULL, 1, kReadyProbeTimeout) == kIOReturnSuccess) {
+            mReadyReset = probe == HCI_OP_RESET;
+            break;
+        }
+        if (!readyBackoff(begin, &delay)) {
+            /* The state machine still gets its own, longer timeouts */
+            XYLog("controller did not answer %u probes, continuing\n", probes);
+            break;
+        }
+    }
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - begin, &elapsedNs);
+    mReadyLatency = (uint32_t)(elapsedNs / 1000000);
+    mRetries += probes - 1;
+    setProperty("ReadyLatency", mReadyLatency, 32);
+    XYLog("controller ready after %llu ms, %u probes\n", (unsigned long long)(elapsedNs / 1000000), probes);
+    return true;
+}
+
+bool IntelBluetoothFirmware::isStopping()
+{
+    IOLockLock(completion);
+    bool stopping = mStopping;
+    IOLockUnlock(completion);
+    return stopping;
+}
+
+/* Aborts a download still running and waits for its thread to let go of
+ * the device.
+ */
+void IntelBluetoothFirmware::stopDownload()
+{
+    IOLockLock(completion);
+    mStopping = true;
+    IOLockWakeup(completion, &fwResource, false);
+    IOLockUnlock(completion);
+    mCommands.stop();
+    IOLockLock(completion);
+    while (mDownloadRunning) {
+        IOLockSleep(completion, &mDownloadRunning, THREAD_UNINT);
+    }
+    IOLockUnlock(completion);
+}
+
 bool IntelBluetoothFirmware::initUSBConfiguration()
 {
     uint8_t configIndex = 0;
@@ -187,79 +461,38 @@ bool IntelBluetoothFirmware::initInterface()
         XYLog("can not open interface\n");
         return false;
     }
-    const StandardUSB::ConfigurationDescriptor *configDescriptor = m_pInterface->getConfigurationDescriptor();
-    const StandardUSB::InterfaceDescriptor *interfaceDescriptor = m_pInterface->getInterfaceDescriptor();
-    if (configDescriptor == NULL || interfaceDescriptor == NULL) {
-        XYLog("find descriptor NULL\n");
+    m_pTransport = createTransport();
+    if (!m_pTransport) {
+        XYLog("can not create usb transport\n");
         return false;
     }
-    const EndpointDescriptor *endpointDescriptor = NULL;
-    while ((endpointDescriptor = StandardUSB::getNextEndpointDescriptor(configDescriptor, interfaceDescriptor, endpointDescriptor))) {
-        uint8_t epDirection = StandardUSB::getEndpointDirection(endpointDescriptor);
-        uint8_t epType = StandardUSB::getEndpointType(endpointDescriptor);
-        if (epDirection == kUSBIn && epType == kUSBInterrupt) {
-            XYLog("Found Interrupt endpoint!\n");
-            m_pInterruptReadPipe = m_pInterface->copyPipe(StandardUSB::getEndpointAddress(endpointDescriptor));
-            if (m_pInterruptReadPipe == NULL) {
-                XYLog("copy InterruptReadPipe pipe fail\n");
-                return false;
-            }
-            m_pInterruptReadPipe->retain();
-            m_pInterruptReadPipe->release();
-        } else {
-            if (epDirection == kUSBOut && epType == kUSBBulk) {
-                XYLog("Found Bulk out endpoint!\n");
-                m_pBulkWritePipe = m_pInterface->copyPipe(StandardUSB::getEndpointAddress(endpointDescriptor));
-                if (m_pBulkWritePipe == NULL) {
-                    XYLog("copy Bulk pipe fail\n");
-                    return false;
-                }
-                m_pBulkWritePipe->retain();
-                m_pBulkWritePipe->release();
-            } else {
-                if (epDirection == kUSBIn && epType == kUSBBulk) {
-                    XYLog("Found Bulk in endpoint!\n");
-                    m_pBulkReadPipe = m_pInterface->copyPipe(StandardUSB::getEndpointAddress(endpointDescriptor));
-                    if (m_pBulkReadPipe == NULL) {
-                        XYLog("copy Bulk pipe fail\n");
-                        return false;
-                    }
-                    m_pBulkReadPipe->retain();
-                    m_pBulkReadPipe->release();
-                }
-            }
-        }
+    return mCommands.init(m_pTransport, &mTrace);
+}
+
+BtTransport *IntelBluetoothFirmware::createTransport()
+{
+    USBTransport *transport = new USBTransport(this, m_pInterface);
+    if (!transport) {
+        return NULL;
     }
-    return m_pInterruptReadPipe != NULL && m_pBulkWritePipe != NULL;
+    transport->setReadAction(this, onRead);
+    if (!transport->init()) {
+        delete transport;
+        return NULL;
+    }
+    return transport;
 }
 
 void IntelBluetoothFirmware::cleanUp()
 {
     XYLog("Clean up...\n");
-    if (fwData) {
-        fwData->release();
-        fwData = NULL;
-    }
-    if (m_pBulkWritePipe) {
-        m_pBulkWritePipe->abort();
-        m_pBulkWritePipe->release();
-        m_pBulkWritePipe = NULL;
-    }
-    if (m_pBulkReadPipe) {
-        m_pBulkReadPipe->abort();
-        m_pBulkReadPipe->release();
-        m_pBulkReadPipe = NULL;
-    }
-    if (m_pInterruptReadPipe) {
-        m_pInterruptReadPipe->abort();
-        m_pInterruptReadPipe->release();
-        m_pInterruptReadPipe = NULL;
-    }
-    if (mReadBuffer) {
-        mReadBuffer->complete(kIODirectionIn);
-        usbCompletion.owner = NULL;
-        usbCompletion.action = NULL;
-        OSSafeReleaseNULL(mReadBuffer);
+    fwReader.close();
+    releaseFirmware();
+    fwImage.reset();
+    mCommands.stop();
+    if (m_pTransport) {
+        delete m_pTransport;
+        m_pTransport = NULL;
     }
     if (m_pInterface) {
         m_pInterface->close(this);
@@ -272,61 +505,13 @@ void IntelBluetoothFirmware::cleanUp()
     }
 }
 
-bool IntelBluetoothFirmware::interruptPipeRead()
-{
-    IOReturn result;
-    isRequest = false;
-    if ((result = m_pInterruptReadPipe->io(mReadBuffer, (uint32_t)mReadBuffer->getLength(), &usbCompletion, 0)) != kIOReturnSuccess) {
-        if (result == kIOUSBPipeStalled)
-        {
-            XYLog("%s pipe stall, try clear\n", __FUNCTION__);
-            bool clearSucceed = false;
-            for (int i = 0; i < 1000; i++) {
-                if (m_pInterruptReadPipe->clearStall(true) != kIOUSBPipeStalled) {
-                    XYLog("%s %d clear stall succeed.\n", __FUNCTION__, i);
-                    clearSucceed = true;
-                    break;
-                }
-            }
-            if (clearSucceed) {
-                return (result = m_pInterruptReadPipe->io(mReadBuffer, (uint32_t)mReadBuffer->getLength(), &usbCompletion, 0)) != kIOReturnSuccess;
-            }
-        }
-        return false;
-    }
-    return true;
-}
-
-bool IntelBluetoothFirmware::bulkPipeRead()
-{
-    IOReturn result;
-    isRequest = false;
-    if ((result = m_pBulkReadPipe->io(mReadBuffer, (uint32_t)mReadBuffer->getLength(), &usbCompletion, 0)) != kIOReturnSuccess) {
-        if (result == kIOUSBPipeStalled)
-        {
-            XYLog("%s pipe stall, try clear\n", __FUNCTION__);
-            bool clearSucceed = false;
-            for (int i = 0; i < 1000; i++) {
-                if (m_pBulkReadPipe->clearStall(true) != kIOUSBPipeStalled) {
-                    XYLog("%s %d clear stall succeed.\n", __FUNCTION__, i);
-                    clearSucceed = true;
-                    break;
-                }
-            }
-            if (clearSucceed) {
-                return (result = m_pBulkReadPipe->io(mReadBuffer, (uint32_t)mReadBuffer->getLength(), &usbCompletion, 0)) != kIOReturnSuccess;
-            }
-        }
-        return false;
-    }
-    return true;
-}
-
 void IntelBluetoothFirmware::beginDownload()
 {
-    mDeviceState = kReset;
+    /* Reset once more only if the readiness probe got no answer */
+    mDeviceState = mReadyReset ? kGetIntelVersion : kReset;
     bool isSucceed = false;
     while (true) {
+        enterPhase(mDeviceState);
         
         if (mDeviceState == kUpdateDone || mDeviceState == kUpdateAbort) {
             break;
@@ -336,7 +521,7 @@ void IntelBluetoothFirmware::beginDownload()
         switch (mDeviceState) {
             case kReset:
             {
-                XYLog("HCI_RESET\n");
+                XYLogDebug("HCI_RESET\n");
                 if ((ret = sendHCIRequest(HCI_OP_RESET, 0, NULL)) != kIOReturnSuccess) {
                     XYLog("sending initial HCI reset command failed (%d), %s\n ", ret, stringFromReturn(ret));
                     goto done;
@@ -346,7 +531,7 @@ void IntelBluetoothFirmware::beginDownload()
             }
             case kGetIntelVersion:
             {
-                XYLog("HCI_OP_INTEL_VERSION\n");
+                XYLogDebug("HCI_OP_INTEL_VERSION\n");
                 if ((ret = sendHCIRequest(HCI_OP_INTEL_VERSION, 0, NULL)) != kIOReturnSuccess) {
                     XYLog("Reading Intel version information failed, ret=%d %s\n", ret, stringFromReturn(ret));
                     goto done;
@@ -356,7 +541,7 @@ void IntelBluetoothFirmware::beginDownload()
             }
             case kEnterMfg:
             {
-                XYLog("HCI_OP_INTEL_ENTER_MFG\n");
+                XYLogDebug("HCI_OP_INTEL_ENTER_MFG\n");
                 if ((ret = sendHCIRequest(HCI_OP_INTEL_ENTER_MFG, 2, (void *)ENTER_MFG_PARAM)) != kIOReturnSuccess) {
                     XYLog("Entering manufacturer mode failed (%d) %s\n", ret, stringFromReturn(ret));
                     goto done;
@@ -366,106 +551,55 @@ void IntelBluetoothFirmware::beginDownload()
             }
             case kLoadFW:
             {
-                uint8_t* fw = (uint8_t*)fwData->getBytesNoCopy();
-                uint8_t* fw_ptr = (uint8_t*)fw;
-                while (fwData->getLength() > fw_ptr - fw) {
-                    FWCommandHdr *cmd;
-                    const uint8_t *cmd_param;
-                    HciEventHdr *evt = NULL;
-                    const uint8_t *evt_param = NULL;
-                    int remain = fwData->getLength() - (fw_ptr - fw);
-                    /* The first byte indicates the types of the patch command or event.
-                     * 0x01 means HCI command and 0x02 is HCI event. If the first bytes
-                     * in the current firmware buffer doesn't start with 0x01 or
-                     * the size of remain buffer is smaller than HCI command header,
-                     * the firmware file is corrupted and it should stop the patching
-                     * process.
-                     */
-                    if (remain > HCI_COMMAND_HDR_SIZE && fw_ptr[0] != 0x01) {
-                        XYLog("Intel fw corrupted: invalid cmd read\n");
-                        mDeviceState = kUpdateAbort;
-                        goto done;
-                        break;
-                    }
-                    fw_ptr++;
-                    remain--;
-                    cmd = (FWCommandHdr*)(fw_ptr);
-                    fw_ptr += sizeof(*cmd);
-                    remain -= sizeof(*cmd);
-                    /* Ensure that the remain firmware data is long enough than the length
-                     * of command parameter. If not, the firmware file is corrupted.
-                     */
-                    if (remain < cmd->plen) {
-                        XYLog("Intel fw corrupted: invalid cmd len\n");
-                        goto done;
-                        break;
-                    }
-                    /* If there is a command that loads a patch in the firmware
-                     * file, then enable the patch upon success, otherwise just
-                     * disable the manufacturer mode, for example patch activation
-                     * is not required when the default firmware patch file is used
-                     * because there are no patch data to load.
-                     */
-                    
-                    cmd_param = fw_ptr;
-                    fw_ptr += cmd->plen;
-                    remain -= cmd->plen;
-                    /* This reads the expected events when the above command is sent to the
-                     * device. Some vendor commands expects more than one events, for
-                     * example command status event followed by vendor specific event.
-                     * For this case, it only keeps the last expected event. so the command
-                     * can be sent with __hci_cmd_sync_ev() which returns the sk_buff of
-                     * last expected event.
+                if (!waitFirmware()) {
+                    mDeviceState = kUpdateAbort;
+                    goto done;
+                }
+                if (!fwReader.open(fwImage)) {
+                    XYLog("can not open firmware %s\n", fwImage.name());
+                    goto done;
+                }
+                if (fwImage.patchCount()) {
+                    /* Indexed and validated by FwGenerator when the image
+                     * was embedded.
                      */
-                    int evt_times = 0;
-                    while (remain > HCI_EVENT_HDR_SIZE && fw_ptr[0] == 0x02) {
-                        fw_ptr++;
-                        remain--;
-                        
-                        evt_times++;
-                        
-                        evt = (HciEventHdr*)(fw_ptr);
-                        fw_ptr += sizeof(*evt);
-                        remain -= sizeof(*evt);
-                        
-                        if (remain < evt->plen) {
-                            XYLog("Intel fw corrupted: invalid evt len\n");
+                    for (int i = 0; i < fwImage.patchCount(); i++) {
+                        const FwPatchCommand *command = &fwImage.patch()[i];
+                        if (!sendPatchCommand(command, fwReader.map(command->offset, command->plen))) {
                             goto done;
-                            break;
                         }
-                        
-                        evt_param = fw_ptr;
-                        fw_ptr += evt->plen;
-                        remain -= evt->plen;
                     }
-                    /* Every HCI commands in the firmware file has its correspond event.
-                     * If event is not found or remain is smaller than zero, the firmware
-                     * file is corrupted.
+                } else {
+                    /* Without an index the stream has to be walked in
+                     * place, which only a raw image allows.
                      */
-                    if (!evt || !evt_param || remain < 0) {
-                        XYLog("Intel fw corrupted: invalid evt read\n");
+                    const uint8_t* fw = fwReader.map(0, fwImage.length());
+                    if (!fw) {
+                        XYLog("Intel fw %s is packed without a patch index\n", fwImage.name());
+                        mDeviceState = kUpdateAbort;
                         goto done;
-                        break;
                     }
-                    if ((ret = sendHCIRequest(USBToHost16(cmd->opcode), cmd->plen, (void *)cmd_param)) != kIOReturnSuccess) {
-                        XYLog("sending Intel patch command (0x%4.4x) failed (%d) %s\n",
-                              cmd->opcode, ret, stringFromReturn(ret));
+                    /* Validate the whole patch stream before the first
+                     * command goes out, a corrupted file must not leave the
+                     * controller half patched in manufacturer mode.
+                     */
+                    FwPatchIndexer validator(fw, fwImage.length());
+                    FwPatchCommand command;
+                    while (validator.next(&command)) {
+                    }
+                    if (validator.isCorrupted()) {
+                        XYLog("Intel fw corrupted: invalid record at %u\n", validator.position());
+                        mDeviceState = kUpdateAbort;
                         goto done;
-                        break;
                     }
-                    for (int j=0; j<evt_times; j++) {
-                        interruptPipeRead();
-                        IOLockLock(completion);
-                        AbsoluteTime deadline;
-                        clock_interval_to_deadline(HCI_INIT_TIMEOUT, kMillisecondScale, reinterpret_cast<uint64_t*> (&deadline));
-                        int ret = IOLockSleepDeadline(completion, this, deadline, THREAD_INTERRUPTIBLE);
-                        IOLockUnlock(completion);
-                        if (ret != THREAD_AWAKENED) {
+                    FwPatchIndexer indexer(fw, fwImage.length());
+                    while (indexer.next(&command)) {
+                        if (!sendPatchCommand(&command, fw + command.offset)) {
                             goto done;
-                            break;
                         }
                     }
                 }
+                fwReader.close();
                 
                 mDeviceState = kExitMfg;
                 break;
@@ -482,7 +616,7 @@ void IntelBluetoothFirmware::beginDownload()
                  */
                 //                if (reset)
                 //                    param[1] |= patched ? 0x02 : 0x01;
-                XYLog("HCI_OP_INTEL_EXIT_MFG\n");
+                XYLogDebug("HCI_OP_INTEL_EXIT_MFG\n");
                 if ((ret = sendHCIRequest(HCI_OP_INTEL_ENTER_MFG, 2, (void *)EXIT_MFG_PARAM)) != kIOReturnSuccess) {
                     XYLog("Exiting manufacturer mode failed (%d) %s\n", ret, stringFromReturn(ret));
                     goto done;
@@ -492,7 +626,7 @@ void IntelBluetoothFirmware::beginDownload()
             }
             case kSetEventMask:
             {
-                XYLog("HCI_OP_INTEL_EVENT_MASK\n");
+                XYLogDebug("HCI_OP_INTEL_EVENT_MASK\n");
                 if ((ret = sendHCIRequest(HCI_OP_INTEL_EVENT_MASK, 8, (void *)EVENT_MASK)) != kIOReturnSuccess) {
                     XYLog("Setting Intel event mask failed (%d) %s\n", ret, stringFromReturn(ret));
                     goto done;
@@ -505,88 +639,81 @@ void IntelBluetoothFirmware::beginDownload()
             default:
                 break;
         }
-        
-        if (isRequest) {
-            if (!interruptPipeRead())
-            {
-                XYLog("hci read pipe fail. stop\n");
-                break;
-            }
-            XYLog("interrupt wait\n");
-            IOLockLock(completion);
-            AbsoluteTime deadline;
-            clock_interval_to_deadline(HCI_INIT_TIMEOUT, kMillisecondScale, reinterpret_cast<uint64_t*> (&deadline));
-            IOLockSleepDeadline(completion, this, deadline, THREAD_INTERRUPTIBLE);
-            IOLockUnlock(completion);
-        }
-        isRequest = false;
-        XYLog("interrupt continue\n");
     }
     
 done:
     
+    enterPhase(-1);
+    fwReader.close();
+    releaseFirmware();
     publishReg(isSucceed);
     XYLog("End download\n");
 }
 
-IOReturn IntelBluetoothFirmware::sendHCIRequest(uint16_t opCode, uint8_t paramLen, const void * param)
-{
-    isRequest = true;
-    //    XYLog("opCode=0x%02x, paramLen=%d\n", opCode, paramLen);
-    StandardUSB::DeviceRequest request =
-    {
-        .bmRequestType = makeDeviceRequestbmRequestType(kRequestDirectionOut, kRequestTypeClass, kRequestRecipientDevice),
-        .bRequest = 0,
-        .wValue = 0,
-        .wIndex = 0,
-        .wLength = (uint16_t)(HCI_COMMAND_HDR_SIZE + paramLen)
-    };
-    uint32_t bytesTransfered;
-    bzero(hciCommand, sizeof(HciCommandHdr));
-    hciCommand->opcode = opCode;
-    hciCommand->plen = paramLen;
-    memcpy((void *)hciCommand->pData, param, paramLen);
-    IOReturn ret = m_pInterface->deviceRequest(request, (void *)hciCommand, bytesTransfered);
-    return ret;
-}
-
-IOReturn IntelBluetoothFirmware::bulkWrite(const void *data, uint16_t length)
+bool IntelBluetoothFirmware::sendPatchCommand(const FwPatchCommand *command, const uint8_t *param)
 {
-    IOMemoryDescriptor* buffer = IOMemoryDescriptor::withAddress((void*)data, length, kIODirectionOut);
-    if (!buffer) {
-        XYLog("Unable to allocate bulk write buffer.\n");
-        return kIOReturnNoMemory;
-    }
     IOReturn ret;
-    if ((ret = buffer->prepare(kIODirectionOut)) != kIOReturnSuccess) {
-        XYLog("Failed to prepare bulk write memory buffer, %s\n", stringFromReturn(ret));
-        buffer->release();
-        return ret;
+    if (!param) {
+        XYLog("can not read Intel patch command (0x%4.4x) at %u\n", command->opcode, command->offset);
+        return false;
     }
-    if ((ret = m_pBulkWritePipe->io(buffer, buffer->getLength(), (IOUSBHostCompletion*)NULL, 0)) != kIOReturnSuccess) {
-        XYLog("Failed to write to bulk pipe, %s\n", stringFromReturn(ret));
-        buffer->release();
-        return ret;
+    /* Done once every event the patch lists for the command came in, the
+     * command complete among them if there is one. 0xfc2f only gets a
+     * command status and a vendor event.
+     */
+    uint32_t timeout = mCommands.timeout(0, kCommandMinTimeout, HCI_INIT_TIMEOUT);
+    uint32_t flags = (command->flags & kFwPatchAnyEvent) ? kBtCommandAnyEvent : 0;
+    if ((ret = mCommands.send(command->opcode, command->plen, param, command->events, timeout, NULL, NULL, flags)) != kIOReturnSuccess) {
+        XYLog("sending Intel patch command (0x%4.4x) failed (%d) %s\n",
+              command->opcode, ret, stringFromReturn(ret));
+        return false;
     }
-    if ((ret = buffer->complete(kIODirectionOut)) != kIOReturnSuccess) {
-        XYLog("Failed to complete bulk write memory buffer, %s\n", stringFromReturn(ret));
-        buffer->release();
-        return ret;
+    return true;
+}
+
+/* Sends the command, waits for its command complete and hands that to the
+ * state machine on the calling thread, never from the read completion.
+ */
+IOReturn IntelBluetoothFirmware::sendHCIRequest(uint16_t opCode, uint8_t paramLen, const void * param)
+{
+    //    XYLog("opCode=0x%02x, paramLen=%d\n", opCode, paramLen);
+    uint32_t length = 0;
+    /* A reset takes as long as it takes, nothing to measure it against */
+    uint32_t timeout = opCode == HCI_OP_RESET ? HCI_INIT_TIMEOUT : mCommands.timeout(0, kCommandMinTimeout, HCI_INIT_TIMEOUT);
+    IOReturn ret = mCommands.send(opCode, paramLen, param, 1, timeout, mResponse, &length);
+    if (ret == kIOReturnSuccess) {
+        parseHCIResponse(mResponse, length, NULL, NULL);
     }
     return ret;
 }
 
-void IntelBluetoothFirmware::onRead(void *owner, void *parameter, IOReturn status, uint32_t bytesTransferred)
+void IntelBluetoothFirmware::onRead(void *owner, IOReturn status, const void *data, uint32_t length)
 {
     IntelBluetoothFirmware* that = (IntelBluetoothFirmware*)owner;
     
     switch (status) {
         case kIOReturnSuccess:
-            that->parseHCIResponse(that->mReadBuffer->getBytesNoCopy(), bytesTransferred, NULL, NULL);
+        {
+            const HciEventHdr* header = (const HciEventHdr*)data;
+            if (that->currentType == kTypeNew && length > sizeof(HciEventHdr) && header->evt == HCI_EV_VENDOR && header->plen > 0) {
+                BtIntel::printAllByte((void *)data, length);
+                switch (((const uint8_t*)data)[2]) {
+                        
+                    case INTEL_EV_REBOOT_DONE:
+                        XYLogDebug("Notify: Device reboot done\n");
+                        break;
+                    case INTEL_EV_DOWNLOAD_DONE:
+                        XYLogDebug("Notify: Firmware download done\n");
+                        break;
+                        
+                    default:
+                        break;
+                }
+            }
             break;
+        }
         case kIOReturnNotResponding:
-            XYLog("%s not responding\n", __FUNCTION__);
-            that->m_pInterruptReadPipe->clearStall(false);
+        case kIOReturnAborted:
             break;
             
         default:
@@ -594,30 +721,14 @@ void IntelBluetoothFirmware::onRead(void *owner, void *parameter, IOReturn statu
             break;
     }
     
-    IOLockWakeup(that->completion, that, false);
+    /* Only wakes whoever waits, the state machine runs on the download thread */
+    that->mCommands.onRead(status, data, length);
 }
 
 void IntelBluetoothFirmware::parseHCIResponse(void* response, UInt16 length, void* output, UInt8* outputLength)
 {
     HciEventHdr* header = (HciEventHdr*)response;
     //    XYLog("recv event=0x%04x, length=%d\n", header->evt, header->plen);
-    if (currentType == kTypeNew) {
-        if (header->evt == 0xff && header->plen > 0) {
-            BtIntel::printAllByte(response, length + HCI_COMMAND_HDR_SIZE);
-            switch (((uint8_t*)response)[2]) {
-                    
-                case 0x02:
-                    XYLog("Notify: Device reboot done\n");
-                    break;
-                case 0x06:
-                    XYLog("Notify: Firmware download done\n");
-                    break;
-                    
-                default:
-                    break;
-            }
-        }
-    }
     switch (header->evt) {
         case HCI_EV_CMD_COMPLETE:
             if (currentType == kTypeOld) {
@@ -636,7 +747,7 @@ void IntelBluetoothFirmware::parseHCIResponse(void* response, UInt16 length, voi
 void IntelBluetoothFirmware::onHCICommandSucceed(HciResponse *command, int length)
 {
     //    XYLog("recv command opcode=0x%04x\n", command->opcode);
-    BtIntel::printAllByte(command, length + HCI_COMMAND_HDR_SIZE);
+    BtIntel::printAllByte(command, length + HCI_EVENT_HDR_SIZE);
     switch (command->opcode) {
         case HCI_OP_RESET:
             mDeviceState = kGetIntelVersion;
@@ -660,11 +771,27 @@ void IntelBluetoothFirmware::onHCICommandSucceed(HciResponse *command, int lengt
                 break;
             }
             XYLog("Found device firmware %s \n", firmwareName);
-            if (!fwData) {
-                FwDesc desc = getFWDescByName(firmwareName);
-                fwData = OSData::withBytes(desc.var, desc.size);
+            if (!fwImage.isValid()) {
+                fwImage = getFWImageByKey(kFwKeyBseq,
+                                          FwKeyBseq(ver->hw_platform, ver->hw_variant, ver->hw_revision,
+                                                    ver->fw_variant, ver->fw_revision, ver->fw_build_num,
+                                                    ver->fw_build_ww, ver->fw_build_yy));
+            }
+            /* Fall back to the default patch of the hardware variant */
+            if (!fwImage.isValid()) {
+                fwImage = getFWImageByKey(kFwKeyBseqDefault,
+                                          FwKeyBseqDefault(ver->hw_platform, ver->hw_variant));
+            }
+            if (!fwImage.isValid()) {
+                XYLog("no patch for this device, continue without patching\n");
+                mDeviceState = kSetEventMask;
+                break;
+            }
+            XYLog("request firmware success: %s\n", fwImage.name());
+            if (!requestFirmware()) {
+                mDeviceState = kUpdateAbort;
+                break;
             }
-            XYLog("request firmware success");
             mDeviceState = kEnterMfg;
             break;
         }
@@ -689,7 +816,154 @@ void IntelBluetoothFirmware::onHCICommandSucceed(HciResponse *command, int lengt
 void IntelBluetoothFirmware::publishReg(bool isSucceed)
 {
     setProperty("fw_name", OSString::withCString(firmwareName));
+    if (mSecureSendFragments) {
+        setProperty("SecureSendFragments", mSecureSendFragments, 32);
+        setProperty("SecureSendPeakInFlight", mSecureSendPeakInFlight, 32);
+        if (mSecureSendElapsedNs) {
+            setProperty("SecureSendThroughput", mSecureSendBytes * 1000000000ULL / mSecureSendElapsedNs, 64);
+        }
+        uint32_t hits, misses;
+        m_pTransport->getBulkBufferStats(&hits, &misses);
+        setProperty("BulkBufferHits", hits, 32);
+        setProperty("BulkBufferMisses", misses, 32);
+        setProperty("SecureSendBytesCopied", m_pTransport->bytesCopied() + mSecureSendDecodeCopied, 64);
+        setProperty("SecureSendResumes", mSecureSendResumes, 32);
+    }
+    if (currentType == kTypeNew) {
+        setProperty("BootloaderResets", mBootloaderResets, 32);
+    }
+    BtStallStats stalls[kBtPipeCount];
+    uint32_t stallCount = 0;
+    m_pTransport->getStallStats(stalls);
+    for (int i = 0; i < kBtPipeCount; i++) {
+        stallCount += stalls[i].stalls;
+    }
+    setProperty("PipeStalls", stallCount, 32);
     m_pDevice->setProperty("FirmwareLoaded", isSucceed);
+    uint64_t now, elapsedNs;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - mDownloadStartTime, &elapsedNs);
+    setProperty("DownloadTime", elapsedNs / 1000000, 32);
+    setProperty("FirmwareLoaded", isSucceed);
+    publishStats(isSucceed, elapsedNs / 1000000);
+    XYTrace(&mTrace, kBtTraceDownload, isSucceed, (uint32_t)(elapsedNs / 1000000), 0, 0);
+    if (!isSucceed) {
+        /* Leave what led up to the failure where it can be read */
+        drainTrace();
+    }
+    XYLog("download %s after %llu ms\n", isSucceed ? "succeeded" : "failed", (unsigned long long)(elapsedNs / 1000000));
+    /* start() is long gone, clients wait for us to show up */
+    registerService();
+}
+
+/* Publishes everything traced since the last drain as the Trace property,
+ * decode it with TraceDecoder.
+ */
+IOReturn IntelBluetoothFirmware::drainTrace()
+{
+    IOLockLock(completion);
+    OSData *trace = mTrace.drain();
+    IOLockUnlock(completion);
+    if (!trace) {
+        return kIOReturnNoMemory;
+    }
+    setProperty("Trace", trace);
+    trace->release();
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothFirmware::setProperties(OSObject *properties)
+{
+    OSDictionary *dict = OSDynamicCast(OSDictionary, properties);
+    if (dict && dict->getObject("DrainTrace") == kOSBooleanTrue) {
+        return drainTrace();
+    }
+    return kIOReturnUnsupported;
+}
+
+/* Closes the phase of the state the machine was in, the loops call this
+ * with the state they are about to run.
+ */
+void IntelBluetoothFirmware::enterPhase(int state)
+{
+    uint64_t now, elapsedNs;
+    if (state == mPhase) {
+        return;
+    }
+    clock_get_uptime(&now);
+    if (mPhase >= 0 && mPhase < kPhaseCount) {
+        absolutetime_to_nanoseconds(now - mPhaseStart, &elapsedNs);
+        mPhaseUs[mPhase] += elapsedNs / 1000;
+    }
+    mPhase = state;
+    mPhaseStart = now;
+    XYTrace(&mTrace, kBtTraceState, currentType == kTypeNew, state, 0, 0);
+}
+
+/* Everything the fleet tooling scrapes about one firmware load, as the
+ * FirmwareLoadStats dictionary.
+ */
+void IntelBluetoothFirmware::publishStats(bool isSucceed, uint64_t downloadMs)
+{
+    BtCommandStats commands;
+    mCommands.getStats(&commands);
+    
+    OSDictionary *stats = OSDictionary::withCapacity(8);
+    OSDictionary *phases = OSDictionary::withCapacity(kPhaseCount);
+    OSDictionary *secureSend = OSDictionary::withCapacity(10);
+    if (!stats || !phases || !secureSend) {
+        OSSafeReleaseNULL(secureSend);
+        OSSafeReleaseNULL(phases);
+        OSSafeReleaseNULL(stats);
+        return;
+    }
+    const char **names = currentType == kTypeOld ? kPhaseNames : kNewPhaseNames;
+    for (int i = 0; i < kPhaseCount; i++) {
+        if (mPhaseUs[i]) {
+            setNumber(phases, names[i], mPhaseUs[i]);
+        }
+    }
+    stats->setObject("PhaseUs", phases);
+    setNumber(stats, "DownloadMs", downloadMs);
+    setNumber(stats, "ReadyMs", mReadyLatency);
+    setNumber(stats, "BootMs", mBootLatency);
+    setNumber(stats, "Retries", mRetries);
+    if (currentType == kTypeNew) {
+        setNumber(stats, "BootloaderResets", mBootloaderResets);
+    }
+    setNumber(stats, "Timeouts", commands.timeouts);
+    BtStallStats stalls[kBtPipeCount];
+    OSDictionary *pipes = OSDictionary::withCapacity(kBtPipeCount);
+    m_pTransport->getStallStats(stalls);
+    if (pipes) {
+        setStalls(pipes, "Interrupt", &stalls[kBtPipeInterrupt]);
+        setStalls(pipes, "BulkIn", &stalls[kBtPipeBulkIn]);
+        setStalls(pipes, "BulkOut", &stalls[kBtPipeBulkOut]);
+        stats->setObject("PipeStalls", pipes);
+        pipes->release();
+    }
+    setLatency(stats, "CommandRtt", &commands.control);
+    if (mSecureSendFragments) {
+        uint32_t hits, misses;
+        m_pTransport->getBulkBufferStats(&hits, &misses);
+        setNumber(secureSend, "Fragments", mSecureSendFragments);
+        setNumber(secureSend, "Bytes", mSecureSendBytes);
+        setNumber(secureSend, "Window", mSecureSendWindow);
+        setNumber(secureSend, "PeakInFlight", mSecureSendPeakInFlight);
+        setNumber(secureSend, "ElapsedUs", mSecureSendElapsedNs / 1000);
+        setNumber(secureSend, "BytesCopied", m_pTransport->bytesCopied() + mSecureSendDecodeCopied);
+        setNumber(secureSend, "DecodeBytesCopied", mSecureSendDecodeCopied);
+        setNumber(secureSend, "BulkBufferHits", hits);
+        setNumber(secureSend, "BulkBufferMisses", misses);
+        setNumber(secureSend, "Resumes", mSecureSendResumes);
+        setLatency(secureSend, "FragmentRtt", &commands.bulk);
+        stats->setObject("SecureSend", secureSend);
+    }
+    stats->setObject("Loaded", isSucceed ? kOSBooleanTrue : kOSBooleanFalse);
+    setProperty("FirmwareLoadStats", stats);
+    secureSend->release();
+    phases->release();
+    stats->release();
 }
 
 #include <IOKit/IOTypes.h>
@@ -719,36 +993,36 @@ typedef s16 __s16;
 typedef s32 __s32;
 typedef s64 __s64;
 
-#define le32_to_cpup __le32_to_cpup
-#define __force
-
-static inline __u32 __le32_to_cpup(const __le32 *p)
-{
-    return (__force __u32)*p;
-}
-
-static inline u32 get_unaligned_le32(const void *p)
-{
-    return le32_to_cpup((__le32 *)p);
-}
-
 void IntelBluetoothFirmware::beginDownloadNew()
 {
     mDeviceState = kNewGetVersion;
     boot_param = 0x00000000;
+    mSecureSendPeakInFlight = 0;
+    mSecureSendFragments = 0;
+    mSecureSendBytes = 0;
+    mSecureSendElapsedNs = 0;
+    mSecureSendResumes = 0;
+    mSecureSendDecodeCopied = 0;
+    mBootloaderResets = 0;
+    uint64_t stepStart;
     bool isSucceed = false;
     while (true) {
+        enterPhase(mDeviceState);
+        
         if (mDeviceState == kNewUpdateDone || mDeviceState == kNewUpdateAbort) {
             break;
         }
         
-        IOReturn ret;
+        IOReturn ret = kIOReturnSuccess;
         switch (mDeviceState) {
             case kNewGetVersion:
             {
-                XYLog("HCI_OP_INTEL_VERSION\n");
+                XYLogDebug("HCI_OP_INTEL_VERSION\n");
                 if ((ret = sendHCIRequest(HCI_OP_INTEL_VERSION, 0, NULL)) != kIOReturnSuccess) {
                     XYLog("Reading Intel version information failed, ret=%d\n %s", ret, stringFromReturn(ret));
+                    if (ret == kIOReturnTimeout) {
+                        break;
+                    }
                     goto done;
                     break;
                 }
@@ -756,9 +1030,12 @@ void IntelBluetoothFirmware::beginDownloadNew()
             }
             case kNewGetBootParams:
             {
-                XYLog("HCI_OP_BOOT_PARAMS\n");
+                XYLogDebug("HCI_OP_BOOT_PARAMS\n");
                 if ((ret = sendHCIRequest(HCI_OP_READ_INTEL_BOOT_PARAMS, 0, NULL)) != kIOReturnSuccess) {
                     XYLog("Reading Intel version boot params failed, ret=%d\n %s", ret, stringFromReturn(ret));
+                    if (ret == kIOReturnTimeout) {
+                        break;
+                    }
                     goto done;
                     break;
                 }
@@ -766,115 +1043,155 @@ void IntelBluetoothFirmware::beginDownloadNew()
             }
             case kNewLoadFW:
             {
-                uint8_t* fw = (uint8_t*)fwData->getBytesNoCopy();
                 /* Start the firmware download transaction with the Init fragment
-                 * represented by the 128 bytes of CSS header.
+                 * represented by the 128 bytes of CSS header, followed by the
+                 * PKey and Sign fragments and the command stream packed into
+                 * as few Data fragments as the alignment rules allow.
+                 */
+                /* Taken before the first fragment, the bootloader may be
+                 * done before the flush returns.
                  */
-                int err = 0;
-                XYLog("send firmware header\n");
-                uint8_t* fw_ptr = fw;
-                err = securedSend(0x00, 128, fw_ptr);
-                if (err < 0) {
-                    XYLog("Failed to send firmware header (%d)\n", err);
+                uint32_t downloadSeen = mCommands.vendorSequence(INTEL_EV_DOWNLOAD_DONE);
+                XYLogDebug("send firmware\n");
+                if (!waitFirmware()) {
                     goto done;
                 }
-                /* Send the 256 bytes of public key information from the firmware
-                 * as the PKey fragment.
-                 */
-                XYLog("send firmware pkey\n");
-                fw_ptr = fw + 128;
-                err = securedSend(0x03, 256, fw_ptr);
-                if (err < 0) {
-                    XYLog("Failed to send firmware pkey (%d)\n", err);
+                if (!fwReader.open(fwImage)) {
+                    XYLog("can not open firmware %s\n", fwImage.name());
                     goto done;
                 }
-                /* Send the 256 bytes of signature information from the firmware
-                 * as the Sign fragment.
+                /* A raw image is mapped in place, the transport sends its
+                 * bytes from there. Packed and delta images come out of
+                 * the reader's windows and are copied.
                  */
-                XYLog("send firmware signature\n");
-                fw_ptr = fw + 388;
-                err = securedSend(0x02, 256, fw_ptr);
-                if (err < 0) {
-                    XYLog("Failed to send firmware signature (%d)\n", err);
-                    goto done;
+                if (!fwImage.isPacked() && !fwImage.isDelta() &&
+                    !m_pTransport->mapImage(fwImage.bytes(), fwImage.length())) {
+                    XYLog("firmware %s is copied to the bulk pipe\n", fwImage.name());
                 }
-                fw_ptr = fw + 644;
-                uint32_t frag_len = 0;
-                XYLog("send firmware data\n");
-                while (fw_ptr - fw < fwData->getLength()) {
-                    FWCommandHdr *cmd = (FWCommandHdr *)(fw_ptr + frag_len);
-                    
-                    /* Each SKU has a different reset parameter to use in the
-                     * HCI_Intel_Reset command and it is embedded in the firmware
-                     * data. So, instead of using static value per SKU, check
-                     * the firmware data and save it for later use.
+                if (fwImage.planCount()) {
+                    /* Fragment boundaries and boot_param were worked out by
+                     * FwGenerator when the image was embedded, packed and
+                     * delta images are rebuilt as the plan walks them.
                      */
-                    if (cmd->opcode == 0xfc0e) {
-                        /* The boot parameter is the first 32-bit value
-                         * and rest of 3 octets are reserved.
-                         */
-                        boot_param = get_unaligned_le32(fw_ptr + sizeof(*cmd));
-                        
-                        XYLog("boot_param=0x%x\n", boot_param);
+                    for (int i = 0; i < fwImage.planCount(); i++) {
+                        const FwFragment *fragment = &fwImage.plan()[i];
+                        ret = securedSend(fragment->type, fragment->offset, fragment->length);
+                        if (ret != kIOReturnSuccess) {
+                            XYLog("Failed to send firmware fragment type %u at %u (%d)\n",
+                                  fragment->type, fragment->offset, ret);
+                            break;
+                        }
                     }
-                    
-                    frag_len += sizeof(*cmd) + cmd->plen;
-                    
-                    /* The parameter length of the secure send command requires
-                     * a 4 byte alignment. It happens so that the firmware file
-                     * contains proper Intel_NOP commands to align the fragments
-                     * as needed.
-                     *
-                     * Send set of commands with 4 byte alignment from the
-                     * firmware data buffer as a single Data fragement.
-                     */
-                    if (!(frag_len % 4)) {
-                        err = securedSend(0x01, frag_len, fw_ptr);
-                        if (err < 0) {
-                            XYLog("Failed to send firmware data (%d)\n",
-                                  err);
-                            goto done;
+                    if (ret == kIOReturnTimeout) {
+                        break;
+                    } else if (ret != kIOReturnSuccess) {
+                        goto done;
+                    }
+                    boot_param = fwImage.bootParam();
+                    XYLog("firmware sent in %d precomputed fragments, boot_param=0x%x\n", fwImage.planCount(), boot_param);
+                    if (fwImage.isDelta()) {
+                        XYLog("firmware rebuilt from a %u bytes delta against %s, %u blocks decoded, %llu us\n",
+                              fwImage.deltaLength(), fwImage.base().name(), fwReader.blocksDecoded(),
+                              (unsigned long long)(fwReader.readTimeNs() / 1000));
+                    } else if (fwImage.isPacked()) {
+                        XYLog("firmware decoded from %u to %u bytes in %u blocks, %llu us\n",
+                              fwImage.packedLength(), fwImage.length(), fwReader.blocksDecoded(),
+                              (unsigned long long)(fwReader.readTimeNs() / 1000));
+                    }
+                } else {
+                    const uint8_t* fw = fwReader.map(0, fwImage.length());
+                    if (!fw) {
+                        XYLog("Intel fw %s is packed without a fragment plan\n", fwImage.name());
+                        goto done;
+                    }
+                    FwFragmentPlanner planner(fw, fwImage.length());
+                    FwFragment fragment;
+                    /* The image is raw here, securedSend() maps it in place */
+                    while (planner.next(&fragment)) {
+                        ret = securedSend(fragment.type, fragment.offset, fragment.length);
+                        if (ret != kIOReturnSuccess) {
+                            XYLog("Failed to send firmware fragment type %u at %u (%d)\n",
+                                  fragment.type, fragment.offset, ret);
+                            break;
                         }
-                        
-                        fw_ptr += frag_len;
-                        frag_len = 0;
                     }
+                    if (ret == kIOReturnTimeout) {
+                        break;
+                    } else if (ret != kIOReturnSuccess) {
+                        goto done;
+                    }
+                    if (planner.isCorrupted()) {
+                        XYLog("Intel fw corrupted: invalid cmd at fragment %u\n", planner.fragmentCount());
+                        goto done;
+                    }
+                    boot_param = planner.bootParam();
+                    XYLog("firmware planned in %u fragments, boot_param=0x%x\n", planner.fragmentCount(), boot_param);
+                }
+                ret = securedSendFlush();
+                m_pTransport->unmapImage();
+                fwReader.close();
+                if (ret == kIOReturnTimeout) {
+                    break;
+                } else if (ret != kIOReturnSuccess) {
+                    XYLog("Failed to send firmware data (%d)\n", ret);
+                    goto done;
+                }
+                XYLogDebug("send firmware done\n");
+                /* The bootloader reports once it verified the image. It may
+                 * also report on the interrupt pipe we are not reading, so
+                 * missing it is not fatal, the boot notification decides.
+                 */
+                clock_get_uptime(&stepStart);
+                if (mCommands.waitVendorEvent(INTEL_EV_DOWNLOAD_DONE, downloadSeen, kDownloadDoneTimeout, kBtCommandBulk) == kIOReturnSuccess) {
+                    XYLog("firmware download done after %llu ms\n", (unsigned long long)elapsedMs(stepStart));
+                } else {
+                    XYLog("%s wait for firmware download done timeout\n", __FUNCTION__);
                 }
-                XYLog("send firmware done\n");
-                //here waiting for firmware download done notification
-//                isRequest = false;
                 mDeviceState = kNewIntelReset;
                 break;
             }
             case kNewIntelReset:
             {
-                XYLog("HCI_OP_INTEL_RESET\n");
-                IntelReset *params = (IntelReset *)INTEL_RESET_PARAM;
-                params->boot_param = USBToHost16(boot_param);
-                if ((ret = sendHCIRequest(HCI_OP_INTEL_RESET_BOOT, sizeof(IntelReset), (void *)INTEL_RESET_PARAM)) != kIOReturnSuccess) {
+                XYLogDebug("HCI_OP_INTEL_RESET\n");
+                IntelReset params;
+                memcpy(&params, INTEL_RESET_PARAM, sizeof(params));
+                params.boot_param = USBToHost16(boot_param);
+                /* Counted from before the reset goes out, the controller
+                 * may report its boot before we get around to waiting.
+                 */
+                uint32_t bootSeen = mCommands.vendorSequence(INTEL_EV_REBOOT_DONE);
+                clock_get_uptime(&stepStart);
+                if (!mCommands.submit(HCI_OP_INTEL_RESET_BOOT, sizeof(params), &params, 1, kBtCommandDetached)) {
+                    ret = kIOReturnError;
                     XYLog("Intel reset failed (%d) boot_param=%08x, %s\n", ret, boot_param, stringFromReturn(ret));
                     goto done;
                     break;
                 }
                 XYLog("Intel reset succeed\n");
-                AbsoluteTime deadline;
-                interruptPipeRead();
-                IOLockLock(completion);
-                clock_interval_to_deadline(5000, kMillisecondScale, reinterpret_cast<uint64_t*> (&deadline));
-                int ret = IOLockSleepDeadline(completion, this, deadline, THREAD_INTERRUPTIBLE);
-                IOLockUnlock(completion);
-                if (ret != THREAD_AWAKENED) {
-                    XYLog("%s wait for firmware download done timeout\n", __FUNCTION__);
+                /* Only the operational firmware telling us it booted says
+                 * the controller is ready for the event mask.
+                 */
+                if ((ret = mCommands.waitVendorEvent(INTEL_EV_REBOOT_DONE, bootSeen, kBootDoneTimeout)) != kIOReturnSuccess) {
+                    XYLog("%s wait for device reboot done failed (%d) %s\n", __FUNCTION__, ret, stringFromReturn(ret));
+                    if (ret == kIOReturnTimeout) {
+                        break;
+                    }
+                    goto done;
                 }
-                isRequest = true;
+                mBootLatency = (uint32_t)elapsedMs(stepStart);
+                setProperty("BootLatency", mBootLatency, 32);
+                XYLog("device booted in %u ms\n", mBootLatency);
                 mDeviceState = kNewSetEventMask;
                 break;
             }
             case kNewSetEventMask:
             {
-                XYLog("HCI_OP_INTEL_EVENT_MASK\n");
+                XYLogDebug("HCI_OP_INTEL_EVENT_MASK\n");
                 if ((ret = sendHCIRequest(HCI_OP_INTEL_EVENT_MASK, 8, (void *)EVENT_MASK)) != kIOReturnSuccess) {
                     XYLog("Setting Intel event mask failed (%d) %s\n", ret, stringFromReturn(ret));
+                    if (ret == kIOReturnTimeout) {
+                        break;
+                    }
                     goto done;
                     break;
                 }
@@ -884,9 +1201,13 @@ void IntelBluetoothFirmware::beginDownloadNew()
             }
             case kNewResetToBL:
             {
-                XYLog("HCI_OP_INTEL_RESET_BL\n");
-                if ((ret = sendHCIRequest(HCI_OP_INTEL_RESET_BOOT, sizeof(IntelReset), (void *)INTEL_RESET_BL_PARAM)) != kIOReturnSuccess) {
-                    XYLog("FW download error recovery failed (%ld), %s\n", ret, stringFromReturn(ret));
+                XYLogDebug("HCI_OP_INTEL_RESET_BL\n");
+                mRetries++;
+                mBootloaderResets++;
+                /* Nothing answers, the controller drops off the bus */
+                if (!mCommands.submit(HCI_OP_INTEL_RESET_BOOT, sizeof(IntelReset), (void *)INTEL_RESET_BL_PARAM, 0)) {
+                    ret = kIOReturnError;
+                    XYLog("FW download error recovery failed (%d), %s\n", ret, stringFromReturn(ret));
                     m_pDevice->reset();
                     goto done;
                     break;
@@ -901,73 +1222,256 @@ void IntelBluetoothFirmware::beginDownloadNew()
                 break;
         }
         
-        if (isRequest) {
-            if (!interruptPipeRead())
-            {
-                XYLog("hci read pipe fail. stop\n");
-                break;
-            }
-            XYLog("interrupt wait\n");
-            IOLockLock(completion);
-            AbsoluteTime deadline;
-            clock_interval_to_deadline(HCI_INIT_TIMEOUT, kMillisecondScale, reinterpret_cast<uint64_t*> (&deadline));
-            int ret = IOLockSleepDeadline(completion, this, deadline, THREAD_INTERRUPTIBLE);
-            IOLockUnlock(completion);
-            if (ret != THREAD_AWAKENED) {
-                XYLog("HCI Timeout, retry\n");
-                isSucceed = false;
-                mDeviceState = kNewResetToBL;
-            }
+        if (ret == kIOReturnTimeout) {
+            XYLog("HCI Timeout, retry\n");
+            isSucceed = false;
+            mDeviceState = kNewResetToBL;
         }
-        isRequest = false;
-        XYLog("interrupt continue\n");
     }
     
 done:
     
+    enterPhase(-1);
+    m_pTransport->unmapImage();
+    fwReader.close();
+    releaseFirmware();
     publishReg(isSucceed);
     
     XYLog("End download\n");
 }
 
-int IntelBluetoothFirmware::securedSend(uint8_t fragmentType, uint32_t plen, const uint8_t *p)
+/* Kicks off the request of an on demand image, it comes in while the
+ * controller is taken through the steps before the download.
+ */
+bool IntelBluetoothFirmware::requestFirmware()
+{
+    if (!fwImage.isResource()) {
+        return true;
+    }
+    char name[FW_CONTAINER_RESOURCE_NAME_LEN];
+    snprintf(name, sizeof(name), FW_CONTAINER_RESOURCE_FMT, fwImage.checksum());
+    ResourceCallbackContext *request = (ResourceCallbackContext *)IOMalloc(sizeof(ResourceCallbackContext));
+    if (!request) {
+        return false;
+    }
+    request->context = this;
+    request->resource = NULL;
+    /* Keeps us around until the callback, it fires even after stop() */
+    retain();
+    IOLockLock(completion);
+    fwRequest = request;
+    IOLockUnlock(completion);
+    OSKextRequestTag tag;
+    OSReturn ret = OSKextRequestResource(OSKextGetCurrentIdentifier(), name, onFirmwareResource, request, &tag);
+    if (ret != kOSReturnSuccess) {
+        XYLog("can not request firmware %s as %s (0x%x)\n", fwImage.name(), name, ret);
+        IOLockLock(completion);
+        fwRequest = NULL;
+        IOLockUnlock(completion);
+        IOFree(request, sizeof(ResourceCallbackContext));
+        release();
+        return false;
+    }
+    XYLog("requested firmware %s as %s\n", fwImage.name(), name);
+    return true;
+}
+
+void IntelBluetoothFirmware::onFirmwareResource(OSKextRequestTag requestTag, OSReturn result,
+                                                const void *resourceData, uint32_t resourceDataLength, void *context)
+{
+    ResourceCallbackContext *request = (ResourceCallbackContext *)context;
+    IntelBluetoothFirmware *that = request->context;
+    /* resourceData goes away once we return */
+    if (result == kOSReturnSuccess && resourceData) {
+        request->resource = OSData::withBytes(resourceData, resourceDataLength);
+    } else {
+        XYLog("firmware resource request failed (0x%x)\n", result);
+    }
+    IOLockLock(that->completion);
+    if (that->fwRequest == request) {
+        that->fwRequest = NULL;
+        that->fwResource = request->resource;
+        request->resource = NULL;
+    }
+    IOLockUnlock(that->completion);
+    IOLockWakeup(that->completion, &that->fwResource, false);
+    if (request->resource) {
+        request->resource->release();
+    }
+    IOFree(request, sizeof(ResourceCallbackContext));
+    that->release();
+}
+
+bool IntelBluetoothFirmware::waitFirmware()
+{
+    if (!fwImage.isResource() || fwImage.bytes()) {
+        return true;
+    }
+    IOLockLock(completion);
+    AbsoluteTime deadline;
+    clock_interval_to_deadline(kFirmwareResourceTimeout, kMillisecondScale, reinterpret_cast<uint64_t*> (&deadline));
+    while (fwRequest && !fwResource && !mStopping) {
+        if (IOLockSleepDeadline(completion, &fwResource, deadline, THREAD_INTERRUPTIBLE) != THREAD_AWAKENED) {
+            break;
+        }
+    }
+    OSData *resource = fwResource;
+    IOLockUnlock(completion);
+    if (!resource) {
+        XYLog("firmware %s did not arrive\n", fwImage.name());
+        return false;
+    }
+    FwView image = fwImage.withStream((const uint8_t *)resource->getBytesNoCopy(), resource->getLength());
+    if (!image.isValid()) {
+        XYLog("firmware resource of %s has %u bytes\n", fwImage.name(), resource->getLength());
+        return false;
+    }
+    /* Whatever sits in the kext's Resources is only trusted once it
+     * rebuilds into the image the container was made from.
+     */
+    bool verified = fwReader.open(image) && fwReader.verify();
+    fwReader.close();
+    if (!verified) {
+        XYLog("firmware resource of %s does not match its checksum %08x\n", fwImage.name(), fwImage.checksum());
+        return false;
+    }
+    fwImage = image;
+    XYLog("loaded firmware %s on demand, %u bytes resident\n", fwImage.name(), resource->getLength());
+    return true;
+}
+
+/* Drops the on demand image once the download is over, a request still in
+ * flight throws its data away when it comes in.
+ */
+void IntelBluetoothFirmware::releaseFirmware()
+{
+    IOLockLock(completion);
+    OSData *resource = fwResource;
+    fwResource = NULL;
+    fwRequest = NULL;
+    IOLockUnlock(completion);
+    if (fwImage.isValid() && fwImage.isResource()) {
+        fwImage.reset();
+    }
+    if (resource) {
+        XYLog("released firmware resource (%u bytes)\n", resource->getLength());
+        resource->release();
+    }
+}
+
+/* Sends plen bytes of the image at offset as secure send fragments */
+IOReturn IntelBluetoothFirmware::securedSend(uint8_t fragmentType, uint32_t offset, uint32_t plen)
 {
     while (plen > 0) {
-        uint8_t cmd_param[253], fragment_len = (plen > 252) ? 252 : plen;
-        
-        cmd_param[0] = fragmentType;
-        memcpy(cmd_param + 1, p, fragment_len);
+        uint8_t fragment_len = (plen > 252) ? 252 : plen;
         
-        uint8_t len = fragment_len + 1;
-        bzero(hciCommand, sizeof(HciCommandHdr));
-        hciCommand->opcode = 0xfc09;
-        hciCommand->plen = len;
-        memcpy((void *)hciCommand->pData, cmd_param, len);
-        if (bulkWrite((void *)hciCommand, len + HCI_COMMAND_HDR_SIZE)  != kIOReturnSuccess) {
-            return -1;
+        /* Keep at most mSecureSendWindow fragments waiting for their
+         * command complete, the engine matches the acks to them as they
+         * come back on bulk in.
+         */
+        IOReturn ret = waitSecureSend(mSecureSendWindow - 1);
+        if (ret != kIOReturnSuccess) {
+            XYLog("%s failed (%d) %s\n", __FUNCTION__, ret, stringFromReturn(ret));
+            return ret;
         }
         
-        bulkPipeRead();
-        IOLockLock(completion);
-        AbsoluteTime deadline;
-        clock_interval_to_deadline(HCI_INIT_TIMEOUT, kMillisecondScale, reinterpret_cast<uint64_t*> (&deadline));
-        int ret = IOLockSleepDeadline(completion, this, deadline, THREAD_INTERRUPTIBLE);
-        IOLockUnlock(completion);
-        if (ret != THREAD_AWAKENED) {
-            XYLog("%s timeout\n", __FUNCTION__);
-            return -1;
+        if ((ret = sendSecureFragment(fragmentType, offset, fragment_len)) != kIOReturnSuccess) {
+            return ret;
         }
         
         plen -= fragment_len;
-        p += fragment_len;
+        offset += fragment_len;
     }
     
-    return 1;
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothFirmware::sendSecureFragment(uint8_t fragmentType, uint32_t offset, uint8_t length)
+{
+    const uint8_t *data = fwReader.map(offset, length);
+    if (!data) {
+        XYLog("Failed to read firmware fragment at %u\n", offset);
+        return kIOReturnNoMemory;
+    }
+    if (mSecureSendFragments == 0) {
+        clock_get_uptime(&mSecureSendStartTime);
+    }
+    /* Only the fragment type goes ahead of the image bytes. The transport
+     * sends those of a mapped image from where they are and copies the
+     * rest, see BtTransport::mapImage().
+     */
+    if (!mCommands.submitGather(HCI_OP_INTEL_SECURE_SEND, &fragmentType, 1, data, length, 1,
+                                kBtCommandBulk | kBtCommandDetached)) {
+        return kIOReturnError;
+    }
+    uint32_t inFlight = mCommands.pending(HCI_OP_INTEL_SECURE_SEND);
+    XYTrace(&mTrace, kBtTraceFragment, fragmentType, length, inFlight, 0);
+    if (inFlight > mSecureSendPeakInFlight) {
+        mSecureSendPeakInFlight = inFlight;
+    }
+    mSecureSendFragments++;
+    mSecureSendBytes += length + 1 + HCI_COMMAND_HDR_SIZE;
+    return kIOReturnSuccess;
+}
+
+/* Waits until at most max fragments are unacknowledged, resuming the
+ * wait whenever the acks stop.
+ */
+IOReturn IntelBluetoothFirmware::waitSecureSend(uint32_t max)
+{
+    while (true) {
+        /* Backs off after every timeout until an ack comes in again */
+        uint32_t timeout = mCommands.timeout(kBtCommandBulk, kSecureSendMinAckTimeout, kSecureSendAckTimeout);
+        IOReturn ret = mCommands.waitPending(HCI_OP_INTEL_SECURE_SEND, max, timeout);
+        if (ret != kIOReturnTimeout || isStopping() || (ret = resumeSecureSend()) != kIOReturnSuccess) {
+            return ret;
+        }
+    }
+}
+
+/* Gives the fragments still unacknowledged another wait on a freshly
+ * posted read. None is sent again: the bootloader may already hold one
+ * whose ack got lost and takes no byte twice. Returns kIOReturnTimeout
+ * once out of resumes, which takes the state machine to kNewResetToBL and
+ * the image from the start.
+ */
+IOReturn IntelBluetoothFirmware::resumeSecureSend()
+{
+    if (mSecureSendResumes >= kSecureSendMaxResumes) {
+        XYLog("secure send stalled after %u resumes\n", mSecureSendResumes);
+        return kIOReturnTimeout;
+    }
+    uint32_t unacked = mCommands.pending(HCI_OP_INTEL_SECURE_SEND);
+    mSecureSendResumes++;
+    XYLog("secure send stalled, %u of %u fragments unacknowledged, waiting again\n", unacked, mSecureSendFragments);
+    XYTrace(&mTrace, kBtTraceResume, mSecureSendFragments - unacked, unacked, mSecureSendResumes, 0);
+    mCommands.rearm();
+    return kIOReturnSuccess;
+}
+
+IOReturn IntelBluetoothFirmware::securedSendFlush()
+{
+    IOReturn ret = waitSecureSend(0);
+    if (ret != kIOReturnSuccess) {
+        XYLog("%s failed (%d), %u fragments not acknowledged\n", __FUNCTION__, ret, mCommands.pending(HCI_OP_INTEL_SECURE_SEND));
+        return ret;
+    }
+    uint64_t now;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - mSecureSendStartTime, &mSecureSendElapsedNs);
+    uint64_t elapsedMs = mSecureSendElapsedNs / 1000000;
+    mSecureSendDecodeCopied = fwReader.bytesCopied();
+    XYLog("secure send %u fragments, %llu bytes in %llu ms, window %u, peak in flight %u, %llu bytes copied, "
+          "%llu of them decoding, %u resumes\n", mSecureSendFragments, (unsigned long long)mSecureSendBytes,
+          (unsigned long long)elapsedMs, mSecureSendWindow, mSecureSendPeakInFlight,
+          (unsigned long long)(m_pTransport->bytesCopied() + mSecureSendDecodeCopied),
+          (unsigned long long)mSecureSendDecodeCopied, mSecureSendResumes);
+    return kIOReturnSuccess;
 }
 
 void IntelBluetoothFirmware::onHCICommandSucceedNew(HciResponse *command, int length)
 {
-    BtIntel::printAllByte(command, length + HCI_COMMAND_HDR_SIZE);
+    BtIntel::printAllByte(command, length + HCI_EVENT_HDR_SIZE);
     switch (command->opcode) {
         case HCI_OP_INTEL_VERSION:
         {
@@ -1061,37 +1565,42 @@ void IntelBluetoothFirmware::onHCICommandSucceedNew(HciResponse *command, int le
                 mDeviceState = kNewUpdateAbort;
                 break;
             }
-            char fw_name[64];
-            int len = sizeof(fw_name);
+            uint16_t kind = kFwKeyNone;
+            uint64_t key = 0;
             switch (ver->hw_variant) {
                 case 0x0b:    /* SfP */
                 case 0x0c:    /* WsP */
-                    snprintf(fw_name, len, "ibt-%u-%u.sfi",
-                             ver->hw_variant,
-                             params->dev_revid);
+                    kind = kFwKeySfiRevId;
+                    key = FwKeySfiRevId(ver->hw_variant, USBToHost16(params->dev_revid));
                     break;
                 case 0x11:    /* JfP */
                 case 0x12:    /* ThP */
                 case 0x13:    /* HrP */
                 case 0x14:    /* CcP */
-                    snprintf(fw_name, len, "ibt-%u-%u-%u.sfi",
-                             ver->hw_variant,
-                             ver->hw_revision,
-                             ver->fw_revision);
+                    kind = kFwKeySfi;
+                    key = FwKeySfi(ver->hw_variant, ver->hw_revision, ver->fw_revision);
                     break;
                 default:
                     XYLog("Unsupported Intel firmware naming");
                     mDeviceState = kNewUpdateAbort;
                     break;
             }
-            if (!fwData) {
-                FwDesc desc = getFWDescByName(fw_name);
-                fwData = OSData::withBytes(desc.var, desc.size);
+            if (!fwImage.isValid() && kind != kFwKeyNone) {
+                fwImage = getFWImageByKey(kind, key);
+            }
+            if (!fwImage.isValid()) {
+                XYLog("No firmware for hw_variant %u (key 0x%llx)\n", ver->hw_variant, (unsigned long long)key);
+                mDeviceState = kNewUpdateAbort;
+                break;
             }
-            XYLog("Found device firmware: %s\n", fw_name);
-            if (fwData->getLength() < 644) {
-                XYLog("Invalid size of firmware file (%zu)\n",
-                      fwData->getLength());
+            XYLog("Found device firmware: %s\n", fwImage.name());
+            if (fwImage.length() < 644) {
+                XYLog("Invalid size of firmware file (%u)\n",
+                      fwImage.length());
+                mDeviceState = kNewUpdateAbort;
+                break;
+            }
+            if (!requestFirmware()) {
                 mDeviceState = kNewUpdateAbort;
                 break;
             }
@@ -1105,7 +1614,6 @@ void IntelBluetoothFirmware::onHCICommandSucceedNew(HciResponse *command, int le
         case HCI_OP_INTEL_EVENT_MASK:
             mDeviceState = kNewUpdateDone;
             break;
-            
         default:
             break;
     }
@@ -1120,6 +1628,7 @@ IOReturn IntelBluetoothFirmware::setPowerState(unsigned long powerStateOrdinal,
 void IntelBluetoothFirmware::stop(IOService *provider)
 {
     XYLog("Driver Stop()\n");
+    stopDownload();
     PMstop();
     super::stop(provider);
 }
@@ -1139,10 +1648,21 @@ IOService * IntelBluetoothFirmware::probe(IOService *provider, SInt32 *score)
     UInt16 vendorID = USBToHost16(m_pDevice->getDeviceDescriptor()->idVendor);
     UInt16 productID = USBToHost16(m_pDevice->getDeviceDescriptor()->idProduct);
     XYLog("name=%s, class=%s, vendorID=0x%04X, productID=0x%04X\n", m_pDevice->getName(), provider->metaClass->getClassName(), vendorID, productID);
-    if (productID == 0x07dc || productID == 0x0a2a || productID == 0x0aa7) {
-        currentType = kTypeOld;
-    } else {
-        currentType = kTypeNew;
+    currentType = kTypeNew;
+    for (size_t i = 0; i < sizeof(kDeviceTable) / sizeof(kDeviceTable[0]); i++) {
+        if (kDeviceTable[i].productID != productID) {
+            continue;
+        }
+        /* Slimmed builds leave controllers they carry no firmware for to
+         * whatever else matches them.
+         */
+        if (!hasFWVariant(kDeviceTable[i].variants[0]) && !hasFWVariant(kDeviceTable[i].variants[1])) {
+            XYLog("no firmware for productID=0x%04X in this build\n", productID);
+            m_pDevice = NULL;
+            return NULL;
+        }
+        currentType = kDeviceTable[i].type;
+        break;
     }
     m_pDevice = NULL;
     return this;
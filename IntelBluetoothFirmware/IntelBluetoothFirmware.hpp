@@ -11,6 +11,10 @@
 #include <IOKit/usb/IOUSBHostInterface.h>
 #include "Log.h"
 #include "FWData.h"
+#include "BtTransport.h"
+#include "BtCommand.h"
+#include "BtTrace.h"
+#include "FwReader.h"
 
 enum BTType {
     kTypeOld,
@@ -35,23 +39,39 @@ public:
     
     IOReturn setPowerState(unsigned long powerStateOrdinal, IOService *whatDevice) override;
     
+    IOReturn setProperties(OSObject *properties) override;
+    
     void cleanUp();
     
-    bool interruptPipeRead();
+    bool download();
+    
+    static void onDownload(thread_call_param_t param0, thread_call_param_t param1);
+    
+    bool isStopping();
+    
+    bool readyBackoff(uint64_t begin, uint32_t *delay);
+    
+    bool waitReady();
     
-    bool bulkPipeRead();
+    void stopDownload();
     
     void beginDownload();
     
     void beginDownloadNew();
     
-    IOReturn bulkWrite(const void *data, uint16_t length);
-    
-    static void onRead(void* owner, void* parameter, IOReturn status, uint32_t bytesTransferred);
+    static void onRead(void* owner, IOReturn status, const void *data, uint32_t length);
     
     IOReturn sendHCIRequest(uint16_t opCode, uint8_t paramLen, const void * param);
     
-    int securedSend(uint8_t fragmentType, uint32_t plen, const uint8_t *p);
+    bool sendPatchCommand(const FwPatchCommand *command, const uint8_t *param);
+    
+    IOReturn securedSend(uint8_t fragmentType, uint32_t offset, uint32_t plen);
+    
+    IOReturn waitSecureSend(uint32_t max);
+    
+    IOReturn resumeSecureSend();
+    
+    IOReturn securedSendFlush();
     
     void parseHCIResponse(void* response, UInt16 length, void* output, UInt8* outputLength);
     
@@ -63,38 +83,93 @@ public:
     
     bool initInterface();
     
+    /* The transport to the controller on m_pInterface, ready to post reads
+     * on and delivering them to onRead(). Host tests hand out a simulated
+     * controller here.
+     */
+    virtual BtTransport *createTransport();
+    
     void publishReg(bool isSucceed);
     
+    void enterPhase(int state);
+    
+    void publishStats(bool isSucceed, uint64_t downloadMs);
+    
+    IOReturn drainTrace();
+    
+    bool requestFirmware();
+    
+    bool waitFirmware();
+    
+    void releaseFirmware();
+    
+    static void onFirmwareResource(OSKextRequestTag requestTag, OSReturn result,
+                                   const void *resourceData, uint32_t resourceDataLength, void *context);
+    
 public:
     
     
     IOUSBHostDevice* m_pDevice;
     IOUSBHostInterface* m_pInterface;
-    IOUSBHostPipe* m_pInterruptReadPipe;
-    IOUSBHostPipe* m_pBulkWritePipe;
-    IOUSBHostPipe* m_pBulkReadPipe;
+    BtTransport* m_pTransport;
+    BtCommandEngine mCommands;
     
     IOLock* completion;
-    IOUSBHostCompletion usbCompletion;
     
     int mDeviceState;
     IntelVersion *ver;
     IntelBootParams *params;
     
-    IOBufferMemoryDescriptor* mReadBuffer;
-    
 private:
-    bool isRequest;
-    OSData *fwData;
+    FwView fwImage;
+    FwReader fwReader;
     char firmwareName[64];
-    HciCommandHdr *hciCommand;
+    /* Command complete of the last sendHCIRequest() */
+    uint8_t mResponse[BT_EVENT_MAX_LEN];
     struct ResourceCallbackContext
     {
         IntelBluetoothFirmware* context;
         OSData* resource;
     };
+    /* On demand firmware, both guarded by completion */
+    ResourceCallbackContext* fwRequest;
+    OSData* fwResource;
     BTType currentType;
+    /* Download thread call, mDownloadRunning and mStopping are guarded by
+     * completion.
+     */
+    thread_call_t mDownloadCall;
+    bool mDownloadRunning;
+    bool mStopping;
+    /* The readiness probe was an HCI_Reset and got answered */
+    bool mReadyReset;
+    uint64_t mDownloadStartTime;
     uint32_t boot_param;
+    
+    uint32_t mSecureSendWindow;
+    uint32_t mSecureSendPeakInFlight;
+    uint32_t mSecureSendFragments;
+    uint64_t mSecureSendBytes;
+    uint64_t mSecureSendStartTime;
+    uint64_t mSecureSendElapsedNs;
+    
+    IOReturn sendSecureFragment(uint8_t fragmentType, uint32_t offset, uint8_t length);
+    
+    uint32_t mSecureSendResumes;
+    uint64_t mSecureSendDecodeCopied;   /* by fwReader, the transport counts its own */
+    uint32_t mBootloaderResets;
+    
+    /* Timing of one firmware load, see publishStats() */
+    enum { kPhaseCount = 8 };
+    int mPhase;
+    uint64_t mPhaseStart;
+    uint64_t mPhaseUs[kPhaseCount];
+    uint32_t mReadyLatency;
+    uint32_t mBootLatency;
+    uint32_t mRetries;
+    
+    /* Binary records of the hot paths, drained by setting DrainTrace */
+    BtTrace mTrace;
 };
 
 #endif
@@ -11,10 +11,26 @@
 
 #include <IOKit/IOLib.h>
 
-#define XYLog(fmt, x...)\
+/* Compile time log level, set XY_LOG_LEVEL in the preprocessor
+ * definitions. Sites above it are compiled out.
+ */
+#define XY_LOG_NONE     0
+#define XY_LOG_INFO     1
+#define XY_LOG_DEBUG    2
+
+#ifndef XY_LOG_LEVEL
+#define XY_LOG_LEVEL XY_LOG_INFO
+#endif
+
+#define XYLogAt(level, fmt, x...)\
 do\
 {\
-IOLog("%s: " fmt, "IntelFirmware", ##x);\
+if ((level) <= XY_LOG_LEVEL) IOLog("%s: " fmt, "IntelFirmware", ##x);\
 }while(0)
 
+#define XYLog(fmt, x...) XYLogAt(XY_LOG_INFO, fmt, ##x)
+
+/* Once per command or state, the trace ring has the same in binary */
+#define XYLogDebug(fmt, x...) XYLogAt(XY_LOG_DEBUG, fmt, ##x)
+
 #endif /* Log_h */
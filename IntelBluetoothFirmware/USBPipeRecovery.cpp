@@ -0,0 +1,57 @@
+//
+//  USBPipeRecovery.cpp
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "USBPipeRecovery.h"
+#include "Log.h"
+
+USBPipeRecovery::USBPipeRecovery(const char *name)
+: mName(name)
+{
+    bzero(&mStats, sizeof(mStats));
+}
+
+IOReturn USBPipeRecovery::recover(IOUSBHostPipe *pipe)
+{
+    uint64_t begin, now, elapsedNs = 0;
+    uint32_t delay = USB_PIPE_RECOVERY_MIN_DELAY;
+    uint32_t attempts = 0;
+    IOReturn ret;
+
+    clock_get_uptime(&begin);
+    mStats.stalls++;
+    while (true) {
+        attempts++;
+        mStats.clears++;
+        ret = pipe->clearStall(true);
+        clock_get_uptime(&now);
+        absolutetime_to_nanoseconds(now - begin, &elapsedNs);
+        /* Nothing left to clear once the device is gone */
+        if (ret == kIOReturnSuccess || ret == kIOReturnNoDevice || ret == kIOReturnNotAttached || ret == kIOReturnAborted) {
+            break;
+        }
+        if (elapsedNs / 1000000 + delay > USB_PIPE_RECOVERY_BUDGET) {
+            break;
+        }
+        IOSleep(delay);
+        delay = delay * 2 < USB_PIPE_RECOVERY_MAX_DELAY ? delay * 2 : USB_PIPE_RECOVERY_MAX_DELAY;
+    }
+
+    uint32_t us = (uint32_t)(elapsedNs / 1000);
+    mStats.totalUs += us;
+    if (us > mStats.maxUs) {
+        mStats.maxUs = us;
+    }
+    if (ret == kIOReturnSuccess) {
+        mStats.recovered++;
+        XYLog("%s pipe stall cleared after %u attempts, %u us\n", mName, attempts, us);
+    } else {
+        mStats.failed++;
+        XYLog("%s pipe stall not cleared after %u attempts, %u us (0x%08x)\n", mName, attempts, us, ret);
+    }
+    return ret;
+}
@@ -0,0 +1,46 @@
+//
+//  USBPipeRecovery.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef USBPipeRecovery_h
+#define USBPipeRecovery_h
+
+#include <IOKit/IOLib.h>
+#include <IOKit/usb/IOUSBHostInterface.h>
+#include "BtTransport.h"
+
+/* Time one stall may take to clear and the delays between attempts, in ms */
+#define USB_PIPE_RECOVERY_BUDGET        200
+#define USB_PIPE_RECOVERY_MIN_DELAY     1
+#define USB_PIPE_RECOVERY_MAX_DELAY     32
+
+/* Clears the stall of one pipe, retrying with exponential backoff until
+ * it cleared or the budget is spent, and counts how that went. The
+ * transport keeps one per endpoint.
+ */
+class USBPipeRecovery {
+
+public:
+
+    USBPipeRecovery(const char *name);
+
+    /* Returns kIOReturnSuccess once the halt is cleared, the error of the
+     * last attempt otherwise. Sleeps between attempts, so never call it
+     * from a USB completion.
+     */
+    IOReturn recover(IOUSBHostPipe *pipe);
+
+    const BtStallStats &stats() const { return mStats; }
+
+    const char *name() const { return mName; }
+
+private:
+    const char *mName;
+    BtStallStats mStats;
+};
+
+#endif /* USBPipeRecovery_h */
@@ -0,0 +1,396 @@
+//
+//  USBTransport.cpp
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#include "USBTransport.h"
+#include <IOKit/usb/StandardUSB.h>
+#include "Log.h"
+
+#define kReadBufferSize 4096
+/* Largest HCI command, header included */
+#define kBulkBufferSize 258
+
+USBTransport::USBTransport(IOService *client, IOUSBHostInterface *interface)
+: m_pClient(client), m_pInterface(interface), m_pInterruptReadPipe(NULL),
+m_pBulkWritePipe(NULL), m_pBulkReadPipe(NULL), mReadBuffer(NULL), mReadPipe(NULL),
+mInterruptRecovery("interrupt"), mBulkReadRecovery("bulk in"), mBulkWriteRecovery("bulk out"),
+mRecoverCall(NULL), mRecoverLock(NULL), mStalledPipe(NULL), mStalledRecovery(NULL), mStallSequence(0),
+mBulkBuffer(NULL), mBulkBufferBusy(false), mBulkBufferHits(0), mBulkBufferMisses(0),
+mImageBytes(NULL), mImageLength(0), mImageBuffer(NULL), mHeaderRange(NULL), mDataRange(NULL), mGather(NULL)
+{
+    usbCompletion.owner = this;
+    usbCompletion.action = onRead;
+    usbCompletion.parameter = NULL;
+}
+
+USBTransport::~USBTransport()
+{
+    abort();
+    unmapImage();
+    if (mRecoverCall) {
+        thread_call_cancel_wait(mRecoverCall);
+        thread_call_free(mRecoverCall);
+        mRecoverCall = NULL;
+    }
+    if (mRecoverLock) {
+        IOLockFree(mRecoverLock);
+        mRecoverLock = NULL;
+    }
+    OSSafeReleaseNULL(m_pBulkWritePipe);
+    OSSafeReleaseNULL(m_pBulkReadPipe);
+    OSSafeReleaseNULL(m_pInterruptReadPipe);
+    if (mReadBuffer) {
+        mReadBuffer->complete(kIODirectionIn);
+        OSSafeReleaseNULL(mReadBuffer);
+    }
+    if (mBulkBuffer) {
+        mBulkBuffer->complete(kIODirectionOut);
+        OSSafeReleaseNULL(mBulkBuffer);
+    }
+    usbCompletion.owner = NULL;
+    usbCompletion.action = NULL;
+}
+
+bool USBTransport::init()
+{
+    mRecoverLock = IOLockAlloc();
+    mRecoverCall = thread_call_allocate(onRecover, this);
+    if (!mRecoverLock || !mRecoverCall) {
+        XYLog("fail to alloc stall recovery\n");
+        return false;
+    }
+    mReadBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionIn, kReadBufferSize);
+    if (!mReadBuffer) {
+        XYLog("fail to alloc read buffer\n");
+        return false;
+    }
+    mReadBuffer->prepare(kIODirectionIn);
+    /* Wired once here instead of a descriptor per secure send fragment */
+    mBulkBuffer = IOBufferMemoryDescriptor::inTaskWithOptions(kernel_task, kIODirectionOut, kBulkBufferSize);
+    if (!mBulkBuffer) {
+        XYLog("fail to alloc bulk buffer\n");
+        return false;
+    }
+    mBulkBuffer->prepare(kIODirectionOut);
+
+    const StandardUSB::ConfigurationDescriptor *configDescriptor = m_pInterface->getConfigurationDescriptor();
+    const StandardUSB::InterfaceDescriptor *interfaceDescriptor = m_pInterface->getInterfaceDescriptor();
+    if (configDescriptor == NULL || interfaceDescriptor == NULL) {
+        XYLog("find descriptor NULL\n");
+        return false;
+    }
+    const EndpointDescriptor *endpointDescriptor = NULL;
+    while ((endpointDescriptor = StandardUSB::getNextEndpointDescriptor(configDescriptor, interfaceDescriptor, endpointDescriptor))) {
+        uint8_t epDirection = StandardUSB::getEndpointDirection(endpointDescriptor);
+        uint8_t epType = StandardUSB::getEndpointType(endpointDescriptor);
+        if (epDirection == kUSBIn && epType == kUSBInterrupt) {
+            XYLog("Found Interrupt endpoint!\n");
+            m_pInterruptReadPipe = m_pInterface->copyPipe(StandardUSB::getEndpointAddress(endpointDescriptor));
+            if (m_pInterruptReadPipe == NULL) {
+                XYLog("copy InterruptReadPipe pipe fail\n");
+                return false;
+            }
+        } else {
+            if (epDirection == kUSBOut && epType == kUSBBulk) {
+                XYLog("Found Bulk out endpoint!\n");
+                m_pBulkWritePipe = m_pInterface->copyPipe(StandardUSB::getEndpointAddress(endpointDescriptor));
+                if (m_pBulkWritePipe == NULL) {
+                    XYLog("copy Bulk pipe fail\n");
+                    return false;
+                }
+            } else {
+                if (epDirection == kUSBIn && epType == kUSBBulk) {
+                    XYLog("Found Bulk in endpoint!\n");
+                    m_pBulkReadPipe = m_pInterface->copyPipe(StandardUSB::getEndpointAddress(endpointDescriptor));
+                    if (m_pBulkReadPipe == NULL) {
+                        XYLog("copy Bulk pipe fail\n");
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return m_pInterruptReadPipe != NULL && m_pBulkWritePipe != NULL;
+}
+
+void USBTransport::abort()
+{
+    cancelRecovery(NULL);
+    if (m_pBulkWritePipe) {
+        m_pBulkWritePipe->abort();
+    }
+    if (m_pBulkReadPipe) {
+        m_pBulkReadPipe->abort();
+    }
+    if (m_pInterruptReadPipe) {
+        m_pInterruptReadPipe->abort();
+    }
+}
+
+void USBTransport::abortRead(bool bulk)
+{
+    IOUSBHostPipe *pipe = bulk ? m_pBulkReadPipe : m_pInterruptReadPipe;
+    if (pipe && !cancelRecovery(pipe)) {
+        pipe->abort();
+    }
+}
+
+bool USBTransport::cancelRecovery(IOUSBHostPipe *pipe)
+{
+    if (!mRecoverLock) {
+        return false;
+    }
+    IOLockLock(mRecoverLock);
+    bool cancel = mStalledPipe && (!pipe || mStalledPipe == pipe);
+    if (cancel) {
+        mStalledPipe = NULL;
+        mStallSequence++;
+    }
+    IOLockUnlock(mRecoverLock);
+    if (cancel) {
+        /* One still clearing the halt sees the sequence moved on */
+        thread_call_cancel(mRecoverCall);
+        notifyRead(kIOReturnAborted, NULL, 0);
+    }
+    return cancel;
+}
+
+IOReturn USBTransport::sendHCICommand(const void *command, uint16_t length)
+{
+    StandardUSB::DeviceRequest request =
+    {
+        .bmRequestType = makeDeviceRequestbmRequestType(kRequestDirectionOut, kRequestTypeClass, kRequestRecipientDevice),
+        .bRequest = 0,
+        .wValue = 0,
+        .wIndex = 0,
+        .wLength = length
+    };
+    uint32_t bytesTransfered;
+    return m_pInterface->deviceRequest(request, (void *)command, bytesTransfered);
+}
+
+uint8_t *USBTransport::acquireBulkBuffer(uint16_t length)
+{
+    if (length > kBulkBufferSize || mBulkBufferBusy) {
+        return NULL;
+    }
+    mBulkBufferBusy = true;
+    return (uint8_t *)mBulkBuffer->getBytesNoCopy();
+}
+
+void USBTransport::getBulkBufferStats(uint32_t *hits, uint32_t *misses)
+{
+    *hits = mBulkBufferHits;
+    *misses = mBulkBufferMisses;
+}
+
+bool USBTransport::mapImage(const void *bytes, uint32_t length)
+{
+    IOReturn ret;
+    unmapImage();
+    mImageBuffer = IOMemoryDescriptor::withAddress((void *)bytes, length, kIODirectionOut);
+    if (!mImageBuffer) {
+        XYLog("Unable to allocate the image descriptor.\n");
+        return false;
+    }
+    if ((ret = mImageBuffer->prepare(kIODirectionOut)) != kIOReturnSuccess) {
+        XYLog("Failed to prepare the image, %s\n", m_pClient->stringFromReturn(ret));
+        OSSafeReleaseNULL(mImageBuffer);
+        return false;
+    }
+    mImageBytes = (const uint8_t *)bytes;
+    mImageLength = length;
+    mHeaderRange = IOSubMemoryDescriptor::withSubRange(mBulkBuffer, 0, kBulkBufferSize, kIODirectionOut);
+    mDataRange = IOSubMemoryDescriptor::withSubRange(mImageBuffer, 0, length, kIODirectionOut);
+    if (mHeaderRange && mDataRange) {
+        mGatherRanges[0] = mHeaderRange;
+        mGatherRanges[1] = mDataRange;
+        mGather = IOMultiMemoryDescriptor::withDescriptors(mGatherRanges, 2, kIODirectionOut, true);
+    }
+    if (!mGather) {
+        XYLog("Unable to allocate the image write descriptors.\n");
+        unmapImage();
+        return false;
+    }
+    return true;
+}
+
+void USBTransport::unmapImage()
+{
+    OSSafeReleaseNULL(mGather);
+    OSSafeReleaseNULL(mDataRange);
+    OSSafeReleaseNULL(mHeaderRange);
+    if (mImageBuffer) {
+        mImageBuffer->complete(kIODirectionOut);
+        OSSafeReleaseNULL(mImageBuffer);
+    }
+    mImageBytes = NULL;
+    mImageLength = 0;
+}
+
+IOReturn USBTransport::bulkWriteGather(const void *header, uint16_t headerLength, const void *data, uint16_t dataLength)
+{
+    IOReturn ret;
+    const uint8_t *bytes = (const uint8_t *)data;
+    if (!mGather || bytes < mImageBytes || dataLength > mImageLength || bytes - mImageBytes > mImageLength - dataLength) {
+        return BtTransport::bulkWriteGather(header, headerLength, data, dataLength);
+    }
+    uint8_t *buffer = acquireBulkBuffer(headerLength);
+    if (!buffer) {
+        return BtTransport::bulkWriteGather(header, headerLength, data, dataLength);
+    }
+    /* Only the header is copied, the image bytes go out from where they are */
+    memcpy(buffer, header, headerLength);
+    if (!mHeaderRange->initSubRange(mBulkBuffer, 0, headerLength, kIODirectionOut) ||
+        !mDataRange->initSubRange(mImageBuffer, bytes - mImageBytes, dataLength, kIODirectionOut) ||
+        !mGather->initWithDescriptors(mGatherRanges, 2, kIODirectionOut, true)) {
+        XYLog("Failed to point the image write descriptors at %ld\n", (long)(bytes - mImageBytes));
+        mBulkBufferBusy = false;
+        return kIOReturnError;
+    }
+    mBulkBufferHits++;
+    if ((ret = mGather->prepare(kIODirectionOut)) == kIOReturnSuccess) {
+        ret = writeBulkBuffer(mGather, headerLength + dataLength);
+        mGather->complete(kIODirectionOut);
+    } else {
+        XYLog("Failed to prepare the image write, %s\n", m_pClient->stringFromReturn(ret));
+    }
+    mBulkBufferBusy = false;
+    return ret;
+}
+
+IOReturn USBTransport::writeBulkBuffer(IOMemoryDescriptor *buffer, uint16_t length)
+{
+    IOReturn ret;
+    ret = m_pBulkWritePipe->io(buffer, length, (IOUSBHostCompletion*)NULL, 0);
+    if (ret == kIOUSBPipeStalled && mBulkWriteRecovery.recover(m_pBulkWritePipe) == kIOReturnSuccess) {
+        ret = m_pBulkWritePipe->io(buffer, length, (IOUSBHostCompletion*)NULL, 0);
+    }
+    if (ret != kIOReturnSuccess) {
+        XYLog("Failed to write to bulk pipe, %s\n", m_pClient->stringFromReturn(ret));
+    }
+    return ret;
+}
+
+IOReturn USBTransport::bulkWrite(const void *data, uint16_t length)
+{
+    IOReturn ret;
+    uint8_t *bytes = (uint8_t *)mBulkBuffer->getBytesNoCopy();
+    bool wired = mBulkBufferBusy && data == bytes;
+    if (!wired && acquireBulkBuffer(length)) {
+        /* Copied into the wired buffer, still cheaper than wiring */
+        memcpy(bytes, data, length);
+        mBytesCopied += length;
+        wired = true;
+    }
+    if (wired) {
+        mBulkBufferHits++;
+        ret = writeBulkBuffer(mBulkBuffer, length);
+        mBulkBufferBusy = false;
+        return ret;
+    }
+    mBulkBufferMisses++;
+    IOMemoryDescriptor* buffer = IOMemoryDescriptor::withAddress((void*)data, length, kIODirectionOut);
+    if (!buffer) {
+        XYLog("Unable to allocate bulk write buffer.\n");
+        return kIOReturnNoMemory;
+    }
+    if ((ret = buffer->prepare(kIODirectionOut)) != kIOReturnSuccess) {
+        XYLog("Failed to prepare bulk write memory buffer, %s\n", m_pClient->stringFromReturn(ret));
+        buffer->release();
+        return ret;
+    }
+    ret = writeBulkBuffer(buffer, length);
+    IOReturn completeRet = buffer->complete(kIODirectionOut);
+    if (completeRet != kIOReturnSuccess) {
+        XYLog("Failed to complete bulk write memory buffer, %s\n", m_pClient->stringFromReturn(completeRet));
+        if (ret == kIOReturnSuccess) {
+            ret = completeRet;
+        }
+    }
+    buffer->release();
+    return ret;
+}
+
+bool USBTransport::interruptRead()
+{
+    return postRead(m_pInterruptReadPipe, &mInterruptRecovery);
+}
+
+bool USBTransport::bulkRead()
+{
+    return postRead(m_pBulkReadPipe, &mBulkReadRecovery);
+}
+
+bool USBTransport::postRead(IOUSBHostPipe *pipe, USBPipeRecovery *recovery)
+{
+    if (!pipe) {
+        return false;
+    }
+    mReadPipe = pipe;
+    IOReturn result = pipe->io(mReadBuffer, (uint32_t)mReadBuffer->getLength(), &usbCompletion, 0);
+    if (result != kIOUSBPipeStalled) {
+        return result == kIOReturnSuccess;
+    }
+    XYLog("%s pipe stalled, clearing it off the completion path\n", recovery->name());
+    IOLockLock(mRecoverLock);
+    mStalledPipe = pipe;
+    mStalledRecovery = recovery;
+    mStallSequence++;
+    IOLockUnlock(mRecoverLock);
+    thread_call_enter(mRecoverCall);
+    return true;
+}
+
+void USBTransport::onRecover(thread_call_param_t param0, thread_call_param_t param1)
+{
+    USBTransport *that = (USBTransport *)param0;
+
+    IOLockLock(that->mRecoverLock);
+    IOUSBHostPipe *pipe = that->mStalledPipe;
+    USBPipeRecovery *recovery = that->mStalledRecovery;
+    uint32_t sequence = that->mStallSequence;
+    IOLockUnlock(that->mRecoverLock);
+    if (!pipe) {
+        return;
+    }
+    IOReturn ret = recovery->recover(pipe);
+
+    IOLockLock(that->mRecoverLock);
+    bool current = that->mStalledPipe == pipe && that->mStallSequence == sequence;
+    if (current) {
+        that->mStalledPipe = NULL;
+        if (ret == kIOReturnSuccess) {
+            ret = pipe->io(that->mReadBuffer, (uint32_t)that->mReadBuffer->getLength(), &that->usbCompletion, 0);
+        }
+    }
+    IOLockUnlock(that->mRecoverLock);
+    /* A cancelled read was already reported, the posted one completes as usual */
+    if (current && ret != kIOReturnSuccess) {
+        that->notifyRead(ret, NULL, 0);
+    }
+}
+
+void USBTransport::getStallStats(BtStallStats *stats)
+{
+    stats[kBtPipeInterrupt] = mInterruptRecovery.stats();
+    stats[kBtPipeBulkIn] = mBulkReadRecovery.stats();
+    stats[kBtPipeBulkOut] = mBulkWriteRecovery.stats();
+}
+
+void USBTransport::onRead(void *owner, void *parameter, IOReturn status, uint32_t bytesTransferred)
+{
+    USBTransport* that = (USBTransport*)owner;
+
+    if (status == kIOReturnNotResponding) {
+        XYLog("%s not responding\n", __FUNCTION__);
+        if (that->mReadPipe) {
+            that->mReadPipe->clearStall(false);
+        }
+    }
+    that->notifyRead(status, that->mReadBuffer->getBytesNoCopy(), bytesTransferred);
+}
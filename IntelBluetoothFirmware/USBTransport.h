@@ -0,0 +1,113 @@
+//
+//  USBTransport.h
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+
+#ifndef USBTransport_h
+#define USBTransport_h
+
+#include <IOKit/IOLib.h>
+#include <IOKit/IOLocks.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IOMultiMemoryDescriptor.h>
+#include <IOKit/IOSubMemoryDescriptor.h>
+#include <IOKit/usb/IOUSBHostInterface.h>
+#include "BtTransport.h"
+#include "USBPipeRecovery.h"
+
+class USBTransport : public BtTransport {
+
+public:
+
+    USBTransport(IOService *client, IOUSBHostInterface *interface);
+
+    ~USBTransport() override;
+
+    bool init();
+
+    IOReturn sendHCICommand(const void *command, uint16_t length) override;
+
+    IOReturn bulkWrite(const void *data, uint16_t length) override;
+
+    uint8_t *acquireBulkBuffer(uint16_t length) override;
+
+    void getBulkBufferStats(uint32_t *hits, uint32_t *misses) override;
+
+    bool mapImage(const void *bytes, uint32_t length) override;
+
+    void unmapImage() override;
+
+    IOReturn bulkWriteGather(const void *header, uint16_t headerLength, const void *data, uint16_t dataLength) override;
+
+    bool interruptRead() override;
+
+    bool bulkRead() override;
+
+    void abort() override;
+
+    void abortRead(bool bulk) override;
+
+    void getStallStats(BtStallStats *stats) override;
+
+private:
+
+    static void onRead(void* owner, void* parameter, IOReturn status, uint32_t bytesTransferred);
+
+    /* Posts the read on pipe. A pipe that stalled is cleared on
+     * mRecoverCall and the read posted from there, postRead() may run in
+     * the completion of the last read and must not sleep.
+     */
+    bool postRead(IOUSBHostPipe *pipe, USBPipeRecovery *recovery);
+
+    static void onRecover(thread_call_param_t param0, thread_call_param_t param1);
+
+    /* Drops the recovery of pipe, or any pipe if NULL, returns whether
+     * there was one. Its read completes with kIOReturnAborted.
+     */
+    bool cancelRecovery(IOUSBHostPipe *pipe);
+
+    IOReturn writeBulkBuffer(IOMemoryDescriptor *buffer, uint16_t length);
+
+private:
+    IOService *m_pClient;
+    IOUSBHostInterface *m_pInterface;
+    IOUSBHostPipe *m_pInterruptReadPipe;
+    IOUSBHostPipe *m_pBulkWritePipe;
+    IOUSBHostPipe *m_pBulkReadPipe;
+    IOBufferMemoryDescriptor *mReadBuffer;
+    IOUSBHostCompletion usbCompletion;
+    IOUSBHostPipe *mReadPipe;       /* of the read posted last */
+    USBPipeRecovery mInterruptRecovery;
+    USBPipeRecovery mBulkReadRecovery;
+    USBPipeRecovery mBulkWriteRecovery;
+    thread_call_t mRecoverCall;
+    IOLock *mRecoverLock;
+    IOUSBHostPipe *mStalledPipe;    /* read waiting for its stall to clear */
+    USBPipeRecovery *mStalledRecovery;
+    uint32_t mStallSequence;        /* tells a recovery it was cancelled */
+    /* Bulk writes are synchronous, one at a time, so one wired buffer
+     * serves all of them. Held from acquireBulkBuffer() until the write
+     * returns.
+     */
+    IOBufferMemoryDescriptor *mBulkBuffer;
+    bool mBulkBufferBusy;
+    uint32_t mBulkBufferHits;
+    uint32_t mBulkBufferMisses;
+    /* The image wired once by mapImage(). Each write out of it retargets
+     * mHeaderRange to the header in mBulkBuffer and mDataRange to the
+     * fragment, and sends both through mGather, nothing is allocated per
+     * fragment.
+     */
+    const uint8_t *mImageBytes;
+    uint32_t mImageLength;
+    IOMemoryDescriptor *mImageBuffer;
+    IOSubMemoryDescriptor *mHeaderRange;
+    IOSubMemoryDescriptor *mDataRange;
+    IOMemoryDescriptor *mGatherRanges[2];
+    IOMultiMemoryDescriptor *mGather;
+};
+
+#endif /* USBTransport_h */
@@ -0,0 +1,169 @@
+//
+//  TraceDecoder.cpp
+//  IntelBluetoothFirmware
+//
+//  Created by agent on 2026/10/16.
+//  Copyright © 2026 agent. All rights reserved.
+//
+//  Host tool that prints the Trace property of the driver, see BtTrace.h.
+//  Takes the raw property or the output of
+//  ioreg -a -r -c IntelBluetoothFirmware, from a file or stdin:
+//
+//  c++ -std=c++11 -O2 -IIntelBluetoothFirmware -o TraceDecoder TraceDecoder/TraceDecoder.cpp
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "BtTraceFormat.h"
+
+struct EventFormat {
+    const char *name;
+    const char *args[4];
+};
+
+/* Indexed by event, the argument names follow BtTraceFormat.h */
+static const EventFormat kEvents[kBtTraceEventCount] = {
+    { "?",          { NULL } },
+    { "state",      { "new", "state" } },
+    { "submit",     { "opcode", "length", "flags", "token" } },
+    { "complete",   { "opcode", "status", "us", "token" } },
+    { "timeout",    { "opcode", "token", "ms" } },
+    { "read",       { "bulk" } },
+    { "event",      { "status", "length", "evt", "bulk" } },
+    { "vendor",     { "code", "count" } },
+    { "fragment",   { "type", "length", "inflight" } },
+    { "download",   { "succeeded", "ms" } },
+    { "resume",     { "acked", "unacked", "resumes" } },
+};
+
+static bool readAll(FILE *file, std::vector<uint8_t> &out)
+{
+    uint8_t buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        out.insert(out.end(), buffer, buffer + n);
+    }
+    return !ferror(file);
+}
+
+static int base64Value(char c)
+{
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+/* Pulls the Trace data out of an ioreg plist, nothing else of it is read */
+static bool extractPlist(const std::vector<uint8_t> &input, std::vector<uint8_t> &out)
+{
+    std::string text(input.begin(), input.end());
+    size_t key = text.find("<key>Trace</key>");
+    if (key == std::string::npos) {
+        return false;
+    }
+    size_t begin = text.find("<data>", key);
+    size_t end = text.find("</data>", begin);
+    if (begin == std::string::npos || end == std::string::npos) {
+        return false;
+    }
+    uint32_t bits = 0;
+    int count = 0;
+    for (size_t i = begin + 6; i < end; i++) {
+        int value = base64Value(text[i]);
+        if (value < 0) {
+            continue;
+        }
+        bits = (bits << 6) | value;
+        if (++count == 4) {
+            out.push_back(bits >> 16);
+            out.push_back(bits >> 8);
+            out.push_back(bits);
+            bits = 0;
+            count = 0;
+        }
+    }
+    if (count == 3) {
+        out.push_back(bits >> 10);
+        out.push_back(bits >> 2);
+    } else if (count == 2) {
+        out.push_back(bits >> 4);
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *file = stdin;
+    std::vector<uint8_t> input, trace;
+
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [trace or ioreg plist]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 2 && !(file = fopen(argv[1], "rb"))) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (!readAll(file, input)) {
+        perror("read");
+        return 1;
+    }
+    if (file != stdin) {
+        fclose(file);
+    }
+
+    BtTraceHeader header;
+    if (input.size() >= sizeof(header) && memcpy(&header, input.data(), sizeof(header)) && header.magic == BT_TRACE_MAGIC) {
+        trace.swap(input);
+    } else if (!extractPlist(input, trace)) {
+        fprintf(stderr, "no trace found\n");
+        return 1;
+    }
+    if (trace.size() < sizeof(header)) {
+        fprintf(stderr, "trace truncated\n");
+        return 1;
+    }
+    memcpy(&header, trace.data(), sizeof(header));
+    if (header.magic != BT_TRACE_MAGIC || header.version != BT_TRACE_VERSION ||
+        header.recordSize != sizeof(BtTraceRecord) || !header.ticksPerSecond) {
+        fprintf(stderr, "unsupported trace, magic 0x%08x version %u\n", header.magic, header.version);
+        return 1;
+    }
+    if ((trace.size() - sizeof(header)) / sizeof(BtTraceRecord) < header.count) {
+        fprintf(stderr, "trace truncated, %u records expected\n", header.count);
+        return 1;
+    }
+    printf("%u records, %u dropped\n", header.count, header.dropped);
+
+    const BtTraceRecord *records = (const BtTraceRecord *)(trace.data() + sizeof(header));
+    uint64_t first = header.count ? records[0].time : 0;
+    uint64_t previous = first;
+    for (uint32_t i = 0; i < header.count; i++) {
+        const BtTraceRecord &r = records[i];
+        double at = (double)(r.time - first) * 1e6 / header.ticksPerSecond;
+        double delta = (double)(r.time - previous) * 1e6 / header.ticksPerSecond;
+        previous = r.time;
+        printf("%10u %14.3f %+12.3f  ", r.sequence, at, delta);
+        if (!r.event || r.event >= kBtTraceEventCount) {
+            printf("event%u 0x%x 0x%x 0x%x 0x%x\n", r.event, r.args[0], r.args[1], r.args[2], r.args[3]);
+            continue;
+        }
+        const EventFormat &format = kEvents[r.event];
+        printf("%-9s", format.name);
+        for (int a = 0; a < 4 && format.args[a]; a++) {
+            if (!strcmp(format.args[a], "opcode") || !strcmp(format.args[a], "status")) {
+                printf(" %s=0x%x", format.args[a], r.args[a]);
+            } else {
+                printf(" %s=%u", format.args[a], r.args[a]);
+            }
+        }
+        printf("\n");
+    }
+    return 0;
+}
@@ -6,36 +6,71 @@
 #  Created by qcwap on 2020/2/26.
 #  Copyright © 2020 钟先耀. All rights reserved.
 
-target_file="${PROJECT_DIR}/IntelBluetoothFirmware/FwBinary.cpp"
+target_file="${PROJECT_DIR}/IntelBluetoothFirmware/FwPayload.bin"
+payload_asm="${PROJECT_DIR}/IntelBluetoothFirmware/FwPayload.S"
 fw_files=${PROJECT_DIR}/IntelBluetoothFirmware/fw/*.*
+generator_dir="${TARGET_TEMP_DIR:-${TMPDIR:-/tmp}}"
+generator="${generator_dir}/FwGenerator"
+# Images are stored LZ packed and decoded block by block while they are
+# downloaded, set FW_COMPRESS=0 to embed them raw. Close siblings are
+# stored as deltas against each other unless FW_DELTA=0.
+generator_flags=""
+if [ "${FW_COMPRESS:-1}" != "0" ]; then
+    generator_flags="-z"
+fi
+# FW_VARIANTS="0x12 0x14" builds a kext that only carries the firmware of
+# those hw_variant values, probe() passes on every other controller.
+variants=$(echo "${FW_VARIANTS}" | tr ' ' ',')
+if [ -n "$variants" ]; then
+    generator_flags="$generator_flags -v $variants"
+fi
+# FW_ON_DEMAND=1 keeps only the index in the kext and ships every image
+# as a resource of the bundle, the driver requests the one it needs.
+resource_dir=""
+set --
+if [ "${FW_ON_DEMAND:-0}" != "0" ]; then
+    resource_dir="${BUILT_PRODUCTS_DIR}/IntelBluetoothFirmware.kext/Contents/Resources"
+    set -- -r "$resource_dir"
+elif [ "${FW_DELTA:-1}" != "0" ]; then
+    generator_flags="$generator_flags -d"
+fi
 
-rm -rf $target_file
+mkdir -p "$generator_dir"
+if [ -n "$resource_dir" ]; then
+    mkdir -p "$resource_dir" && rm -f "$resource_dir"/ibt-*.fw || exit 1
+fi
+# The generator is only rebuilt when one of its sources is newer
+generator_sources="${PROJECT_DIR}/FwGenerator/FwGenerator.cpp \
+    ${PROJECT_DIR}/FwGenerator/FwLzEncoder.cpp \
+    ${PROJECT_DIR}/FwGenerator/FwDeltaEncoder.cpp \
+    ${PROJECT_DIR}/IntelBluetoothFirmware/FwPlan.cpp \
+    ${PROJECT_DIR}/IntelBluetoothFirmware/FwLz.cpp \
+    ${PROJECT_DIR}/IntelBluetoothFirmware/FwDelta.cpp"
+generator_headers="${PROJECT_DIR}/FwGenerator/*.h \
+    ${PROJECT_DIR}/IntelBluetoothFirmware/FWData.h \
+    ${PROJECT_DIR}/IntelBluetoothFirmware/FwKey.h \
+    ${PROJECT_DIR}/IntelBluetoothFirmware/FwContainer.h \
+    ${PROJECT_DIR}/IntelBluetoothFirmware/FwPlan.h \
+    ${PROJECT_DIR}/IntelBluetoothFirmware/FwLz.h \
+    ${PROJECT_DIR}/IntelBluetoothFirmware/FwDelta.h"
+stale=1
+if [ -x "$generator" ]; then
+    stale=0
+    for source in $generator_sources $generator_headers; do
+        if [ "$source" -nt "$generator" ]; then
+            stale=1
+            break
+        fi
+    done
+fi
+if [ "$stale" = "1" ]; then
+    ${CXX_FOR_BUILD:-c++} -std=c++11 -O2 -o "$generator" \
+        -I"${PROJECT_DIR}/IntelBluetoothFirmware" $generator_sources || exit 1
+fi
 
-echo "//  IntelBluetoothFirmware\n\n//  Copyright © 2020 钟先耀. All rights reserved." >$target_file
-echo "#include \"FwData.h\"">>$target_file
+rm -f "$target_file" "$payload_asm"
 
-for fw in $fw_files; do
-    fw_file_name=`basename $fw`
-    fw_var_name=${fw_file_name//./_}
-    fw_var_name=${fw_var_name//-/_}
-    echo "">>$target_file
-    echo "const unsigned char ${fw_var_name}[] = {">>$target_file
-    xxd -i <$fw >>$target_file
-    echo "};">>$target_file
-    echo "">>$target_file
-    echo "const long int ${fw_var_name}_size = sizeof(${fw_var_name});">>$target_file
-done
-
-echo "">>$target_file
-
-echo "const struct FwDesc fwList[] = {">>$target_file
-i=0;
-for fw in $fw_files; do
-    fw_file_name=`basename $fw`
-    fw_var_name=${fw_file_name//./_}
-    fw_var_name=${fw_var_name//-/_}
-    echo "{IBT_FW(\"$fw_file_name\", $fw_var_name, ${fw_var_name}_size)},">>$target_file
-    let i+=1
-done
-echo "};">>$target_file
-echo "const int fwNumber = $i;">>$target_file
+"$generator" $generator_flags "$@" -o "$target_file" -s "$payload_asm" $fw_files || {
+    rm -f "$target_file" "$payload_asm"
+    exit 1
+}